@@ -0,0 +1,127 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RGBDSLAM_BOUNDED_QUEUE_H_
+#define RGBDSLAM_BOUNDED_QUEUE_H_
+#include <deque>
+#include <string>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+
+//!What to do if an item is pushed into a full BoundedQueue
+enum BackpressurePolicy {
+  BLOCK,       ///<Wait until the consumer made room
+  DROP_OLDEST, ///<Evict the item at the front of the queue
+  DROP_NEWEST  ///<Reject the pushed item
+};
+
+///Parse "block", "drop_oldest" or "drop_newest". Unknown strings yield BLOCK.
+inline BackpressurePolicy backpressurePolicyFromString(const std::string& name){
+  if(name == "drop_oldest") return DROP_OLDEST;
+  if(name == "drop_newest") return DROP_NEWEST;
+  return BLOCK;
+}
+
+//!Thread-safe FIFO with a maximum size, used to connect the stages of the frame pipeline
+/** Producers call push(), which applies the backpressure policy if the queue is full.
+ *  Consumers call pop(), which blocks until an item is available or the queue is closed.
+ *  Items that are discarded by the policy are handed back to the caller, so that
+ *  owning pointers can be deleted there.
+ */
+template <class T>
+class BoundedQueue {
+public:
+  BoundedQueue(unsigned int capacity = 1, BackpressurePolicy policy = BLOCK)
+  : capacity_(capacity > 0 ? capacity : 1), policy_(policy), closed_(false), dropped_(0) {}
+
+  void configure(unsigned int capacity, BackpressurePolicy policy){
+    QMutexLocker locker(&mutex_);
+    capacity_ = capacity > 0 ? capacity : 1;
+    policy_ = policy;
+  }
+
+  ///Returns false if an item was discarded. In this case it is stored in "dropped"
+  ///(either the pushed item or the evicted oldest one, depending on the policy)
+  bool push(const T& item, T& dropped){
+    QMutexLocker locker(&mutex_);
+    if(queue_.size() >= capacity_ && !closed_){
+      if(policy_ == DROP_NEWEST){
+        dropped = item; ++dropped_;
+        return false;
+      }
+      else if(policy_ == DROP_OLDEST){
+        dropped = queue_.front(); ++dropped_;
+        queue_.pop_front();
+        queue_.push_back(item);
+        not_empty_.wakeOne();
+        return false;
+      }
+      while(queue_.size() >= capacity_ && !closed_){
+        not_full_.wait(&mutex_);
+      }
+    }
+    if(closed_){
+      dropped = item; ++dropped_;
+      return false;
+    }
+    queue_.push_back(item);
+    not_empty_.wakeOne();
+    return true;
+  }
+
+  ///Blocks until an item is available. Returns false if the queue has been closed and is empty
+  bool pop(T& item){
+    QMutexLocker locker(&mutex_);
+    while(queue_.empty() && !closed_){
+      not_empty_.wait(&mutex_);
+    }
+    if(queue_.empty()) return false;
+    item = queue_.front();
+    queue_.pop_front();
+    not_full_.wakeOne();
+    return true;
+  }
+
+  ///Wake up all waiting threads. Subsequent pushes are rejected, pops drain the remaining items
+  void close(){
+    QMutexLocker locker(&mutex_);
+    closed_ = true;
+    not_empty_.wakeAll();
+    not_full_.wakeAll();
+  }
+
+  size_t size() {
+    QMutexLocker locker(&mutex_);
+    return queue_.size();
+  }
+  ///Number of items discarded by the backpressure policy so far
+  unsigned int droppedCount() {
+    QMutexLocker locker(&mutex_);
+    return dropped_;
+  }
+
+private:
+  std::deque<T> queue_;
+  size_t capacity_;
+  BackpressurePolicy policy_;
+  bool closed_;
+  unsigned int dropped_;
+  QMutex mutex_;
+  QWaitCondition not_empty_;
+  QWaitCondition not_full_;
+};
+
+#endif
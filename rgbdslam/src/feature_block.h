@@ -0,0 +1,91 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RGBD_SLAM_FEATURE_BLOCK_H_
+#define RGBD_SLAM_FEATURE_BLOCK_H_
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <opencv2/features2d/features2d.hpp>
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include "misc2.h"
+
+//!Structure-of-arrays copy of the feature data that is read in the inner loops of RANSAC
+/** Filled once, when the features of a node are final. Node::feature_locations_2d_ and
+ *  Node::feature_locations_3d_ stay the interface for everything else. The descriptors are
+ *  a packed matrix already (feature_descriptors_ or quantized_descriptors_) and are not duplicated.
+ */
+struct FeatureBlock {
+  std::vector<float> x, y, z;       ///<Position relative to the camera. z is NaN if the depth is unknown
+  std::vector<float> u, v;          ///<Position in the image
+  std::vector<double> depth_cov;    ///<featureDepthCovariance(z), as used by errorFunction2
+  std::vector<float> cov_x, cov_y, cov_z; ///<Diagonal of the feature covariance in errorFunction2 (lateral, lateral, depth_cov)
+  std::vector<float> ray_x, ray_y;  ///<Viewing ray in normalized image coordinates (z = 1). NaN if neither depth nor intrinsics are known
+
+  void assign(const std::vector<cv::KeyPoint>& locations_2d,
+              const std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> >& locations_3d)
+  {
+    const size_t count = locations_3d.size();
+    x.resize(count); y.resize(count); z.resize(count);
+    u.resize(count); v.resize(count);
+    depth_cov.resize(count);
+    cov_x.resize(count); cov_y.resize(count); cov_z.resize(count);
+    ray_x.resize(count); ray_y.resize(count);
+    for(size_t i = 0; i < count; i++){
+      x[i] = locations_3d[i](0);
+      y[i] = locations_3d[i](1);
+      z[i] = locations_3d[i](2);
+      u[i] = locations_2d[i].pt.x;
+      v[i] = locations_2d[i].pt.y;
+      depth_cov[i] = featureDepthCovariance(z[i]);
+      cov_x[i] = rasterCovarianceX() * z[i];
+      cov_y[i] = rasterCovarianceY() * z[i];
+      cov_z[i] = depth_cov[i];
+      ray_x[i] = z[i] > 0 ? x[i] / z[i] : std::numeric_limits<float>::quiet_NaN();
+      ray_y[i] = z[i] > 0 ? y[i] / z[i] : std::numeric_limits<float>::quiet_NaN();
+    }
+  }
+  ///Compute the viewing rays from u,v, s.t. they are known for features without depth, too.
+  ///inv_fx and inv_fy are the inverse focal lengths, as in Node::projectTo3D
+  void assignViewingRays(float cx, float cy, float inv_fx, float inv_fy)
+  {
+    for(size_t i = 0; i < size(); i++){
+      ray_x[i] = (u[i] - cx) * inv_fx;
+      ray_y[i] = (v[i] - cy) * inv_fy;
+    }
+  }
+
+  size_t size() const { return z.size(); }
+  bool hasDepth(int i) const { return !std::isnan(z[i]); }
+  Eigen::Vector3f position3(int i) const { return Eigen::Vector3f(x[i], y[i], z[i]); }
+  ///Homogeneous position, as in Node::feature_locations_3d_
+  Eigen::Vector4f position(int i) const { return Eigen::Vector4f(x[i], y[i], z[i], 1.0f); }
+
+  void clear()
+  {
+    std::vector<float>().swap(x); std::vector<float>().swap(y); std::vector<float>().swap(z);
+    std::vector<float>().swap(u); std::vector<float>().swap(v);
+    std::vector<double>().swap(depth_cov);
+    std::vector<float>().swap(cov_x); std::vector<float>().swap(cov_y); std::vector<float>().swap(cov_z);
+    std::vector<float>().swap(ray_x); std::vector<float>().swap(ray_y);
+  }
+  size_t memoryFootprint() const
+  {
+    return size() * (10 * sizeof(float) + sizeof(double));
+  }
+};
+
+#endif
@@ -0,0 +1,623 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "feature_matching.h"
+#include "scoped_timer.h"
+#include <ros/console.h>
+#include <limits>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <cstring>
+#include <stdint.h>
+#if defined __AVX__ || defined __AVX2__
+#include <immintrin.h>
+#elif defined __SSE__
+#include <xmmintrin.h>
+#endif
+
+///Popcount of a ^ b. Uses the nibble lookup table method (Mula) with AVX2 for 32 byte blocks, if available
+static inline unsigned int hamming(const unsigned char* a, const unsigned char* b, int bytes)
+{
+  unsigned int dist = 0;
+  int i = 0;
+#ifdef __AVX2__
+  if(bytes >= 32){
+    const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                            0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    for(; i + 32 <= bytes; i += 32){
+      __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a+i)),
+                                   _mm256_loadu_si256((const __m256i*)(b+i)));
+      __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(x, low_mask));
+      __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask));
+      acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    uint64_t partial[4];
+    _mm256_storeu_si256((__m256i*)partial, acc);
+    dist = partial[0] + partial[1] + partial[2] + partial[3];
+  }
+#endif
+  for(; i + 8 <= bytes; i += 8){
+    uint64_t x, y;
+    std::memcpy(&x, a+i, 8);
+    std::memcpy(&y, b+i, 8);
+    dist += __builtin_popcountll(x ^ y);
+  }
+  for(; i < bytes; i++){
+    dist += __builtin_popcount(a[i] ^ b[i]);
+  }
+  return dist;
+}
+
+unsigned int hammingDistance(const unsigned char* a, const unsigned char* b, int bytes)
+{
+  return hamming(a, b, bytes);
+}
+
+///Two nearest train descriptors of each query descriptor, for a distance functor dist(query_idx, train_idx).
+///On equal distances the lower train index is preferred, as in cv::BFMatcher
+template <class DistanceT, class DistanceFunctor>
+static void findTwoNearest(int query_count, int train_count, const DistanceFunctor& dist,
+                           std::vector<int>& best_idx, std::vector<DistanceT>& best_dist, std::vector<DistanceT>& second_dist)
+{
+  best_idx.assign(query_count, -1);
+  best_dist.resize(query_count);
+  second_dist.resize(query_count);
+  #pragma omp parallel for schedule(static)
+  for(int q = 0; q < query_count; q++){
+    DistanceT d1 = std::numeric_limits<DistanceT>::max(), d2 = d1;
+    int i1 = -1;
+    for(int t = 0; t < train_count; t++){
+      DistanceT d = dist(q, t);
+      if(d < d2){
+        if(d < d1){ d2 = d1; d1 = d; i1 = t; }
+        else { d2 = d; }
+      }
+    }
+    best_idx[q] = i1;
+    best_dist[q] = d1;
+    second_dist[q] = d2;
+  }
+}
+
+///As findTwoNearest, but query q is only compared to candidates[q]. Queries with less than two candidates get index -1
+template <class DistanceT, class DistanceFunctor>
+static void findTwoNearestAmong(const std::vector<std::vector<int> >& candidates, const DistanceFunctor& dist,
+                                std::vector<int>& best_idx, std::vector<DistanceT>& best_dist, std::vector<DistanceT>& second_dist)
+{
+  const int query_count = candidates.size();
+  best_idx.assign(query_count, -1);
+  best_dist.resize(query_count);
+  second_dist.resize(query_count);
+  #pragma omp parallel for schedule(dynamic, 64)
+  for(int q = 0; q < query_count; q++){
+    DistanceT d1 = std::numeric_limits<DistanceT>::max(), d2 = d1;
+    int i1 = -1;
+    const std::vector<int>& cand = candidates[q];
+    for(unsigned int c = 0; c < cand.size(); c++){
+      const int t = cand[c];
+      DistanceT d = dist(q, t);
+      if(d < d2){
+        if(d < d1 || (d == d1 && t < i1)){ d2 = d1; d1 = d; i1 = t; }
+        else { d2 = d; }
+      }
+    }
+    best_idx[q] = cand.size() < 2 ? -1 : i1;
+    best_dist[q] = d1;
+    second_dist[q] = d2;
+  }
+}
+
+///As findTwoNearest, for several train sets with train_counts[s] descriptors each, in one pass over the queries.
+///The distance functor is called as dist(s, query_idx, train_idx). The results are indexed [s][query_idx]
+template <class DistanceT, class DistanceFunctor>
+static void findTwoNearestPerSet(int query_count, const std::vector<int>& train_counts, const DistanceFunctor& dist,
+                                 std::vector<std::vector<int> >& best_idx, 
+                                 std::vector<std::vector<DistanceT> >& best_dist, 
+                                 std::vector<std::vector<DistanceT> >& second_dist)
+{
+  const int sets = train_counts.size();
+  best_idx.assign(sets, std::vector<int>(query_count, -1));
+  best_dist.assign(sets, std::vector<DistanceT>(query_count));
+  second_dist.assign(sets, std::vector<DistanceT>(query_count));
+  #pragma omp parallel for schedule(static)
+  for(int q = 0; q < query_count; q++){
+    for(int s = 0; s < sets; s++){
+      DistanceT d1 = std::numeric_limits<DistanceT>::max(), d2 = d1;
+      int i1 = -1;
+      for(int t = 0; t < train_counts[s]; t++){
+        DistanceT d = dist(s, q, t);
+        if(d < d2){
+          if(d < d1){ d2 = d1; d1 = d; i1 = t; }
+          else { d2 = d; }
+        }
+      }
+      best_idx[s][q] = train_counts[s] < 2 ? -1 : i1;
+      best_dist[s][q] = d1;
+      second_dist[s][q] = d2;
+    }
+  }
+}
+
+///Ratio test and uniqueness of the train descriptors. Sequentially, s.t. the earliest query descriptor claims 
+///a train descriptor. The distances are converted by to_metric before the ratio is computed
+///train_used marks the claimed train descriptors across calls. Query indices are offset by query_offset
+template <class DistanceT, class MetricFunctor>
+static double selectDistinctiveMatches(const std::vector<int>& best_idx, 
+                                       const std::vector<DistanceT>& best_dist, const std::vector<DistanceT>& second_dist,
+                                       const MetricFunctor& to_metric, float max_dist_ratio, int query_offset,
+                                       std::vector<bool>& train_used, std::vector<cv::DMatch>& matches)
+{
+  double sum_distances = 0.0;
+  for(unsigned int q = 0; q < best_idx.size(); q++){
+    if(best_idx[q] < 0) continue; //no candidates
+    float best = to_metric(best_dist[q]), second = to_metric(second_dist[q]);
+    if(second == 0) continue; //ratio undefined
+    float dist_ratio_fac = best / second;
+    if(!(dist_ratio_fac < max_dist_ratio)) continue;
+    int train_idx = best_idx[q];
+    if(train_used[train_idx]) continue;
+    train_used[train_idx] = true;
+    sum_distances += best;
+    matches.push_back(cv::DMatch(q + query_offset, train_idx, dist_ratio_fac));
+  }
+  return sum_distances;
+}
+
+template <class DistanceT, class MetricFunctor>
+static double selectDistinctiveMatches(int train_count, const std::vector<int>& best_idx, 
+                                       const std::vector<DistanceT>& best_dist, const std::vector<DistanceT>& second_dist,
+                                       const MetricFunctor& to_metric, float max_dist_ratio, std::vector<cv::DMatch>& matches)
+{
+  std::vector<bool> train_used(train_count, false);
+  return selectDistinctiveMatches(best_idx, best_dist, second_dist, to_metric, max_dist_ratio, 0, train_used, matches);
+}
+
+struct BinaryDistance {
+  BinaryDistance(const cv::Mat& q, const cv::Mat& t) : query(q), train(t) {}
+  unsigned int operator()(int q, int t) const { 
+    return hamming(query.ptr<unsigned char>(q), train.ptr<unsigned char>(t), query.cols); 
+  }
+  const cv::Mat& query;
+  const cv::Mat& train;
+};
+
+struct Identity {
+  float operator()(unsigned int d) const { return (float)d; }
+};
+
+double matchBinaryDescriptors(const cv::Mat& query, const cv::Mat& train, float max_dist_ratio, std::vector<cv::DMatch>& matches)
+{
+  ScopedTimer s(__FUNCTION__);
+  if(query.type() != CV_8UC1 || train.type() != CV_8UC1 || query.cols != train.cols){
+    ROS_ERROR("Binary descriptor matching requires CV_8UC1 descriptors of equal length");
+    return 0.0;
+  }
+  if(train.rows < 2) return 0.0; //No ratio test possible
+
+  std::vector<int> best_idx;
+  std::vector<unsigned int> best_dist, second_dist;
+  findTwoNearest(query.rows, train.rows, BinaryDistance(query, train), best_idx, best_dist, second_dist);
+  return selectDistinctiveMatches(train.rows, best_idx, best_dist, second_dist, Identity(), max_dist_ratio, matches);
+}
+
+void QuantizedDescriptors::quantize(const cv::Mat& descriptors)
+{
+  assert(descriptors.type() == CV_32FC1);
+  data.create(descriptors.rows, descriptors.cols, CV_8SC1);
+  scales.resize(descriptors.rows);
+  squared_norms.resize(descriptors.rows);
+  for(int i = 0; i < descriptors.rows; i++){
+    const float* in = descriptors.ptr<float>(i);
+    signed char* out = data.ptr<signed char>(i);
+    float max_abs = 0.0f;
+    for(int j = 0; j < descriptors.cols; j++){
+      max_abs = std::max(max_abs, std::fabs(in[j]));
+    }
+    float scale = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+    float inv_scale = 1.0f / scale;
+    int squared_norm = 0;
+    for(int j = 0; j < descriptors.cols; j++){
+      int v = cvRound(in[j] * inv_scale);
+      out[j] = (signed char)v;
+      squared_norm += v * v;
+    }
+    scales[i] = scale;
+    squared_norms[i] = squared_norm;
+  }
+}
+
+void QuantizedDescriptors::dequantize(cv::Mat& descriptors) const
+{
+  descriptors.create(data.rows, data.cols, CV_32FC1);
+  for(int i = 0; i < data.rows; i++){
+    const signed char* in = data.ptr<signed char>(i);
+    float* out = descriptors.ptr<float>(i);
+    for(int j = 0; j < data.cols; j++){
+      out[j] = in[j] * scales[i];
+    }
+  }
+}
+
+void QuantizedDescriptors::release()
+{
+  data.release();
+  std::vector<float>().swap(scales);
+  std::vector<int>().swap(squared_norms);
+}
+
+size_t QuantizedDescriptors::memoryFootprint() const
+{
+  return data.step * data.rows + scales.size() * sizeof(float) + squared_norms.size() * sizeof(int);
+}
+
+///Dot product of two int8 vectors. With AVX2, 16 components are widened to int16 and multiply-added per step
+static inline int dotProduct(const signed char* a, const signed char* b, int length)
+{
+  int dot = 0;
+  int i = 0;
+#ifdef __AVX2__
+  if(length >= 16){
+    __m256i acc = _mm256_setzero_si256();
+    for(; i + 16 <= length; i += 16){
+      __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a+i)));
+      __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b+i)));
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    int partial[8];
+    _mm256_storeu_si256((__m256i*)partial, acc);
+    for(int k = 0; k < 8; k++) dot += partial[k];
+  }
+#endif
+  for(; i < length; i++){
+    dot += a[i] * b[i];
+  }
+  return dot;
+}
+
+///Squared L2 distance of two float vectors. With AVX (SSE) 8 (4) components per step
+static inline float squaredL2(const float* a, const float* b, int length)
+{
+  float sum = 0.0f;
+  int j = 0;
+#if defined __AVX__
+  if(length >= 8){
+    __m256 acc = _mm256_setzero_ps();
+    for(; j + 8 <= length; j += 8){
+      __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a+j), _mm256_loadu_ps(b+j));
+#ifdef __FMA__
+      acc = _mm256_fmadd_ps(d, d, acc);
+#else
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+#endif
+    }
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    sum = _mm_cvtss_f32(half);
+  }
+#elif defined __SSE__
+  if(length >= 4){
+    __m128 acc = _mm_setzero_ps();
+    for(; j + 4 <= length; j += 4){
+      __m128 d = _mm_sub_ps(_mm_loadu_ps(a+j), _mm_loadu_ps(b+j));
+      acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+    }
+    acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+    acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+    sum = _mm_cvtss_f32(acc);
+  }
+#endif
+  for(; j < length; j++){
+    const float d = a[j] - b[j];
+    sum += d * d;
+  }
+  return sum;
+}
+
+float quantizedSquaredDistance(const QuantizedDescriptors& a, int idx_a, const QuantizedDescriptors& b, int idx_b)
+{
+  float sa = a.scales[idx_a], sb = b.scales[idx_b];
+  int dot = dotProduct(a.data.ptr<signed char>(idx_a), b.data.ptr<signed char>(idx_b), a.data.cols);
+  float squared = sa*sa*a.squared_norms[idx_a] + sb*sb*b.squared_norms[idx_b] - 2.0f*sa*sb*dot;
+  return squared > 0.0f ? squared : 0.0f; //rounding
+}
+
+struct QuantizedDistance {
+  QuantizedDistance(const QuantizedDescriptors& q, const QuantizedDescriptors& t) : query(q), train(t) {}
+  float operator()(int q, int t) const { return quantizedSquaredDistance(query, q, train, t); }
+  const QuantizedDescriptors& query;
+  const QuantizedDescriptors& train;
+};
+
+struct SquareRoot {
+  float operator()(float squared) const { return std::sqrt(squared); }
+};
+
+double matchQuantizedDescriptors(const QuantizedDescriptors& query, const QuantizedDescriptors& train, float max_dist_ratio, std::vector<cv::DMatch>& matches)
+{
+  ScopedTimer s(__FUNCTION__);
+  if(query.data.cols != train.data.cols){
+    ROS_ERROR("Quantized descriptor matching requires descriptors of equal length");
+    return 0.0;
+  }
+  if(train.rows() < 2) return 0.0; //No ratio test possible
+
+  std::vector<int> best_idx;
+  std::vector<float> best_dist, second_dist; //squared
+  findTwoNearest(query.rows(), train.rows(), QuantizedDistance(query, train), best_idx, best_dist, second_dist);
+  return selectDistinctiveMatches(train.rows(), best_idx, best_dist, second_dist, SquareRoot(), max_dist_ratio, matches);
+}
+
+void FeatureGrid::build(const std::vector<float>& x, const std::vector<float>& y, float cell_size)
+{
+  assert(x.size() == y.size());
+  x_ = x; y_ = y;
+  cell_size_ = cell_size > 0.0f ? cell_size : 1.0f;
+  float max_x = -std::numeric_limits<float>::max(), max_y = max_x;
+  min_x_ = min_y_ = std::numeric_limits<float>::max();
+  for(unsigned int i = 0; i < x.size(); i++){
+    if(std::isnan(x[i]) || std::isnan(y[i])) continue;
+    min_x_ = std::min(min_x_, x[i]); max_x = std::max(max_x, x[i]);
+    min_y_ = std::min(min_y_, y[i]); max_y = std::max(max_y, y[i]);
+  }
+  if(min_x_ > max_x){ //no valid points
+    cols_ = rows_ = 0;
+    cell_start_.assign(1, 0);
+    indices_.clear();
+    return;
+  }
+  //Limit the number of cells for sparse, far spread points
+  const int max_cells_per_axis = 256;
+  cell_size_ = std::max(cell_size_, std::max(max_x - min_x_, max_y - min_y_) / max_cells_per_axis);
+  cols_ = (int)((max_x - min_x_) / cell_size_) + 1;
+  rows_ = (int)((max_y - min_y_) / cell_size_) + 1;
+
+  //Counting sort of the points by cell
+  std::vector<int> cell_of(x.size(), -1);
+  cell_start_.assign(cols_ * rows_ + 1, 0);
+  for(unsigned int i = 0; i < x.size(); i++){
+    if(std::isnan(x[i]) || std::isnan(y[i])) continue;
+    int col = std::min(cols_-1, (int)((x[i] - min_x_) / cell_size_));
+    int row = std::min(rows_-1, (int)((y[i] - min_y_) / cell_size_));
+    cell_of[i] = row * cols_ + col;
+    cell_start_[cell_of[i] + 1]++;
+  }
+  for(unsigned int c = 1; c < cell_start_.size(); c++){
+    cell_start_[c] += cell_start_[c-1];
+  }
+  indices_.resize(cell_start_.back());
+  std::vector<int> fill(cell_start_.begin(), cell_start_.end() - 1);
+  for(unsigned int i = 0; i < x.size(); i++){
+    if(cell_of[i] >= 0) indices_[fill[cell_of[i]]++] = i;
+  }
+}
+
+void FeatureGrid::radiusSearch(float x, float y, float radius, std::vector<int>& result) const
+{
+  if(cols_ == 0 || std::isnan(x) || std::isnan(y)) return;
+  int col_begin = std::max(0, (int)std::floor((x - radius - min_x_) / cell_size_));
+  int col_end   = std::min(cols_-1, (int)std::floor((x + radius - min_x_) / cell_size_));
+  int row_begin = std::max(0, (int)std::floor((y - radius - min_y_) / cell_size_));
+  int row_end   = std::min(rows_-1, (int)std::floor((y + radius - min_y_) / cell_size_));
+  const float squared_radius = radius * radius;
+  for(int row = row_begin; row <= row_end; row++){
+    for(int col = col_begin; col <= col_end; col++){
+      const int cell = row * cols_ + col;
+      for(int k = cell_start_[cell]; k < cell_start_[cell+1]; k++){
+        const int i = indices_[k];
+        const float dx = x_[i] - x, dy = y_[i] - y;
+        if(dx*dx + dy*dy <= squared_radius) result.push_back(i);
+      }
+    }
+  }
+}
+
+
+struct FloatSquaredDistance {
+  FloatSquaredDistance(const cv::Mat& q, const cv::Mat& t) : query(q), train(t) {}
+  float operator()(int q, int t) const { 
+    return squaredL2(query.ptr<float>(q), train.ptr<float>(t), query.cols);
+  }
+  const cv::Mat& query;
+  const cv::Mat& train;
+};
+
+double matchDescriptorsGuided(const cv::Mat& query, const cv::Mat& train, const std::vector<std::vector<int> >& candidates,
+                              float max_dist_ratio, std::vector<cv::DMatch>& matches)
+{
+  ScopedTimer s(__FUNCTION__);
+  assert((int)candidates.size() == query.rows);
+  if(query.type() != train.type() || query.cols != train.cols){
+    ROS_ERROR("Guided matching requires descriptors of equal type and length");
+    return 0.0;
+  }
+  std::vector<int> best_idx;
+  if(query.type() == CV_8UC1){
+    std::vector<unsigned int> best_dist, second_dist;
+    findTwoNearestAmong(candidates, BinaryDistance(query, train), best_idx, best_dist, second_dist);
+    return selectDistinctiveMatches(train.rows, best_idx, best_dist, second_dist, Identity(), max_dist_ratio, matches);
+  } else if(query.type() == CV_32FC1){
+    std::vector<float> best_dist, second_dist; //squared
+    findTwoNearestAmong(candidates, FloatSquaredDistance(query, train), best_idx, best_dist, second_dist);
+    return selectDistinctiveMatches(train.rows, best_idx, best_dist, second_dist, SquareRoot(), max_dist_ratio, matches);
+  }
+  ROS_ERROR("Guided matching supports CV_8UC1 and CV_32FC1 descriptors only");
+  return 0.0;
+}
+
+double matchQuantizedDescriptorsGuided(const QuantizedDescriptors& query, const QuantizedDescriptors& train, 
+                                       const std::vector<std::vector<int> >& candidates,
+                                       float max_dist_ratio, std::vector<cv::DMatch>& matches)
+{
+  ScopedTimer s(__FUNCTION__);
+  assert((int)candidates.size() == query.rows());
+  if(query.data.cols != train.data.cols){
+    ROS_ERROR("Quantized descriptor matching requires descriptors of equal length");
+    return 0.0;
+  }
+  std::vector<int> best_idx;
+  std::vector<float> best_dist, second_dist; //squared
+  findTwoNearestAmong(candidates, QuantizedDistance(query, train), best_idx, best_dist, second_dist);
+  return selectDistinctiveMatches(train.rows(), best_idx, best_dist, second_dist, SquareRoot(), max_dist_ratio, matches);
+}
+
+struct BinarySetDistance {
+  BinarySetDistance(const cv::Mat& q, const std::vector<cv::Mat>& t) : query(q), trains(t) {}
+  unsigned int operator()(int s, int q, int t) const { 
+    return hamming(query.ptr<unsigned char>(q), trains[s].ptr<unsigned char>(t), query.cols); 
+  }
+  const cv::Mat& query;
+  const std::vector<cv::Mat>& trains;
+};
+
+struct FloatSetSquaredDistance {
+  FloatSetSquaredDistance(const cv::Mat& q, const std::vector<cv::Mat>& t) : query(q), trains(t) {}
+  float operator()(int s, int q, int t) const { 
+    return squaredL2(query.ptr<float>(q), trains[s].ptr<float>(t), query.cols); 
+  }
+  const cv::Mat& query;
+  const std::vector<cv::Mat>& trains;
+};
+
+struct QuantizedSetDistance {
+  QuantizedSetDistance(const QuantizedDescriptors& q, const std::vector<const QuantizedDescriptors*>& t) : query(q), trains(t) {}
+  float operator()(int s, int q, int t) const { return quantizedSquaredDistance(query, q, *trains[s], t); }
+  const QuantizedDescriptors& query;
+  const std::vector<const QuantizedDescriptors*>& trains;
+};
+
+void matchDescriptorsOneToMany(const cv::Mat& query, const std::vector<cv::Mat>& trains,
+                               float max_dist_ratio, std::vector<std::vector<cv::DMatch> >& matches)
+{
+  ScopedTimer s(__FUNCTION__);
+  matches.assign(trains.size(), std::vector<cv::DMatch>());
+  if(query.type() != CV_8UC1 && query.type() != CV_32FC1){
+    ROS_ERROR("One to many matching supports CV_8UC1 and CV_32FC1 descriptors only");
+    return;
+  }
+  std::vector<int> train_counts(trains.size(), 0);
+  for(unsigned int i = 0; i < trains.size(); i++){
+    if(trains[i].type() == query.type() && trains[i].cols == query.cols){
+      train_counts[i] = trains[i].rows;
+    } else if(!trains[i].empty()) {
+      ROS_ERROR("Descriptors of train set %d do not match the type or length of the query descriptors", i);
+    }
+  }
+  std::vector<std::vector<int> > best_idx;
+  if(query.type() == CV_8UC1){
+    std::vector<std::vector<unsigned int> > best_dist, second_dist;
+    findTwoNearestPerSet(query.rows, train_counts, BinarySetDistance(query, trains), best_idx, best_dist, second_dist);
+    for(unsigned int i = 0; i < trains.size(); i++){
+      selectDistinctiveMatches(train_counts[i], best_idx[i], best_dist[i], second_dist[i], Identity(), max_dist_ratio, matches[i]);
+    }
+  } else {
+    std::vector<std::vector<float> > best_dist, second_dist; //squared
+    findTwoNearestPerSet(query.rows, train_counts, FloatSetSquaredDistance(query, trains), best_idx, best_dist, second_dist);
+    for(unsigned int i = 0; i < trains.size(); i++){
+      selectDistinctiveMatches(train_counts[i], best_idx[i], best_dist[i], second_dist[i], SquareRoot(), max_dist_ratio, matches[i]);
+    }
+  }
+}
+
+void matchQuantizedDescriptorsOneToMany(const QuantizedDescriptors& query, const std::vector<const QuantizedDescriptors*>& trains,
+                                        float max_dist_ratio, std::vector<std::vector<cv::DMatch> >& matches)
+{
+  ScopedTimer s(__FUNCTION__);
+  matches.assign(trains.size(), std::vector<cv::DMatch>());
+  std::vector<int> train_counts(trains.size(), 0);
+  for(unsigned int i = 0; i < trains.size(); i++){
+    if(trains[i]->data.cols == query.data.cols){
+      train_counts[i] = trains[i]->rows();
+    } else if(!trains[i]->empty()) {
+      ROS_ERROR("Quantized descriptors of train set %d do not match the length of the query descriptors", i);
+    }
+  }
+  std::vector<std::vector<int> > best_idx;
+  std::vector<std::vector<float> > best_dist, second_dist; //squared
+  findTwoNearestPerSet(query.rows(), train_counts, QuantizedSetDistance(query, trains), best_idx, best_dist, second_dist);
+  for(unsigned int i = 0; i < trains.size(); i++){
+    selectDistinctiveMatches(train_counts[i], best_idx[i], best_dist[i], second_dist[i], SquareRoot(), max_dist_ratio, matches[i]);
+  }
+}
+
+///Two nearest train descriptors (squared L2) of the query rows [q_begin, q_end), results indexed by q - q_begin.
+///Blocks of query rows are compared to blocks of train rows, s.t. the train block stays in cache
+static void findTwoNearestL2Blocked(const cv::Mat& query, int q_begin, int q_end, const cv::Mat& train,
+                                    std::vector<int>& best_idx, std::vector<float>& best_dist, std::vector<float>& second_dist)
+{
+  const int query_block = 16;
+  const int train_block = 128; //64KB of SIFT descriptors
+  const int count = q_end - q_begin;
+  best_idx.assign(count, -1);
+  best_dist.assign(count, std::numeric_limits<float>::max());
+  second_dist.assign(count, std::numeric_limits<float>::max());
+  #pragma omp parallel for schedule(dynamic)
+  for(int qb = q_begin; qb < q_end; qb += query_block){
+    const int qe = std::min(qb + query_block, q_end);
+    for(int tb = 0; tb < train.rows; tb += train_block){
+      const int te = std::min(tb + train_block, train.rows);
+      for(int q = qb; q < qe; q++){
+        const float* a = query.ptr<float>(q);
+        const int r = q - q_begin;
+        float d1 = best_dist[r], d2 = second_dist[r];
+        int i1 = best_idx[r];
+        for(int t = tb; t < te; t++){
+          const float d = squaredL2(a, train.ptr<float>(t), query.cols);
+          if(d < d2){
+            if(d < d1){ d2 = d1; d1 = d; i1 = t; }
+            else { d2 = d; }
+          }
+        }
+        best_idx[r] = i1; best_dist[r] = d1; second_dist[r] = d2;
+      }
+    }
+  }
+}
+
+double matchFloatDescriptors(const cv::Mat& query, const cv::Mat& train, float max_dist_ratio, 
+                             int sufficient_matches, std::vector<cv::DMatch>& matches)
+{
+  ScopedTimer s(__FUNCTION__);
+  if(query.type() != CV_32FC1 || train.type() != CV_32FC1 || query.cols != train.cols){
+    ROS_ERROR("L2 descriptor matching requires CV_32FC1 descriptors of equal length");
+    return 0.0;
+  }
+  if(train.rows < 2) return 0.0; //No ratio test possible
+
+  //Segments of query rows as in the FLANN matcher, s.t. matching can stop early
+  int num_segments = sufficient_matches > 0 ? query.rows / (sufficient_matches + 100) : 1;
+  if(sufficient_matches <= 0 || num_segments <= 0){
+    num_segments = 1;
+    sufficient_matches = std::numeric_limits<int>::max();
+  }
+  const int segment_size = (query.rows + num_segments - 1) / num_segments;
+  std::vector<bool> train_used(train.rows, false);
+  std::vector<int> best_idx;
+  std::vector<float> best_dist, second_dist; //squared
+  double sum_distances = 0.0;
+  for(int begin = 0; begin < query.rows; begin += segment_size){
+    const int end = std::min(begin + segment_size, query.rows);
+    findTwoNearestL2Blocked(query, begin, end, train, best_idx, best_dist, second_dist);
+    sum_distances += selectDistinctiveMatches(best_idx, best_dist, second_dist, SquareRoot(), max_dist_ratio, begin, train_used, matches);
+    if((int)matches.size() > sufficient_matches){
+      ROS_DEBUG("Enough matches after %d of %d query descriptors. Skipping the rest", end, query.rows);
+      break;
+    }
+  }
+  return sum_distances;
+}
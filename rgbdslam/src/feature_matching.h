@@ -0,0 +1,109 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RGBD_SLAM_FEATURE_MATCHING_H_
+#define RGBD_SLAM_FEATURE_MATCHING_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <vector>
+
+//!Hamming distance of two binary descriptors of "bytes" length (popcount of the xor)
+unsigned int hammingDistance(const unsigned char* a, const unsigned char* b, int bytes);
+
+//!Brute force matching of binary descriptors (CV_8U, e.g. ORB or BRIEF)
+/** For each query descriptor the two nearest train descriptors are searched in one sweep.
+ *  A match is kept, if the ratio of the two distances is below max_dist_ratio and the train
+ *  descriptor has not been matched by an earlier query descriptor yet.
+ *  Yields the same matches as knnMatch with "BruteForce-Hamming" and k=2, followed by the ratio test.
+ *  The distance of the returned matches is the distance ratio. Returns the sum of the Hamming distances.
+ */
+double matchBinaryDescriptors(const cv::Mat& query, const cv::Mat& train, float max_dist_ratio, std::vector<cv::DMatch>& matches);
+
+//!Exhaustive L2 matching of float descriptors (e.g. SURF, SIFT), vectorized with AVX or SSE and parallelized over the query rows
+/** Ratio test and uniqueness as in matchBinaryDescriptors. The query descriptors are processed in 
+ *  segments. Matching stops after the segment that yields more than sufficient_matches matches
+ *  (no early exit for sufficient_matches <= 0). Returns the sum of the L2 distances
+ */
+double matchFloatDescriptors(const cv::Mat& query, const cv::Mat& train, float max_dist_ratio, 
+                             int sufficient_matches, std::vector<cv::DMatch>& matches);
+
+//!Float descriptors (e.g. SURF, SIFT, RootSIFT) stored with 8 bit per component
+/** Component j of descriptor i is data(i,j) * scales[i]. The scale maps the largest absolute 
+ *  component of each descriptor to 127. Needs a quarter of the memory of the float descriptors.
+ */
+struct QuantizedDescriptors {
+  cv::Mat data;                     ///<CV_8SC1, one row per descriptor
+  std::vector<float> scales;        ///<One per descriptor
+  std::vector<int> squared_norms;   ///<Sum of squares of the rows of data. Allows to compute the L2 distance from the dot product
+
+  ///Replace the content by the quantization of the CV_32FC1 descriptors
+  void quantize(const cv::Mat& descriptors);
+  ///Approximate float descriptors
+  void dequantize(cv::Mat& descriptors) const;
+  bool empty() const { return data.empty(); }
+  int rows() const { return data.rows; }
+  void release();
+  size_t memoryFootprint() const;
+};
+
+//!Squared L2 distance of the dequantized descriptors, computed from the integer dot product
+float quantizedSquaredDistance(const QuantizedDescriptors& a, int idx_a, const QuantizedDescriptors& b, int idx_b);
+
+//!As matchBinaryDescriptors, but for quantized descriptors with the L2 distance. 
+///Yields approximately the matches of "BruteForce" (L2) on the float descriptors. Returns the sum of the L2 distances
+double matchQuantizedDescriptors(const QuantizedDescriptors& query, const QuantizedDescriptors& train, float max_dist_ratio, std::vector<cv::DMatch>& matches);
+
+//!Uniform grid over 2D points (e.g. predicted image positions of features) for radius queries
+class FeatureGrid {
+public:
+  FeatureGrid() : cell_size_(1.0f), min_x_(0.0f), min_y_(0.0f), cols_(0), rows_(0) {}
+  ///Bucket the points. Points with NaN coordinates are left out
+  void build(const std::vector<float>& x, const std::vector<float>& y, float cell_size);
+  ///Append the indices of the points within radius of (x,y) to result
+  void radiusSearch(float x, float y, float radius, std::vector<int>& result) const;
+private:
+  float cell_size_, min_x_, min_y_;
+  int cols_, rows_;
+  std::vector<int> cell_start_;   ///<Points of cell c are indices_[cell_start_[c]] to indices_[cell_start_[c+1]-1]
+  std::vector<int> indices_;
+  std::vector<float> x_, y_;
+};
+
+//!Guided matching: query descriptor i is only compared to the train descriptors candidates[i]
+/** Ratio test and uniqueness as in matchBinaryDescriptors. Query descriptors with less than two 
+ *  candidates are not matched, as their distinctness cannot be tested. Handles float (L2) and 
+ *  binary (Hamming) descriptors. Returns the sum of the distances
+ */
+double matchDescriptorsGuided(const cv::Mat& query, const cv::Mat& train, const std::vector<std::vector<int> >& candidates,
+                              float max_dist_ratio, std::vector<cv::DMatch>& matches);
+//!matchDescriptorsGuided for quantized descriptors
+double matchQuantizedDescriptorsGuided(const QuantizedDescriptors& query, const QuantizedDescriptors& train, 
+                                       const std::vector<std::vector<int> >& candidates,
+                                       float max_dist_ratio, std::vector<cv::DMatch>& matches);
+
+//!Match the query descriptors against several train sets (e.g. the candidate nodes) in one pass over the queries
+/** Each query descriptor is compared to all train sets while it is in cache. For each set the result is 
+ *  the same as matchBinaryDescriptors (CV_8UC1) or a brute force L2 matcher (CV_32FC1) would yield for 
+ *  that set alone. matches[i] receives the matches against trains[i]. Sets of another type or length
+ *  than the query, or with less than two descriptors, get no matches.
+ */
+void matchDescriptorsOneToMany(const cv::Mat& query, const std::vector<cv::Mat>& trains,
+                               float max_dist_ratio, std::vector<std::vector<cv::DMatch> >& matches);
+//!matchDescriptorsOneToMany for quantized descriptors
+void matchQuantizedDescriptorsOneToMany(const QuantizedDescriptors& query, const std::vector<const QuantizedDescriptors*>& trains,
+                                        float max_dist_ratio, std::vector<std::vector<cv::DMatch> >& matches);
+
+#endif
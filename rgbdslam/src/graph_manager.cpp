@@ -26,6 +26,7 @@
 #include <qtconcurrentrun.h>
 #include <QtConcurrentMap> 
 #include <utility>
+#include <map>
 #include <fstream>
 #include <limits>
 #include <boost/foreach.hpp>
@@ -56,6 +57,16 @@ typedef std::pair<int, g2o::HyperGraph::Vertex*> VertexIDPair;
 //std::tr1::unordered_map<int, g2o::HyperGraph::Vertex* >
 typedef std::set<g2o::HyperGraph::Edge*> EdgeSet;
 
+///The cloud of the node as handed to the 3D view. Lazily stored clouds are only computed if they are rendered
+static pointcloud_type::Ptr cloudForGLViewer(const Node* node)
+{
+  ParameterServer* ps = ParameterServer::instance();
+  if(ps->get<bool>("use_glwidget") && ps->get<bool>("use_gui") && !ps->get<bool>("glwidget_without_clouds")){
+    return node->getPointCloud();
+  }
+  return node->pc_col;
+}
+
 
 GraphManager::GraphManager() :
     optimizer_(NULL), 
@@ -65,6 +76,8 @@ GraphManager::GraphManager() :
     process_node_runs_(false),
     localization_only_(false),
     loop_closures_edges(0), sequential_edges(0),
+    motion_prior_(Eigen::Matrix4f::Identity()),
+    motion_prior_node_id_(-1),
     next_seq_id(0), next_vertex_id(0),
     current_backend_("none")
 {
@@ -197,6 +210,7 @@ QList<int> GraphManager::getPotentialEdgeTargetsWithDijkstra(const Node* new_nod
 {
     QList<int> ids_to_link_to; //return value
     if(predecessor_id < 0) predecessor_id = graph_.size()-1;
+    cv::RNG rng(randomSeed(EDGE_CANDIDATE_RANDOM, new_node->id_)); //reproducible in deterministic mode
     //Prepare output
     std::stringstream ss;
     ss << "Node ID's to compare with candidate for node " << graph_.size() << ". Sequential: ";
@@ -265,7 +279,7 @@ QList<int> GraphManager::getPotentialEdgeTargetsWithDijkstra(const Node* new_nod
       //Sample targets from graph-neighbours
       ss << "Dijkstra: ";
       while(ids_to_link_to.size() < sequential_targets+geodesic_targets && neighbour_indices.size() != 0){ 
-        int random_pick = rand() % sum_of_weights;
+        int random_pick = rng.uniform(0, sum_of_weights);
         ROS_DEBUG("Pick: %d/%d", random_pick, sum_of_weights);
         int weight_so_far = 0;
         for(std::map<int,int>::iterator map_it = neighbour_indices.begin(); map_it != neighbour_indices.end(); map_it++ ){
@@ -298,7 +312,7 @@ QList<int> GraphManager::getPotentialEdgeTargetsWithDijkstra(const Node* new_nod
 
       //Sample targets from non-neighbours (search new loops)
       while(ids_to_link_to.size() < geodesic_targets+sampled_targets+sequential_targets && non_neighbour_indices.size() != 0){ 
-          int index_of_v_id = rand() % non_neighbour_indices.size();
+          int index_of_v_id = rng.uniform(0, (int)non_neighbour_indices.size());
           int sampled_id = non_neighbour_indices[index_of_v_id];
           non_neighbour_indices[index_of_v_id] = non_neighbour_indices.back(); //copy last id to position of the used id
           non_neighbour_indices.resize(non_neighbour_indices.size()-1); //drop last id
@@ -335,6 +349,7 @@ void GraphManager::resetGraph(){
     keyframe_ids_.clear();
     Q_EMIT resetGLViewer();
     curr_best_result_ = MatchingResult();
+    motion_prior_node_id_ = -1;
     current_poses_.clear();
     current_edges_.clear();
     reset_request_ = false;
@@ -371,7 +386,7 @@ void GraphManager::firstNode(Node* new_node)
     //pointcloud_type::Ptr the_pc(new_node->pc_col); //this would delete the cloud after the_pc gets out of scope
     QMatrix4x4 latest_transform = g2o2QMatrix(g2o_ref_se3);
     if(!ParameterServer::instance()->get<bool>("glwidget_without_clouds")) { 
-      Q_EMIT setPointCloud(new_node->pc_col.get(), latest_transform);
+      Q_EMIT setPointCloud(cloudForGLViewer(new_node).get(), latest_transform); //Blocking, the temporary lives long enough
       Q_EMIT setFeatures(&(new_node->feature_locations_3d_));
     }
     current_poses_.append(latest_transform);
@@ -396,6 +411,38 @@ void updateInlierFeatures(const MatchingResult& mr, Node* new_node, Node* old_no
   }
 }
 
+///Comparison of the new node to an older node, usable with QtConcurrent::blockingMapped.
+///Uses guided matching for the node the motion prior refers to, if available
+///Uses the matches of batch matching, if given for the node
+struct NodeComparison {
+  typedef MatchingResult result_type;
+  typedef std::map<int, std::vector<cv::DMatch> > MatchMap;
+  NodeComparison(Node* new_node, const Eigen::Matrix4f* motion_prior, int motion_prior_node_id)
+  : new_node_(new_node), motion_prior_(motion_prior), motion_prior_node_id_(motion_prior_node_id), batch_matches_(NULL) {}
+  MatchingResult operator()(const Node* older_node) const {
+    if(motion_prior_ != NULL && older_node->id_ == motion_prior_node_id_){
+      return new_node_->matchNodePairGuided(older_node, *motion_prior_);
+    }
+    if(batch_matches_ != NULL){
+      MatchMap::const_iterator it = batch_matches_->find(older_node->id_);
+      if(it != batch_matches_->end()) return new_node_->matchNodePairWithMatches(older_node, it->second);
+    }
+    return new_node_->matchNodePair(older_node);
+  }
+  Node* new_node_;
+  const Eigen::Matrix4f* motion_prior_; //Pointer, s.t. the functor can be copied without alignment issues
+  int motion_prior_node_id_;
+  const MatchMap* batch_matches_;
+};
+
+void GraphManager::updateMotionPrior(const MatchingResult& mr, const Node* new_node, int predecessor_id)
+{
+  if(mr.edge.id1 == predecessor_id && mr.edge.id2 == new_node->id_){
+    motion_prior_ = mr.final_trafo;
+    motion_prior_node_id_ = new_node->id_;
+  }
+}
+
 bool GraphManager::nodeComparisons(Node* new_node, 
                                    QMatrix4x4& curr_motion_estimate,
                                    bool& edge_to_keyframe)///Output:contains the best-yet of the pairwise motion estimates for the current node
@@ -438,6 +485,8 @@ bool GraphManager::nodeComparisons(Node* new_node,
       odom_delta_tf = tf::Transform::getIdentity();
     }
     //int best_match_candidate_id = sequentially_previous_id; 
+    bool guided = ps->get<bool>("guided_matching") && motion_prior_node_id_ >= 0;
+    NodeComparison compare(new_node, guided ? &motion_prior_ : NULL, motion_prior_node_id_);
     MatchingResult mr;
     curr_best_result_ = mr;
 
@@ -451,7 +500,7 @@ bool GraphManager::nodeComparisons(Node* new_node,
       Node* prev_frame = graph_[graph_.size()-1];
       if(localization_only_ && curr_best_result_.edge.id1 > 0){ prev_frame =  graph_[curr_best_result_.edge.id1]; }
       ROS_INFO("Comparing new node (%i) with previous node %i", new_node->id_, prev_frame->id_);
-      mr = new_node->matchNodePair(prev_frame);
+      mr = compare(prev_frame);
       if(mr.edge.id1 > 0 && mr.edge.id2 > 0) {//Found trafo
       ros::Time time1 = pcl_conversions::fromPCL(prev_frame->pc_col->header).stamp;
        ros::Time time2 = pcl_conversions::fromPCL(new_node->pc_col->header).stamp;
@@ -481,6 +530,7 @@ bool GraphManager::nodeComparisons(Node* new_node,
             updateLandmarks(mr, prev_frame,new_node);
 #endif
             updateInlierFeatures(mr, new_node, prev_frame);
+            updateMotionPrior(mr, new_node, sequentially_previous_id);
             graph_[mr.edge.id1]->valid_tf_estimate_ = true;
             ROS_INFO("Added Edge between %i and %i. Inliers: %i",mr.edge.id1,mr.edge.id2,(int) mr.inlier_matches.size());
             curr_best_result_ = mr;
@@ -511,6 +561,23 @@ bool GraphManager::nodeComparisons(Node* new_node,
 
     QList<const Node* > nodes_to_comp;//only necessary for parallel computation
 
+    //Batch matching: the features of the new node are compared to all candidates in one pass
+    NodeComparison::MatchMap batch_matches;
+    if(ps->get<bool>("batch_matching") && vertices_to_comp.size() > 1){
+      std::vector<const Node*> batch_nodes;
+      Q_FOREACH(int id, vertices_to_comp){
+        if(compare.motion_prior_ != NULL && id == compare.motion_prior_node_id_) continue; //guided
+        batch_nodes.push_back(graph_[id]);
+      }
+      std::vector<std::vector<cv::DMatch> > matches;
+      if(new_node->batchFeatureMatching(batch_nodes, matches)){
+        for(unsigned int i = 0; i < batch_nodes.size(); i++){
+          batch_matches[batch_nodes[i]->id_].swap(matches[i]);
+        }
+        compare.batch_matches_ = &batch_matches;
+      }
+    }
+
     //MAIN LOOP: Compare node pairs ######################################################################
     if (ps->get<bool>("concurrent_edge_construction")) 
     {
@@ -527,7 +594,8 @@ bool GraphManager::nodeComparisons(Node* new_node,
             ROS_WARN("Few Threads Remaining: Increasing maxThreadCount to %i", qtp->maxThreadCount()+1);
             qtp->setMaxThreadCount(qtp->maxThreadCount() + 1);
         }
-        QList<MatchingResult> results = QtConcurrent::blockingMapped(nodes_to_comp, boost::bind(&Node::matchNodePair, new_node, _1));
+        //The results are in the order of nodes_to_comp, the edges are added independent of the thread scheduling
+        QList<MatchingResult> results = QtConcurrent::blockingMapped(nodes_to_comp, compare);
 
         for (int i = 0; i < results.size(); i++) 
         {
@@ -548,6 +616,7 @@ bool GraphManager::nodeComparisons(Node* new_node,
                   updateLandmarks(mr, graph_[mr.edge.id1],new_node);
 #endif
                   updateInlierFeatures(mr, new_node, graph_[mr.edge.id1]);
+                  updateMotionPrior(mr, new_node, sequentially_previous_id);
                   graph_[mr.edge.id1]->valid_tf_estimate_ = true;
                   ROS_INFO("Added Edge between %i and %i. Inliers: %i",mr.edge.id1,mr.edge.id2,(int) mr.inlier_matches.size());
                   if (mr.inlier_matches.size() > curr_best_result_.inlier_matches.size()) {
@@ -561,7 +630,7 @@ bool GraphManager::nodeComparisons(Node* new_node,
         for (int id_of_id = (int) vertices_to_comp.size() - 1; id_of_id >= 0; id_of_id--) {
             Node* node_to_compare = graph_[vertices_to_comp[id_of_id]];
             ROS_INFO("Comparing new node (%i) with node %i / %i", new_node->id_, vertices_to_comp[id_of_id], node_to_compare->id_);
-            MatchingResult mr = new_node->matchNodePair(node_to_compare);
+            MatchingResult mr = compare(node_to_compare);
 
             if (mr.edge.id1 >= 0) {
                 //mr.edge.informationMatrix *= geodesicDiscount(hypdij, mr);
@@ -576,6 +645,7 @@ bool GraphManager::nodeComparisons(Node* new_node,
 #endif
                 graph_[new_node->id_] = new_node; //Needs to be added
                 updateInlierFeatures(mr, new_node, node_to_compare);
+                updateMotionPrior(mr, new_node, sequentially_previous_id);
                 graph_[mr.edge.id1]->valid_tf_estimate_ = true;
                 ROS_INFO("Added Edge between %i and %i. Inliers: %i",mr.edge.id1,mr.edge.id2,(int) mr.inlier_matches.size());
                 if (mr.inlier_matches.size() > curr_best_result_.inlier_matches.size()) {
@@ -676,7 +746,8 @@ void GraphManager::localizationUpdate(Node* new_node, QMatrix4x4 motion_estimate
 {
       //First render the cloud with the best frame-to-frame estimate
       //The transform will get updated when optimizeGraph finishes
-      pointcloud_type* cloud_to_visualize = new_node->pc_col.get();
+      pointcloud_type::Ptr node_cloud = cloudForGLViewer(new_node); //Keeps a lazily computed cloud alive until it is rendered
+      pointcloud_type* cloud_to_visualize = node_cloud.get();
       std_vector_of_eigen_vector4f * features_to_visualize = &(new_node->feature_locations_3d_);
       if(!new_node->valid_tf_estimate_){
         cloud_to_visualize = new pointcloud_type();
@@ -726,7 +797,8 @@ bool GraphManager::addNode(Node* new_node)
 
       //First render the cloud with the best frame-to-frame estimate
       //The transform will get updated when optimizeGraph finishes
-      pointcloud_type* cloud_to_visualize = new_node->pc_col.get();
+      pointcloud_type::Ptr node_cloud = cloudForGLViewer(new_node); //Keeps a lazily computed cloud alive until it is rendered
+      pointcloud_type* cloud_to_visualize = node_cloud.get();
       std_vector_of_eigen_vector4f * features_to_visualize = &(new_node->feature_locations_3d_);
       if(!new_node->valid_tf_estimate_) {
         cloud_to_visualize = new pointcloud_type();
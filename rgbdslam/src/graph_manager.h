@@ -193,6 +193,12 @@ protected:
     void createOptimizer(std::string backend, g2o::SparseOptimizer* optimizer = NULL);
     ///will contain the motion to the best matching node
     MatchingResult curr_best_result_; 
+    ///Motion from the latest node to its predecessor. Prior for the guided matching of the next node (constant velocity)
+    Eigen::Matrix4f motion_prior_;
+    ///Id of the node motion_prior_ refers to, -1 if there is none
+    int motion_prior_node_id_;
+    ///Remember the motion, if mr is the result of the comparison with the predecessor
+    void updateMotionPrior(const MatchingResult& mr, const Node* new_node, int predecessor_id);
 
     ///Compute the tranformation between (sensor) Base and Fixed (Map) frame
     tf::StampedTransform computeFixedToBaseTransform(Node* node, bool invert);
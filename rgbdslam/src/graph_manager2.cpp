@@ -44,7 +44,7 @@ void GraphManager::clearPointClouds() {
 void GraphManager::clearPointCloud(pointcloud_type const * pc) {
   ROS_DEBUG("Should clear cloud at %p", pc);
   BOOST_REVERSE_FOREACH(GraphNodeType entry, graph_){
-    if(entry.second->pc_col.get() == pc){
+    if(entry.second->ownsPointCloud(pc)){
       entry.second->clearPointCloud();
       ROS_INFO("Cleared PointCloud after rendering to openGL list. It will not be available for save/send.");
       return;
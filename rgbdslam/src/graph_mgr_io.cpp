@@ -154,7 +154,7 @@ bool GraphManager::updateCloudOrigin(Node* node)
       ROS_ERROR("Nullpointer in graph at position %i!", node->id_);
       return false;
     }
-    if(node->pc_col->size() == 0){
+    if(node->getPointCloudSize() == 0){
       ROS_INFO("Skipping Node %i, point cloud data is empty!", node->id_);
       return false;
     }
@@ -162,6 +162,7 @@ bool GraphManager::updateCloudOrigin(Node* node)
     node->pc_col->sensor_origin_.head<3>() = v->estimate().translation().cast<float>();
     node->pc_col->sensor_orientation_ =  v->estimate().rotation().cast<float>();
     //node->pc_col->header.frame_id = ParameterServer::instance()->get<std::string>("fixed_frame_name");
+    return true;
 }
 
 void GraphManager::saveOctomap(QString filename, bool threaded){
@@ -194,7 +195,7 @@ void GraphManager::saveOctomapImpl(QString filename)
       Node* node = it->second;
       if(this->updateCloudOrigin(node)){
         nodes_for_octomapping.push_back(node);
-        points_to_render += node->pc_col->size();
+        points_to_render += node->getPointCloudSize();
       }
     }
   } 
@@ -207,8 +208,8 @@ void GraphManager::saveOctomapImpl(QString filename)
   {
       QString message;
       Q_EMIT setGUIStatus(message.sprintf("Inserting Node %i/%i into octomap", ++counter, (int)nodes_for_octomapping.size()));
+      rendered_points += node->getPointCloudSize();
       this->renderToOctomap(node);
-      rendered_points += node->pc_col->size();
       ROS_INFO("Rendered %u points of %u", rendered_points, points_to_render);
       Q_EMIT progress(0, "Saving Octomap", counter);
       if(counter % ParameterServer::instance()->get<int>("octomap_autosave_step") == 0){
@@ -239,7 +240,7 @@ void GraphManager::renderToOctomap(Node* node)
 {
     ScopedTimer s(__FUNCTION__);
     ROS_INFO("Rendering Node %i with frame %s", node->id_, node->pc_col->header.frame_id.c_str());
-    co_server_.insertCloudCallback(node->pc_col, ParameterServer::instance()->get<double>("maximum_depth")); // Will be transformed according to sensor pose set previously
+    co_server_.insertCloudCallback(node->getPointCloud(), ParameterServer::instance()->get<double>("maximum_depth")); // Will be transformed according to sensor pose set previously
     if(ParameterServer::instance()->get<bool>("octomap_clear_raycasted_clouds")){
       node->clearPointCloud();
       ROS_INFO("Cleared pointcloud of Node %i", node->id_);
@@ -271,7 +272,7 @@ void GraphManager::saveIndividualCloudsToFile(QString file_basename)
       ROS_ERROR("Nullpointer in graph at position %i!", it->first);
       continue;
     }
-    if(node->pc_col->size() == 0){
+    if(node->getPointCloudSize() == 0){
       ROS_INFO("Skipping Node %i, point cloud data is empty!", it->first);
       continue;
     }
@@ -295,7 +296,7 @@ void GraphManager::saveIndividualCloudsToFile(QString file_basename)
 
     filename.sprintf("%s_%04d.pcd", qPrintable(file_basename), it->first);
     Q_EMIT setGUIStatus(message.sprintf("Saving to %s: Transformed Node %i/%i", qPrintable(filename), it->first, (int)camera_vertices.size()));
-    pcl::io::savePCDFile(qPrintable(filename), *(node->pc_col), true); //Last arg: true is binary mode. ASCII mode drops color bits
+    pcl::io::savePCDFile(qPrintable(filename), *(node->getPointCloud()), true); //Last arg: true is binary mode. ASCII mode drops color bits
 
     if(!gt.empty()){
       tf::StampedTransform gt_world2base = node->getGroundTruthTransform();//get mocap pose of base in map
@@ -312,7 +313,7 @@ void GraphManager::saveIndividualCloudsToFile(QString file_basename)
 
       filename.sprintf("%s_%04d_gt.pcd", qPrintable(file_basename), it->first);
       Q_EMIT setGUIStatus(message.sprintf("Saving to %s: Transformed Node %i/%i", qPrintable(filename), it->first, (int)camera_vertices.size()));
-      pcl::io::savePCDFile(qPrintable(filename), *(node->pc_col), true); //Last arg: true is binary mode. ASCII mode drops color bits
+      pcl::io::savePCDFile(qPrintable(filename), *(node->getPointCloud()), true); //Last arg: true is binary mode. ASCII mode drops color bits
     }
 
   }
@@ -370,12 +371,13 @@ void GraphManager::saveAllFeaturesToFile(QString filename)
     fs << "]";
     //Assemble all descriptors into a big matrix
  assert(graph_.size()>0);
-    int descriptor_size = graph_[0]->feature_descriptors_.cols;
-    int descriptor_type = graph_[0]->feature_descriptors_.type();
+    cv::Mat first_descriptors = graph_[0]->getDescriptors();
+    int descriptor_size = first_descriptors.cols;
+    int descriptor_type = first_descriptors.type();
     cv::Mat alldescriptors(0, descriptor_size,  descriptor_type);
     alldescriptors.reserve(feat_count);
     for (unsigned int i = 0; i < graph_.size(); ++i) {
-      alldescriptors.push_back(graph_[i]->feature_descriptors_);
+      alldescriptors.push_back(graph_[i]->getDescriptors());
     }
     fs << "Feature_Descriptors" << alldescriptors;
     fs.release();
@@ -420,7 +422,7 @@ void GraphManager::saveAllCloudsToFile(QString filename){
       }
       tf::Transform transform = eigenTransf2TF(v->estimate());
       world2cam = cam2rgb*transform;
-      transformAndAppendPointCloud (*(node->pc_col), aggregate_cloud, world2cam, ParameterServer::instance()->get<double>("maximum_depth"));
+      transformAndAppendPointCloud (*(node->getPointCloud()), aggregate_cloud, world2cam, ParameterServer::instance()->get<double>("maximum_depth"));
 
       if(ParameterServer::instance()->get<bool>("batch_processing"))
         node->clearPointCloud(); //saving all is the last thing to do, so these are not required anymore
@@ -878,10 +880,12 @@ void GraphManager::broadcastTransform(Node* node, tf::Transform& computed_motion
 
 ///Send node's pointcloud with given publisher and timestamp
 void publishCloud(Node* node, ros::Time timestamp, ros::Publisher pub){
-	ros::Time stamp = pcl_conversions::fromPCL(node->pc_col->header).stamp; //temp storage
-pcl_conversions::fromPCL(node->pc_col->header).stamp = timestamp; //to sync with tf
-  pub.publish(node->pc_col);
-  pcl_conversions::fromPCL(node->pc_col->header).stamp =stamp; //restore original stamp (to minimize unexpected side-effects of this function)
+  //Stamp a copy of the header to sync with tf. Changing pc_col would not match the
+  //metadata of a lazily cached cloud anymore, which would then be rebuilt on every publish
+  sensor_msgs::PointCloud2 msg;
+  pcl::toROSMsg(*(node->getPointCloud()), msg);
+  msg.header.stamp = timestamp;
+  pub.publish(msg);
   ROS_INFO("Pointcloud with id %i sent with frame %s", node->id_, node->pc_col->header.frame_id.c_str());
 }
 
@@ -0,0 +1,189 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "keypoint_budget.h"
+#include "parameter_server.h"
+#include <QMutexLocker>
+#include <std_msgs/Float64MultiArray.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+KeypointBudget* KeypointBudget::_instance = NULL;
+
+///Weight of the newest measurement in the smoothed times
+static const double smoothing = 0.3;
+///No adaptation while the latency is within this fraction of the target, avoids oscillation
+static const double dead_band = 0.1;
+///Step of the threshold factor
+static const double threshold_step = 1.25;
+///Frames without a further threshold change after a change. The frames in the pipeline still show the old threshold
+static const unsigned int threshold_hold_frames = 5;
+
+///Only the self-adjusting detectors take the threshold factor, see createDetector
+static bool usesThresholdFactor(const std::string& detector_type)
+{
+  return detector_type == "FAST" || detector_type == "SURF" || detector_type == "SIFTGPU";
+}
+
+KeypointBudget* KeypointBudget::instance()
+{
+  static QMutex creation_mutex; //Nodes may be constructed concurrently
+  QMutexLocker locker(&creation_mutex);
+  if (_instance == NULL) {
+    _instance = new KeypointBudget();
+  }
+  return _instance;
+}
+
+KeypointBudget::KeypointBudget()
+: last_keypoints_(0), extraction_reported_(false), threshold_hold_(0)
+{
+  ParameterServer* ps = ParameterServer::instance();
+  state_.latency_target = ps->get<double>("frame_latency_target");
+  state_.extraction_time = 0.0;
+  state_.matching_time = 0.0;
+  state_.max_keypoints = ps->get<int>("max_keypoints");
+  state_.min_keypoints = ps->get<int>("min_keypoints");
+  state_.threshold_factor = 1.0;
+  state_.generation = 0;
+  state_.frames = 0;
+  if(state_.latency_target > 0){
+    ros::NodeHandle nh;
+    state_pub_ = nh.advertise<std_msgs::Float64MultiArray>("/rgbdslam/keypoint_budget", 10);
+    ROS_INFO("Adapting the keypoint budget to a latency of %f s per frame", state_.latency_target);
+  }
+}
+
+int KeypointBudget::maxKeypoints()
+{
+  QMutexLocker locker(&mutex_);
+  if(state_.latency_target <= 0) return ParameterServer::instance()->get<int>("max_keypoints");
+  return state_.max_keypoints;
+}
+
+int KeypointBudget::minKeypoints()
+{
+  QMutexLocker locker(&mutex_);
+  if(state_.latency_target <= 0) return ParameterServer::instance()->get<int>("min_keypoints");
+  return state_.min_keypoints;
+}
+
+double KeypointBudget::thresholdFactor()
+{
+  QMutexLocker locker(&mutex_);
+  return state_.threshold_factor;
+}
+
+unsigned int KeypointBudget::generation()
+{
+  QMutexLocker locker(&mutex_);
+  return state_.generation;
+}
+
+KeypointBudget::State KeypointBudget::state()
+{
+  QMutexLocker locker(&mutex_);
+  return state_;
+}
+
+void KeypointBudget::reportExtraction(double seconds, int keypoints)
+{
+  if(state_.latency_target <= 0) return; //Constant after construction
+  QMutexLocker locker(&mutex_);
+  state_.extraction_time = extraction_reported_ ? (1.0-smoothing) * state_.extraction_time + smoothing * seconds : seconds;
+  extraction_reported_ = true;
+  last_keypoints_ = keypoints;
+}
+
+void KeypointBudget::reportMatching(double seconds)
+{
+  if(state_.latency_target <= 0) return;
+  QMutexLocker locker(&mutex_);
+  state_.matching_time = state_.frames > 0 ? (1.0-smoothing) * state_.matching_time + smoothing * seconds : seconds;
+  state_.frames++;
+  update();
+  publishState();
+}
+
+void KeypointBudget::update()
+{
+  ParameterServer* ps = ParameterServer::instance();
+  double latency = state_.extraction_time + state_.matching_time;
+  if(latency <= 0.0) return;
+  double ratio = state_.latency_target / latency;
+  bool changed = false;
+
+  if(ratio < 1.0 - dead_band || ratio > 1.0 + dead_band){
+    //Matching effort grows faster than linear with the keypoints, so approach the target damped,
+    //never more than halving or doubling per frame
+    double step = std::max(0.5, std::min(2.0, std::sqrt(ratio)));
+    int lower = ps->get<int>("keypoint_budget_min");
+    int upper = ps->get<int>("keypoint_budget_max");
+    int new_max = static_cast<int>(state_.max_keypoints * step + 0.5);
+    new_max = std::max(lower, std::min(upper, new_max));
+    if(new_max != state_.max_keypoints){
+      //min_keypoints keeps its configured ratio to max_keypoints
+      double min_ratio = ps->get<int>("max_keypoints") > 0 ?
+                         ps->get<int>("min_keypoints") / (double)ps->get<int>("max_keypoints") : 0.0;
+      state_.max_keypoints = new_max;
+      state_.min_keypoints = static_cast<int>(new_max * min_ratio);
+      changed = true;
+    }
+  }
+
+  //Too few features: make the detector more sensitive, unless the latency is above the target already.
+  //Saturated and too slow: less sensitive, which makes the detection cheaper
+  if(threshold_hold_ > 0){
+    threshold_hold_--;
+  } else if(usesThresholdFactor(ps->get<std::string>("feature_detector_type"))){
+    double factor = state_.threshold_factor;
+    if(last_keypoints_ < state_.min_keypoints && ratio >= 1.0){
+      factor = std::max(0.1, factor / threshold_step);
+    } else if(ratio < 1.0 - dead_band && last_keypoints_ >= state_.max_keypoints){
+      factor = std::min(10.0, factor * threshold_step);
+    }
+    if(factor != state_.threshold_factor){
+      state_.threshold_factor = factor;
+      threshold_hold_ = threshold_hold_frames;
+      changed = true;
+    }
+  }
+
+  if(changed){
+    state_.generation++;
+    ROS_INFO_NAMED("statistics", "Keypoint budget: %d (min %d), threshold factor %.2f, latency %.3f s (target %.3f s)",
+                   state_.max_keypoints, state_.min_keypoints, state_.threshold_factor, latency, state_.latency_target);
+  }
+}
+
+void KeypointBudget::publishState()
+{
+  if(state_pub_.getNumSubscribers() == 0) return;
+  std_msgs::Float64MultiArray msg;
+  msg.layout.dim.resize(1);
+  msg.layout.dim[0].label = "latency_target,extraction_time,matching_time,max_keypoints,min_keypoints,threshold_factor,generation,frames";
+  msg.layout.dim[0].size = 8;
+  msg.layout.dim[0].stride = 8;
+  msg.data.push_back(state_.latency_target);
+  msg.data.push_back(state_.extraction_time);
+  msg.data.push_back(state_.matching_time);
+  msg.data.push_back(state_.max_keypoints);
+  msg.data.push_back(state_.min_keypoints);
+  msg.data.push_back(state_.threshold_factor);
+  msg.data.push_back(state_.generation);
+  msg.data.push_back(state_.frames);
+  state_pub_.publish(msg);
+}
@@ -0,0 +1,75 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RGBD_SLAM_KEYPOINT_BUDGET_H_
+#define RGBD_SLAM_KEYPOINT_BUDGET_H_
+#include <QMutex>
+#include <ros/ros.h>
+
+//!Closed loop control of the number of keypoints, s.t. a frame takes about frame_latency_target seconds
+/** The node construction reports the time for feature extraction, the graph insertion the time for
+ *  matching (and optimization). The smoothed sum of both is compared to the target after each frame.
+ *  The keypoint budget (max_keypoints, min_keypoints keeps its ratio to it) is scaled multiplicatively
+ *  towards the target. The initial threshold of the adjusted detectors (FAST, SURF) is raised while
+ *  the budget is saturated and too slow, and lowered if the detector does not even find min_keypoints
+ *  and the latency is within the target. After a change the threshold is held for a few frames.
+ *  Without a target (frame_latency_target <= 0), the configured values are returned unchanged.
+ *  The state is published on /rgbdslam/keypoint_budget after each update.
+ */
+class KeypointBudget {
+public:
+  struct State {
+    double latency_target;     ///<seconds per frame
+    double extraction_time;    ///<smoothed, seconds
+    double matching_time;      ///<smoothed, seconds
+    int max_keypoints;
+    int min_keypoints;
+    double threshold_factor;   ///<applied to the initial detector threshold
+    unsigned int generation;   ///<incremented on every change of budget or threshold (of a detector that uses it)
+    unsigned int frames;       ///<number of frames the controller has seen
+  };
+
+  static KeypointBudget* instance();
+
+  ///Current keypoint budget (configured max_keypoints, if disabled)
+  int maxKeypoints();
+  ///Current lower bound (configured min_keypoints, if disabled)
+  int minKeypoints();
+  ///Factor for the initial threshold of the adjusted detectors
+  double thresholdFactor();
+  ///Detectors created with an older generation are outdated
+  unsigned int generation();
+  State state();
+
+  ///Time of the feature detection and extraction for one frame, and the number of features it yielded
+  void reportExtraction(double seconds, int keypoints);
+  ///Time of the matching of one frame. Triggers the update of the budget
+  void reportMatching(double seconds);
+
+private:
+  KeypointBudget();
+  void update();
+  void publishState();
+
+  static KeypointBudget* _instance;
+  QMutex mutex_;
+  State state_;
+  int last_keypoints_;
+  bool extraction_reported_;
+  unsigned int threshold_hold_; ///<Frames until the threshold factor may change again
+  ros::Publisher state_pub_;
+};
+
+#endif
@@ -50,13 +50,13 @@ int findClosestNeighbour(cv::Mat all, cv::Mat row){
 void GraphManager::createSearchTree(const std::vector<int>& node_ids){
 
  // get descriptor size:
- descriptor_length = graph_.begin()->second->feature_descriptors_.cols;
+ descriptor_length = graph_.begin()->second->getDescriptors().cols;
 
  total_descriptor_count = 0;
 
  // get total number of features
  for (uint i=0; i<node_ids.size(); ++i)
-  total_descriptor_count += graph_.at(node_ids[i])->feature_descriptors_.rows;
+  total_descriptor_count += graph_.at(node_ids[i])->feature_locations_2d_.size();
 
  // TODO: memleak?
  descriptor_to_node = new int[total_descriptor_count]; // map from index-position to image
@@ -81,13 +81,14 @@ void GraphManager::createSearchTree(const std::vector<int>& node_ids){
  for (uint i=0; i<node_ids.size(); ++i){
 
   Node* node = graph_.at(node_ids[i]);
-  int desc_cnt = node->feature_descriptors_.rows;
+  cv::Mat descriptors = node->getDescriptors(); //dequantized, if necessary
+  int desc_cnt = descriptors.rows;
 
   // copy desciptors into large matrix
   //all_descriptors.rowRange(pos, pos+desc_cnt) = node->feature_descriptors_;
   for (int l = 0; l<desc_cnt; ++l){
    for (uint d = 0; d<descriptor_length; d++){
-    all_descriptors.at<float>(pos+l,d) = node->feature_descriptors_.at<float>(l,d);
+    all_descriptors.at<float>(pos+l,d) = descriptors.at<float>(l,d);
     descriptor_to_node[pos+l]= node->id_;
    }
   }
@@ -203,8 +204,9 @@ void GraphManager::getNeighbours(int node_id, uint neighbour_cnt, std::vector<st
  //   cout << node->feature_descriptors_.at<float>(i,0) << " ";
  //  cout << endl;
 
- cv::Mat indices(node->feature_descriptors_.rows, neighbour_cnt, CV_32S);
- cv::Mat dists(node->feature_descriptors_.rows, neighbour_cnt, CV_32FC1);
+ cv::Mat descriptors = node->getDescriptors();
+ cv::Mat indices(descriptors.rows, neighbour_cnt, CV_32S);
+ cv::Mat dists(descriptors.rows, neighbour_cnt, CV_32FC1);
 
  std::vector<int> index;
  std::vector<float> dist;
@@ -220,7 +222,7 @@ void GraphManager::getNeighbours(int node_id, uint neighbour_cnt, std::vector<st
  // }
 
 
- tree->knnSearch(node->feature_descriptors_, indices, dists, neighbour_cnt);//, cv::flann::SearchParams(100));
+ tree->knnSearch(descriptors, indices, dists, neighbour_cnt);//, cv::flann::SearchParams(100));
 
  map<int, float> scores;
 
@@ -260,7 +262,7 @@ void GraphManager::getNeighbours(int node_id, uint neighbour_cnt, std::vector<st
   //  all_neighbours.push_back(make_pair(it->first, it->second));
 
   // normalizing the score with the number of features in the corresponding image
-  all_neighbours.push_back(make_pair(it->first, it->second/graph_.at(it->first)->feature_descriptors_.rows));
+  all_neighbours.push_back(make_pair(it->first, it->second/graph_.at(it->first)->feature_locations_2d_.size())); //feature_descriptors_ may be released (quantize_descriptors)
 
   //  ROS_INFO("node: %i,score: %f", it->first, it->second);
   score_sum+=it->second;
@@ -69,7 +69,10 @@ void gui_connections(Graphical_UI* gui, GraphManager* graph_mgr, OpenNIListener*
     QObject::connect(graph_mgr, SIGNAL(deleteLastNode()), glv, SLOT(deleteLastNode()));
     QObject::connect(graph_mgr, SIGNAL(resetGLViewer()),  glv, SLOT(reset()));
     if(!ParameterServer::instance()->get<bool>("store_pointclouds")) {
+        //Also releases the depth and color images of lazily stored clouds
         QObject::connect(glv, SIGNAL(cloudRendered(pointcloud_type const *)), graph_mgr, SLOT(clearPointCloud(pointcloud_type const *))); // 
+    } else if(ParameterServer::instance()->get<bool>("lazy_point_clouds")) {
+        //Nothing to reduce, the rendered clouds are only cached by the nodes
     } else if(ParameterServer::instance()->get<double>("voxelfilter_size") > 0.0) {
         QObject::connect(glv, SIGNAL(cloudRendered(pointcloud_type const *)), graph_mgr, SLOT(reducePointCloud(pointcloud_type const *))); // 
     }
@@ -109,6 +112,12 @@ int main(int argc, char** argv)
     QObject::connect(&listener, SIGNAL(bagFinished()), &qtRos, SLOT(quitNow()));
     QtConcurrent::run(&listener, &OpenNIListener::loadBag, bagfile_name);
   }
+  else if(!ParameterServer::instance()->get<std::string>("tum_dataset_dir").empty())
+  {
+    QObject::connect(&listener, SIGNAL(bagFinished()), &app, SLOT(quit()));
+    QObject::connect(&listener, SIGNAL(bagFinished()), &qtRos, SLOT(quitNow()));
+    QtConcurrent::run(&listener, &OpenNIListener::loadTUMDataset, ParameterServer::instance()->get<std::string>("tum_dataset_dir"));
+  }
 
   Graphical_UI* gui = NULL;
 	if (app.type() == QApplication::GuiClient){
@@ -20,12 +20,23 @@
 #include <Eigen/Core>
 #include <QString>
 #include <QMatrix4x4>
+#include <QMutex>
+#include <QThreadStorage>
+#include <QAtomicInt>
+#include <boost/shared_ptr.hpp>
+#include <cstring>
 #include <ctime>
+#include <fstream>
+#include <sys/time.h>
+#include <unistd.h>
 #include <limits>
 #include <algorithm>
+#include <map>
+#include <cmath>
 #include "parameter_server.h"
 #include <cv.h>
 #include "scoped_timer.h"
+#include "keypoint_budget.h"
 
 #include "g2o/types/slam3d/se3quat.h"
 #include "g2o/types/slam3d/vertex_se3.h"
@@ -35,6 +46,7 @@
 #if CV_MAJOR_VERSION > 2 || CV_MINOR_VERSION >= 4
 #include "opencv2/core/core.hpp"
 #include "opencv2/features2d/features2d.hpp"
+#include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/highgui/highgui.hpp"
 #include "opencv2/nonfree/nonfree.hpp"
 #endif
@@ -279,15 +291,19 @@ g2o::SE3Quat eigen2G2O(const Eigen::Matrix4d& eigen_mat)
 
 using namespace cv;
 ///Analog to opencv example file and modified to use adjusters
-FeatureDetector* createDetector( const string& detectorType ) 
+FeatureDetector* createDetector( const string& detectorType, int min_keypoints, int max_keypoints ) 
 {
 	ParameterServer* params = ParameterServer::instance();
 	FeatureDetector* fd = 0;
+  KeypointBudget* budget = KeypointBudget::instance();
+  const int min_kp = min_keypoints >= 0 ? min_keypoints : budget->minKeypoints();
+  const int max_kp = max_keypoints >= 0 ? max_keypoints : budget->maxKeypoints();
+  const double threshold_factor = budget->thresholdFactor(); //Initial threshold of the adjusters
     if( !detectorType.compare( "FAST" ) ) {
         //fd = new FastFeatureDetector( 20/*threshold*/, true/*nonmax_suppression*/ );
-        fd = new DynamicAdaptedFeatureDetector (new FastAdjuster(20,true), 
-												params->get<int>("min_keypoints"),
-												params->get<int>("max_keypoints"),
+        fd = new DynamicAdaptedFeatureDetector (new FastAdjuster(std::max(1, cvRound(20*threshold_factor)),true), 
+												min_kp,
+												max_kp,
 												params->get<int>("adjuster_max_iterations"));
     }
     else if( !detectorType.compare( "STAR" ) ) {
@@ -307,9 +323,13 @@ FeatureDetector* createDetector( const string& detectorType )
     }
     else if( !detectorType.compare( "SURF" ) ) {
       /* fd = new SurfFeatureDetector(200.0, 6, 5); */
+#if CV_MAJOR_VERSION > 2 || CV_MINOR_VERSION >= 4
+        fd = new DynamicAdaptedFeatureDetector(new SurfAdjuster(400.0*threshold_factor),
+#else
         fd = new DynamicAdaptedFeatureDetector(new SurfAdjuster(),
-        										params->get<int>("min_keypoints"),
-                            params->get<int>("max_keypoints")+300,
+#endif
+        										min_kp,
+                            max_kp+300,
                             params->get<int>("adjuster_max_iterations"));
     }
     else if( !detectorType.compare( "MSER" ) ) {
@@ -319,11 +339,11 @@ FeatureDetector* createDetector( const string& detectorType )
     }
     else if( !detectorType.compare( "GFTT" ) ) {
         ROS_INFO("Creating GFTT detector as fallback.");
-        fd = new GoodFeaturesToTrackDetector( params->get<int>("max_keypoints"), 0.0001, 2.0, 9);
+        fd = new GoodFeaturesToTrackDetector( max_kp, 0.0001, 2.0, 9);
     }
     else if( !detectorType.compare( "ORB" ) ) {
 #if CV_MAJOR_VERSION > 2 || CV_MINOR_VERSION == 3
-        fd = new OrbFeatureDetector(params->get<int>("max_keypoints")+1500,
+        fd = new OrbFeatureDetector(max_kp+1500,
                 ORB::CommonParams(1.2, ORB::CommonParams::DEFAULT_N_LEVELS, 31, ORB::CommonParams::DEFAULT_FIRST_LEVEL));
 #elif CV_MAJOR_VERSION > 2 || CV_MINOR_VERSION >= 4
         fd = new OrbFeatureDetector();
@@ -334,11 +354,11 @@ FeatureDetector* createDetector( const string& detectorType )
     else if( !detectorType.compare( "SIFTGPU" ) ) {
       ROS_INFO("%s is to be used", detectorType.c_str());
       ROS_DEBUG("Creating SURF detector as fallback.");
-      fd = createDetector("SURF"); //recursive call with correct parameter
+      fd = createDetector("SURF", min_keypoints, max_keypoints); //recursive call with correct parameter
     }
     else {
       ROS_WARN("No valid detector-type given: %s. Using SURF.", detectorType.c_str());
-      fd = createDetector("SURF"); //recursive call with correct parameter
+      fd = createDetector("SURF", min_keypoints, max_keypoints); //recursive call with correct parameter
     }
     ROS_ERROR_COND(fd == 0, "No detector could be created");
     return fd;
@@ -370,6 +390,120 @@ DescriptorExtractor* createDescriptorExtractor( const string& descriptorType )
     return extractor;
 }
 
+static bool strongerResponse(const cv::KeyPoint& a, const cv::KeyPoint& b){
+  return a.response > b.response;
+}
+
+//!The detectors of the cells, cached per thread (i.e., per construction worker), see detectFeaturesTiled
+struct TiledDetectors {
+  unsigned int generation;
+  std::string detector_type;
+  int grid_rows, grid_cols;
+  std::vector<cv::Ptr<cv::FeatureDetector> > detectors; ///<NULL for cells without budget
+  std::vector<int> max_keypoints;                        ///<Budget of the cells
+};
+static QThreadStorage<TiledDetectors*> tiled_detectors;
+
+void detectFeaturesTiled(const cv::Mat& image, const cv::Mat& mask, std::vector<cv::KeyPoint>& keypoints)
+{
+  ScopedTimer s(__FUNCTION__);
+  ParameterServer* ps = ParameterServer::instance();
+  const int grid_rows = std::max(1, ps->get<int>("detector_grid_rows"));
+  const int grid_cols = std::max(1, ps->get<int>("detector_grid_cols"));
+  const int cells = grid_rows * grid_cols;
+  KeypointBudget* budget = KeypointBudget::instance();
+  const std::string detector_type = ps->get<std::string>("feature_detector_type");
+  //Detectors don't find features close to the image border. Overlap the cells, s.t. there are no gaps at the seams
+  const int margin = 32;
+
+  //Create the detectors only for a new budget, not for every frame
+  if(!tiled_detectors.hasLocalData()) tiled_detectors.setLocalData(new TiledDetectors());
+  TiledDetectors* cached = tiled_detectors.localData();
+  const unsigned int generation = budget->generation();
+  if(cached->detectors.empty() || cached->generation != generation || cached->detector_type != detector_type ||
+     cached->grid_rows != grid_rows || cached->grid_cols != grid_cols)
+  {
+    //Each cell gets its share of the budget, the remainder goes to the first cells. The total must not
+    //exceed max_keypoints, otherwise the projection truncates the features of the last cells
+    const int max_total = budget->maxKeypoints(), min_total = budget->minKeypoints();
+    cached->detectors.assign(cells, cv::Ptr<cv::FeatureDetector>());
+    cached->max_keypoints.resize(cells);
+    for(int cell = 0; cell < cells; cell++){
+      const int max_kp = max_total / cells + (cell < max_total % cells ? 1 : 0);
+      const int min_kp = std::min(max_kp, min_total / cells + (cell < min_total % cells ? 1 : 0));
+      if(max_kp > 0) cached->detectors[cell] = createDetector(detector_type, min_kp, max_kp);
+      cached->max_keypoints[cell] = max_kp;
+    }
+    cached->generation = generation;
+    cached->detector_type = detector_type;
+    cached->grid_rows = grid_rows;
+    cached->grid_cols = grid_cols;
+  }
+
+  std::vector<std::vector<cv::KeyPoint> > cell_keypoints(cells);
+  #pragma omp parallel for schedule(dynamic)
+  for(int cell = 0; cell < cells; cell++){
+    cv::Ptr<cv::FeatureDetector>& detector = cached->detectors[cell];
+    if(detector.empty()) continue;
+    const int max_kp = cached->max_keypoints[cell];
+    const int r = cell / grid_cols, c = cell % grid_cols;
+    const int left = c * image.cols / grid_cols, right = (c+1) * image.cols / grid_cols;
+    const int top = r * image.rows / grid_rows, bottom = (r+1) * image.rows / grid_rows;
+    cv::Rect roi(left - margin, top - margin, right - left + 2*margin, bottom - top + 2*margin);
+    roi &= cv::Rect(0, 0, image.cols, image.rows);
+
+    std::vector<cv::KeyPoint> found;
+    detector->detect(image(roi), found, mask.empty() ? cv::Mat() : mask(roi));
+
+    //Keep the keypoints in the cell without the margin (these are found in the neighbouring cell)
+    std::vector<cv::KeyPoint>& kept = cell_keypoints[cell];
+    kept.reserve(found.size());
+    for(size_t i = 0; i < found.size(); i++){
+      cv::KeyPoint kp = found[i];
+      kp.pt.x += roi.x;
+      kp.pt.y += roi.y;
+      if(kp.pt.x >= left && kp.pt.x < right && kp.pt.y >= top && kp.pt.y < bottom){
+        kept.push_back(kp);
+      }
+    }
+    if(kept.size() > (size_t)max_kp){
+      std::partial_sort(kept.begin(), kept.begin() + max_kp, kept.end(), strongerResponse);
+      kept.resize(max_kp);
+    }
+  }
+
+  keypoints.clear();
+  for(int cell = 0; cell < cells; cell++){
+    keypoints.insert(keypoints.end(), cell_keypoints[cell].begin(), cell_keypoints[cell].end());
+  }
+  ROS_DEBUG("Detected %zu keypoints in %d cells", keypoints.size(), cells);
+}
+
+void computeDescriptorsParallel(const cv::Mat& image, std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors)
+{
+  ScopedTimer s(__FUNCTION__);
+  const std::string extractor_type = ParameterServer::instance()->get<std::string>("feature_extractor_type");
+  const int chunks = std::max(1, std::min<int>(omp_get_max_threads(), keypoints.size() / 50)); //Don't bother for few keypoints
+  std::vector<std::vector<cv::KeyPoint> > chunk_keypoints(chunks);
+  std::vector<cv::Mat> chunk_descriptors(chunks);
+  for(int i = 0; i < chunks; i++){
+    chunk_keypoints[i].assign(keypoints.begin() + keypoints.size() * i / chunks,
+                              keypoints.begin() + keypoints.size() * (i+1) / chunks);
+  }
+  #pragma omp parallel for schedule(dynamic)
+  for(int i = 0; i < chunks; i++){
+    cv::Ptr<cv::DescriptorExtractor> extractor(createDescriptorExtractor(extractor_type));
+    extractor->compute(image, chunk_keypoints[i], chunk_descriptors[i]);
+  }
+  keypoints.clear();
+  descriptors.release();
+  for(int i = 0; i < chunks; i++){
+    if(chunk_keypoints[i].empty()) continue;
+    keypoints.insert(keypoints.end(), chunk_keypoints[i].begin(), chunk_keypoints[i].end());
+    descriptors.push_back(chunk_descriptors[i]);
+  }
+}
+
 //Little debugging helper functions
 std::string openCVCode2String(unsigned int code){
   switch(code){
@@ -393,22 +527,95 @@ void printMatrixInfo(cv::Mat& image, std::string name){
   ROS_INFO_STREAM("Matrix " << name << " - Type:" << openCVCode2String(image.type()) <<  " rows: " <<  image.rows  <<  " cols: " <<  image.cols);
 }
 
-void depthToCV8UC1(cv::Mat& depth_img, cv::Mat& mono8_img){
-  //Process images
-  if(depth_img.type() == CV_32FC1){
-    depth_img.convertTo(mono8_img, CV_8UC1, 100,0); //milimeter (scale of mono8_img does not matter)
-  }
-  else if(depth_img.type() == CV_16UC1){
-    mono8_img = cv::Mat(depth_img.size(), CV_8UC1);
-    cv::Mat float_img;
-    depth_img.convertTo(mono8_img, CV_8UC1, 0.05, -25); //scale to 2cm
-    depth_img.convertTo(float_img, CV_32FC1, 0.001, 0);//From mm to m(scale of depth_img matters)
-    depth_img = float_img;
-  }
-  else {
+void convertDepth(cv::Mat& depth_img, cv::Mat& mono8_img, double uint16_scale){
+  ScopedTimer s(__FUNCTION__);
+  if(depth_img.type() != CV_32FC1 && depth_img.type() != CV_16UC1){
     printMatrixInfo(depth_img, "Depth Image");
     ROS_ERROR_STREAM("Don't know how to handle depth image of type "<< openCVCode2String(depth_img.type()));
+    return;
   }
+  const bool to_uint16 = ParameterServer::instance()->get<bool>("depth_as_uint16");
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const float scale = static_cast<float>(uint16_scale);
+  //Always write to fresh buffers: The input may share the data of a ros message
+  //and the previous output may still be referenced by a frame in the pipeline
+  mono8_img = cv::Mat(depth_img.size(), CV_8UC1);
+  cv::Mat output;
+  if(depth_img.type() == CV_32FC1){
+    if(to_uint16) output.create(depth_img.size(), CV_16UC1);
+    else output = depth_img; //Already in the desired format
+  } else {
+    if(to_uint16 && uint16_scale == 0.001) output = depth_img; //Already in millimeter
+    else if(to_uint16) output.create(depth_img.size(), CV_16UC1);
+    else output.create(depth_img.size(), CV_32FC1);
+  }
+  const bool write_output = output.data != depth_img.data;
+
+  //Each row is read once: the loop variants write mono8 and the requested output together.
+  //The inner loops only contain selects, which g++ vectorizes at -O3. The rounding offset is added 
+  //before clamping and the clamped value is truncated: with the clamping first, the float to integer
+  //conversion keeps g++ from vectorizing (unless -fno-trapping-math). NaN fails all comparisons below.
+  //Rounding is half up, while convertTo (used before) rounds half to even with cvRound. The results
+  //differ by one only for exact halves.
+  const int cols = depth_img.cols; //Not re-read in the loops: the mono8 stores may alias it for the compiler
+  for(int y = 0; y < depth_img.rows; y++){
+    unsigned char* mono8 = mono8_img.ptr<unsigned char>(y);
+    if(depth_img.type() == CV_32FC1){
+      const float* in = depth_img.ptr<float>(y);
+      if(write_output){ //to uint16 millimeter
+        unsigned short* out = output.ptr<unsigned short>(y);
+        for(int x = 0; x < cols; x++){
+          float v = in[x] * 100.0f + 0.5f; //centimeter, full white at 2.55 meter
+          v = v >= 0.5f ? v : 0.0f;
+          v = v <= 255.0f ? v : 255.0f;
+          mono8[x] = static_cast<unsigned char>(v);
+          float mm = in[x] * 1000.0f + 0.5f;
+          mm = (mm > 0.5f && mm < 65535.5f) ? mm : 0.0f; //0 marks missing values
+          out[x] = static_cast<unsigned short>(mm);
+        }
+      } else {
+        for(int x = 0; x < cols; x++){
+          float v = in[x] * 100.0f + 0.5f;
+          v = v >= 0.5f ? v : 0.0f;
+          v = v <= 255.0f ? v : 255.0f;
+          mono8[x] = static_cast<unsigned char>(v);
+        }
+      }
+    } else {
+      const unsigned short* in = depth_img.ptr<unsigned short>(y);
+      if(write_output && to_uint16){
+        unsigned short* out = output.ptr<unsigned short>(y);
+        const float to_mm = scale * 1000.0f;
+        for(int x = 0; x < cols; x++){
+          float v = in[x] * scale * 50.0f - 25.0f + 0.5f; //scale to 2cm, offset 0.5 meter
+          v = v >= 0.5f ? v : 0.0f;
+          v = v <= 255.0f ? v : 255.0f;
+          mono8[x] = static_cast<unsigned char>(v);
+          float mm = in[x] * to_mm + 0.5f;
+          mm = mm < 65535.5f ? mm : 0.0f;
+          out[x] = static_cast<unsigned short>(mm);
+        }
+      } else if(write_output){ //to float meter
+        float* out = output.ptr<float>(y);
+        for(int x = 0; x < cols; x++){
+          const float raw = in[x];
+          float v = raw * scale * 50.0f - 25.0f + 0.5f;
+          v = v >= 0.5f ? v : 0.0f;
+          v = v <= 255.0f ? v : 255.0f;
+          mono8[x] = static_cast<unsigned char>(v);
+          out[x] = raw != 0.0f ? raw * scale : nan; //From raw units to m(scale of depth_img matters)
+        }
+      } else {
+        for(int x = 0; x < cols; x++){
+          float v = in[x] * scale * 50.0f - 25.0f + 0.5f;
+          v = v >= 0.5f ? v : 0.0f;
+          v = v <= 255.0f ? v : 255.0f;
+          mono8[x] = static_cast<unsigned char>(v);
+        }
+      }
+    }
+  }
+  depth_img = output;
 }
 
 bool asyncFrameDrop(ros::Time depth, ros::Time rgb)
@@ -429,6 +636,42 @@ bool asyncFrameDrop(ros::Time depth, ros::Time rgb)
   return false;
 }
 
+void computeThumbnails(const cv::Mat& visual, const cv::Mat& depth, 
+                       cv::Mat& intensity_thumb, cv::Mat& depth_thumb, int width)
+{
+  cv::Size thumb_size(width, (visual.rows * width) / visual.cols);
+  cv::Mat small_visual;
+  cv::resize(visual, small_visual, thumb_size, 0, 0, cv::INTER_AREA);
+  if(small_visual.channels() == 3){
+    cv::cvtColor(small_visual, small_visual, CV_RGB2GRAY);
+  }
+  small_visual.convertTo(intensity_thumb, CV_32FC1);
+  if(depth.empty()){
+    depth_thumb = cv::Mat();
+  } else {
+    cv::resize(depth, depth_thumb, thumb_size, 0, 0, cv::INTER_NEAREST); //Don't mix NaNs with valid depth
+    if(depth_thumb.type() == CV_16UC1) depth_thumb.convertTo(depth_thumb, CV_32FC1, 0.001); //0 is ignored like NaN
+  }
+}
+
+double meanDepthDifference(const cv::Mat& depth_thumb1, const cv::Mat& depth_thumb2)
+{
+  double sum = 0.0;
+  unsigned int count = 0;
+  for(int y = 0; y < depth_thumb1.rows; y++){
+    const float* row1 = depth_thumb1.ptr<float>(y);
+    const float* row2 = depth_thumb2.ptr<float>(y);
+    for(int x = 0; x < depth_thumb1.cols; x++){
+      if(row1[x] > 0.0f && row2[x] > 0.0f){ //false for NaN
+        sum += std::fabs(row1[x] - row2[x]);
+        count++;
+      }
+    }
+  }
+  if(count < (unsigned int)(depth_thumb1.total() / 10)) return std::numeric_limits<double>::infinity();
+  return sum / count;
+}
+
 
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/CameraInfo.h>
@@ -449,6 +692,49 @@ typedef union
 } RGBValue;
 ///\endcond
 
+///\cond
+/** Back-projection offsets of the sampled columns (or rows) of an image, 
+ *  cached by createXYZRGBPointCloud for the last used intrinsics and skip step */
+struct RayTable {
+  float f, c; ///<reciprocal focal length and principal point coordinate
+  int step, size;
+  std::vector<float> offset;  ///<(u - c) for u = 0, step, 2*step, ...
+  std::vector<float> no_depth; ///<(u - c) * 1.0 * f, the coordinate used for points without depth
+};
+///\endcond
+
+///c ? a : b, as bitwise blend. g++ does not if-convert several selects on one condition (the
+///arithmetic of the operands is sunk into branches), so loops with "?:" are not vectorized
+static inline float selectFloat(bool c, float a, float b)
+{
+  uint32_t bits_a, bits_b;
+  memcpy(&bits_a, &a, sizeof(float));
+  memcpy(&bits_b, &b, sizeof(float));
+  const uint32_t mask = -static_cast<uint32_t>(c);
+  const uint32_t bits = (bits_a & mask) | (bits_b & ~mask);
+  float result;
+  memcpy(&result, &bits, sizeof(float));
+  return result;
+}
+
+///Get the table for the given parameters. Returns the cached table if unchanged. Thread-safe
+static boost::shared_ptr<const RayTable> getRayTable(boost::shared_ptr<const RayTable>& cached, float f, float c, int step, int size)
+{
+  static QMutex mutex;
+  QMutexLocker locker(&mutex);
+  if(!cached || cached->f != f || cached->c != c || cached->step != step || cached->size != size){
+    RayTable* table = new RayTable();
+    table->f = f; table->c = c; table->step = step; table->size = size;
+    for(int u = 0; u < size; u += step){
+      //Same expressions as used per pixel before, so the cloud stays bit-identical
+      table->offset.push_back(u - c);
+      table->no_depth.push_back((u - c) * 1.0 * f);
+    }
+    cached.reset(table);
+  }
+  return cached;
+}
+
 pointcloud_type* createXYZRGBPointCloud (const cv::Mat& depth_img, 
                                          const cv::Mat& rgb_img,
                                          const sensor_msgs::CameraInfoConstPtr& cam_info) 
@@ -457,93 +743,124 @@ pointcloud_type* createXYZRGBPointCloud (const cv::Mat& depth_img,
   pointcloud_type* cloud (new pointcloud_type() );
   cloud->is_dense         = false; //single point of view, 2d rasterized NaN where no depth value was found
 
+  //Read all parameters once
   ParameterServer* ps = ParameterServer::instance();
-  float fx = 1./ (ps->get<double>("depth_camera_fx") > 0 ? ps->get<double>("depth_camera_fx") : cam_info->K[0]); //(cloud->width >> 1) - 0.5f;
-  float fy = 1./ (ps->get<double>("depth_camera_fy") > 0 ? ps->get<double>("depth_camera_fy") : cam_info->K[4]); //(cloud->width >> 1) - 0.5f;
-  float cx = ps->get<double>("depth_camera_cx") > 0 ? ps->get<double>("depth_camera_cx") : cam_info->K[2]; //(cloud->width >> 1) - 0.5f;
-  float cy = ps->get<double>("depth_camera_cy") > 0 ? ps->get<double>("depth_camera_cy") : cam_info->K[5]; //(cloud->width >> 1) - 0.5f;
-  int data_skip_step = ParameterServer::instance()->get<int>("cloud_creation_skip_step");
+  const double param_fx = ps->get<double>("depth_camera_fx"), param_fy = ps->get<double>("depth_camera_fy");
+  const double param_cx = ps->get<double>("depth_camera_cx"), param_cy = ps->get<double>("depth_camera_cy");
+  const float fx = 1./ (param_fx > 0 ? param_fx : cam_info->K[0]);
+  const float fy = 1./ (param_fy > 0 ? param_fy : cam_info->K[4]);
+  const float cx = param_cx > 0 ? param_cx : cam_info->K[2];
+  const float cy = param_cy > 0 ? param_cy : cam_info->K[5];
+  const int data_skip_step = ps->get<int>("cloud_creation_skip_step");
+  const double depth_scaling = ps->get<double>("depth_scaling_factor");
+  const float min_depth = ps->get<double>("minimum_depth");
+  const bool encoding_bgr = ps->get<bool>("encoding_bgr");
   if(depth_img.rows % data_skip_step != 0 || depth_img.cols % data_skip_step != 0){
     ROS_WARN("The parameter cloud_creation_skip_step is not a divisor of the depth image dimensions. This will most likely crash the program!");
   }
   cloud->height = ceil(depth_img.rows / static_cast<float>(data_skip_step));
   cloud->width = ceil(depth_img.cols / static_cast<float>(data_skip_step));
-  //cx = cam_info->K[2]; //(cloud->width >> 1) - 0.5f;
-  //cy = cam_info->K[5]; //(cloud->height >> 1) - 0.5f;
-  //fx = 1.0f / cam_info->K[0]; 
-  //fy = 1.0f / cam_info->K[4]; 
   int pixel_data_size = 3;
-  //Assume BGR
-  //char red_idx = 2, green_idx = 1, blue_idx = 0;
   //Assume RGB
-  char red_idx = 0, green_idx = 1, blue_idx = 2;
+  int red_idx = 0, green_idx = 1, blue_idx = 2;
   if(rgb_img.type() == CV_8UC1) pixel_data_size = 1;
-  else if(ParameterServer::instance()->get<bool>("encoding_bgr")) { red_idx = 2; blue_idx = 0; }
+  else if(encoding_bgr) { red_idx = 2; blue_idx = 0; }
 
-  unsigned int color_row_step, color_pix_step, depth_pix_step, depth_row_step;
-  color_pix_step = pixel_data_size * (rgb_img.cols / cloud->width);
-  color_row_step = pixel_data_size * (rgb_img.rows / cloud->height -1 ) * rgb_img.cols;
-  depth_pix_step = (depth_img.cols / cloud->width);
-  depth_row_step = (depth_img.rows / cloud->height -1 ) * depth_img.cols;
+  const size_t color_pix_step = pixel_data_size * (rgb_img.cols / cloud->width);
+  const size_t color_row_step = pixel_data_size * (rgb_img.rows / cloud->height -1 ) * rgb_img.cols;
+  const size_t depth_pix_step = (depth_img.cols / cloud->width);
+  const size_t depth_row_step = (depth_img.rows / cloud->height -1 ) * depth_img.cols;
+  const size_t color_end = rgb_img.total()*color_pix_step; //Only necessary because of the former color_idx offset hack
+  const bool depth_is_uint16 = depth_img.type() == CV_16UC1; //millimeter, see convertDepth
+  const float nan = std::numeric_limits<float>::quiet_NaN();
 
   cloud->points.resize (cloud->height * cloud->width);
 
-  //const uint8_t* rgb_buffer = &rgb_msg->data[0];
-
-  // depth_img already has the desired dimensions, but rgb_img may be higher res.
-  int color_idx = 0 * color_pix_step - 0 * color_row_step, depth_idx = 0; //FIXME: Hack for hard-coded calibration of color to depth
-  double depth_scaling = ParameterServer::instance()->get<double>("depth_scaling_factor");
-  float max_depth = ParameterServer::instance()->get<double>("maximum_depth");
-  float min_depth = ParameterServer::instance()->get<double>("minimum_depth");
-  if(max_depth < 0.0) max_depth = std::numeric_limits<float>::infinity();
-
-  pointcloud_type::iterator pt_iter = cloud->begin();
-  for (int v = 0; v < (int)rgb_img.rows; v += data_skip_step, color_idx += color_row_step, depth_idx += depth_row_step)
+  //The points are sampled from the grid of the rgb image, point i of row v is pixel (i*step, v*step)
+  static boost::shared_ptr<const RayTable> cached_cols, cached_rows;
+  boost::shared_ptr<const RayTable> cols = getRayTable(cached_cols, fx, cx, data_skip_step, rgb_img.cols);
+  boost::shared_ptr<const RayTable> rows = getRayTable(cached_rows, fy, cy, data_skip_step, rgb_img.rows);
+  const int points_per_row = cols->offset.size();
+  const int row_count = rows->offset.size();
+  const size_t point_count = cloud->points.size();
+  //Offsets between the first pixels of two subsequent rows
+  const size_t depth_row_stride = points_per_row * depth_pix_step + depth_row_step;
+  const size_t color_row_stride = points_per_row * color_pix_step + color_row_step;
+  //Number of sampled columns within the depth image
+  const int valid_per_row = std::min(points_per_row, (depth_img.cols + data_skip_step - 1) / data_skip_step);
+
+  #pragma omp parallel
   {
-    for (int u = 0; u < (int)rgb_img.cols; u += data_skip_step, color_idx += color_pix_step, depth_idx += depth_pix_step, ++pt_iter)
+    std::vector<float> row_x(points_per_row), row_y(points_per_row), row_z(points_per_row);
+    #pragma omp for schedule(static)
+    for(int vi = 0; vi < row_count; vi++)
     {
-      if(pt_iter == cloud->end()){
-        break;
-      }
-      point_type& pt = *pt_iter;
-      if(u < 0 || v < 0 || u >= depth_img.cols || v >= depth_img.rows){
-        pt.x = std::numeric_limits<float>::quiet_NaN();
-        pt.y = std::numeric_limits<float>::quiet_NaN();
-        pt.z = std::numeric_limits<float>::quiet_NaN();
-        continue;
+      const size_t first_point = static_cast<size_t>(vi) * points_per_row;
+      if(first_point >= point_count) continue;
+      const int n = std::min<size_t>(points_per_row, point_count - first_point);
+      const int v = vi * data_skip_step;
+      const int n_valid = v < depth_img.rows ? std::min(n, valid_per_row) : 0;
+
+      //Depth in meter
+      const size_t depth_row_start = vi * depth_row_stride;
+      if(depth_is_uint16){
+        const unsigned short* depth = reinterpret_cast<const unsigned short*>(depth_img.data) + depth_row_start;
+        for(int i = 0; i < n_valid; i++){
+          unsigned short mm = depth[i * depth_pix_step];
+          row_z[i] = selectFloat(mm != 0, static_cast<float>(mm * 0.001f * depth_scaling), nan);
+        }
+      } else {
+        const float* depth = reinterpret_cast<const float*>(depth_img.data) + depth_row_start;
+        for(int i = 0; i < n_valid; i++){
+          row_z[i] = depth[i * depth_pix_step] * depth_scaling;
+        }
       }
 
-      float Z = depth_img.at<float>(depth_idx) * depth_scaling;
-
-      // Check for invalid measurements
-      if (!(Z >= min_depth)) //Should also be trigger on NaN//std::isnan (Z))
-      {
-        pt.x = (u - cx) * 1.0 * fx; //FIXME: better solution as to act as at 1meter?
-        pt.y = (v - cy) * 1.0 * fy;
-        pt.z = std::numeric_limits<float>::quiet_NaN();
+      //Back-projection. Branch-free, so it can be vectorized by the compiler
+      const float* offset_x = &cols->offset[0];
+      const float* no_depth_x = &cols->no_depth[0];
+      const float offset_y = rows->offset[vi];
+      const float no_depth_y = rows->no_depth[vi];
+      float* out_x = &row_x[0];
+      float* out_y = &row_y[0];
+      float* out_z = &row_z[0];
+      for(int i = 0; i < n_valid; i++){
+        const float Z = out_z[i];
+        const bool valid = Z >= min_depth; //false for NaN
+        const float x = offset_x[i] * Z * fx;
+        const float y = offset_y * Z * fy;
+        out_x[i] = selectFloat(valid, x, no_depth_x[i]); //FIXME: better solution as to act as at 1meter?
+        out_y[i] = selectFloat(valid, y, no_depth_y);
+        out_z[i] = selectFloat(valid, Z, nan);
       }
-      else // Fill in XYZ
+
+      //Write the points
+      const uint8_t* color = rgb_img.data;
+      size_t color_idx = vi * color_row_stride;
+      pointcloud_type::iterator pt_iter = cloud->begin() + first_point;
+      for(int i = 0; i < n; i++, color_idx += color_pix_step, ++pt_iter)
       {
-        pt.x = (u - cx) * Z * fx;
-        pt.y = (v - cy) * Z * fy;
-        pt.z = Z;
-      }
-      // Fill in color
-      RGBValue color;
-      if(color_idx > 0 && color_idx < rgb_img.total()*color_pix_step){ //Only necessary because of the color_idx offset 
-        if(pixel_data_size == 3){
-          color.Red   = rgb_img.at<uint8_t>(color_idx + red_idx);
-          color.Green = rgb_img.at<uint8_t>(color_idx + green_idx);
-          color.Blue  = rgb_img.at<uint8_t>(color_idx + blue_idx);
-        } else {
-          color.Red   = color.Green = color.Blue  = rgb_img.at<uint8_t>(color_idx);
+        point_type& pt = *pt_iter;
+        if(i >= n_valid){ //Outside of the depth image
+          pt.x = pt.y = pt.z = nan;
+          continue;
         }
-        color.Alpha = 0;
+        pt.x = row_x[i];
+        pt.y = row_y[i];
+        pt.z = row_z[i];
+        if(color_idx > 0 && color_idx < color_end){ 
+          uint32_t packed; //Memory layout of the rgb float: blue, green, red, alpha(=0)
+          if(pixel_data_size == 3){
+            packed = (uint32_t(color[color_idx + red_idx]) << 16) | (uint32_t(color[color_idx + green_idx]) << 8) | color[color_idx + blue_idx];
+          } else {
+            packed = (uint32_t(color[color_idx]) << 16) | (uint32_t(color[color_idx]) << 8) | color[color_idx];
+          }
 #ifndef RGB_IS_4TH_DIM
-        pt.rgb = color.float_value;
+          memcpy(&pt.rgb, &packed, sizeof(float));
 #else
-        pt.data[3] = color.float_value;
+          memcpy(&pt.data[3], &packed, sizeof(float));
 #endif
+        }
       }
     }
   }
@@ -700,14 +1017,15 @@ double errorFunction2(const Eigen::Vector4f& x1,
                       const Eigen::Vector4f& x2,
                       const Eigen::Matrix4f& tf_1_to_2)
 {
-  static const double cam_angle_x = 58.0/180.0*M_PI;/*{{{*/
-  static const double cam_angle_y = 45.0/180.0*M_PI;
-  static const double cam_resol_x = 640;
-  static const double cam_resol_y = 480;
-  static const double raster_stddev_x = 3*tan(cam_angle_x/cam_resol_x);  //5pix stddev in x
-  static const double raster_stddev_y = 3*tan(cam_angle_y/cam_resol_y);  //5pix stddev in y
-  static const double raster_cov_x = raster_stddev_x * raster_stddev_x;
-  static const double raster_cov_y = raster_stddev_y * raster_stddev_y;/*}}}*/
+  return errorFunction2(x1, featureDepthCovariance(x1(2)), x2, featureDepthCovariance(x2(2)), tf_1_to_2);
+}
+
+double errorFunction2(const Eigen::Vector4f& x1, double x1_depth_cov,
+                      const Eigen::Vector4f& x2, double x2_depth_cov,
+                      const Eigen::Matrix4f& tf_1_to_2)
+{
+  static const double raster_cov_x = rasterCovarianceX();
+  static const double raster_cov_y = rasterCovarianceY();
 
   ROS_WARN_COND(x1(3) != 1.0, "4th element of x1 should be 1.0, is %f", x1(3));
   ROS_WARN_COND(x2(3) != 1.0, "4th element of x2 should be 1.0, is %f", x2(3));
@@ -724,6 +1042,7 @@ double errorFunction2(const Eigen::Vector4f& x1,
     x_1 = x2.cast<double>();
     x_2 = x1.cast<double>();
     x_2(2) = 1.0; //FIXME: Bad Hack 
+    std::swap(x1_depth_cov, x2_depth_cov);
     tf_12 = tf_12.inverse().eval();
     nan1 = false;
     nan2 = true;
@@ -739,15 +1058,13 @@ double errorFunction2(const Eigen::Vector4f& x1,
   Eigen::Matrix3d cov1 = Eigen::Matrix3d::Zero();
   cov1(0,0) = 1 * raster_cov_x * mu_1(2); //how big is 1px std dev in meter, depends on depth
   cov1(1,1) = 1 * raster_cov_y * mu_1(2); //how big is 1px std dev in meter, depends on depth
-  if(nan1) cov1(2,2) = 1e9; //stddev for unknown: should be within 100m
-  else     cov1(2,2) = depth_covariance(mu_1(2));
+  cov1(2,2) = x1_depth_cov;
 
   //Point2
   Eigen::Matrix3d cov2 = Eigen::Matrix3d::Zero();
   cov2(0,0) = 1 * raster_cov_x* mu_2(2); //how big is 1px std dev in meter, depends on depth
   cov2(1,1) = 1 * raster_cov_y* mu_2(2); //how big is 1px std dev in meter, depends on depth
-  if(nan2) cov2(2,2) = 1e9; //stddev for unknown: should be within 100m
-  else     cov2(2,2) = depth_covariance(mu_2(2));
+  cov2(2,2) = x2_depth_cov;
 
   Eigen::Matrix3d cov1_in_frame_2 = rotation_mat.transpose() * cov1 * rotation_mat;//Works since the cov is diagonal => Eig-Vec-Matrix is Identity
 
@@ -778,6 +1095,66 @@ double errorFunction2(const Eigen::Vector4f& x1,
 
 
 
+void errorFunction2Batch(const FeatureBlock& block1, const FeatureBlock& block2,
+                         const std::vector<cv::DMatch>& matches, const Eigen::Matrix4f& tf_1_to_2,
+                         std::vector<float>& sqrd_distances, std::vector<float>& error_bounds)
+{
+  const int n = matches.size();
+  sqrd_distances.resize(n);
+  error_bounds.resize(n);
+  const float r00 = tf_1_to_2(0,0), r01 = tf_1_to_2(0,1), r02 = tf_1_to_2(0,2), t0 = tf_1_to_2(0,3);
+  const float r10 = tf_1_to_2(1,0), r11 = tf_1_to_2(1,1), r12 = tf_1_to_2(1,2), t1 = tf_1_to_2(1,3);
+  const float r20 = tf_1_to_2(2,0), r21 = tf_1_to_2(2,1), r22 = tf_1_to_2(2,2), t2 = tf_1_to_2(2,3);
+  const float abs_t = std::fabs(t0) + std::fabs(t1) + std::fabs(t2);
+  const float eps = std::numeric_limits<float>::epsilon();
+  //The indexed loads can't be vectorized. Gather the features of a chunk of matches into contiguous 
+  //arrays first, then compute the chunk in a branch free loop, which the compiler vectorizes
+  const int chunk = 64;
+  float x1[chunk], y1[chunk], z1[chunk], x2[chunk], y2[chunk], z2[chunk];
+  float c1x[chunk], c1y[chunk], c1z[chunk], c2x[chunk], c2y[chunk], c2z[chunk];
+  for(int start = 0; start < n; start += chunk){
+    const int count = std::min(chunk, n - start);
+    for(int j = 0; j < count; j++){
+      const int q = matches[start+j].queryIdx, t = matches[start+j].trainIdx;
+      x1[j] = block1.x[q]; y1[j] = block1.y[q]; z1[j] = block1.z[q];
+      x2[j] = block2.x[t]; y2[j] = block2.y[t]; z2[j] = block2.z[t];
+      c1x[j] = block1.cov_x[q]; c1y[j] = block1.cov_y[q]; c1z[j] = block1.cov_z[q];
+      c2x[j] = block2.cov_x[t]; c2y[j] = block2.cov_y[t]; c2z[j] = block2.cov_z[t];
+    }
+    float* dists = &sqrd_distances[start];
+    float* bounds = &error_bounds[start];
+    for(int j = 0; j < count; j++){
+      //Δμ = T μ₁ - μ₂
+      const float d0 = r00*x1[j] + r01*y1[j] + r02*z1[j] + t0 - x2[j];
+      const float d1 = r10*x1[j] + r11*y1[j] + r12*z1[j] + t1 - y2[j];
+      const float d2 = r20*x1[j] + r21*y1[j] + r22*z1[j] + t2 - z2[j];
+      //Σc = Rᵀ Σ₁ R + Σ₂ (as in errorFunction2), symmetric
+      const float a = r00*r00*c1x[j] + r10*r10*c1y[j] + r20*r20*c1z[j] + c2x[j];
+      const float b = r00*r01*c1x[j] + r10*r11*c1y[j] + r20*r21*c1z[j];
+      const float c = r00*r02*c1x[j] + r10*r12*c1y[j] + r20*r22*c1z[j];
+      const float d = r01*r01*c1x[j] + r11*r11*c1y[j] + r21*r21*c1z[j] + c2y[j];
+      const float e = r01*r02*c1x[j] + r11*r12*c1y[j] + r21*r22*c1z[j];
+      const float f = r02*r02*c1x[j] + r12*r12*c1y[j] + r22*r22*c1z[j] + c2z[j];
+      //ΔμT Σc⁻¹Δμ via the adjugate
+      const float A00 = d*f - e*e, A01 = c*e - b*f, A02 = b*e - c*d;
+      const float A11 = a*f - c*c, A12 = b*c - a*e, A22 = a*d - b*b;
+      const float det = a*A00 + b*A01 + c*A02;
+      const float quad = d0*d0*A00 + d1*d1*A11 + d2*d2*A22 + 2.0f*(d0*d1*A01 + d0*d2*A02 + d1*d2*A12);
+      const float dist = quad / det;
+      dists[j] = dist;
+      //Bound of the deviation from the double precision result. The condition of Σc is at most the ratio of the 
+      //largest to the smallest sum of diagonal entries. Δμ carries the rounding error of the transformation
+      const float min_cov = std::min(std::min(c1x[j], c1y[j]), c1z[j]) + std::min(std::min(c2x[j], c2y[j]), c2z[j]);
+      const float max_cov = std::max(std::max(c1x[j], c1y[j]), c1z[j]) + std::max(std::max(c2x[j], c2y[j]), c2z[j]);
+      const float condition = max_cov / min_cov;
+      const float delta_error = 8.0f * eps * (std::fabs(x1[j]) + std::fabs(y1[j]) + std::fabs(z1[j]) + abs_t + 
+                                              std::fabs(x2[j]) + std::fabs(y2[j]) + std::fabs(z2[j]));
+      const float delta_term = delta_error * delta_error / min_cov;
+      bounds[j] = 64.0f * eps * condition * dist + 2.0f * std::sqrt(dist * delta_term) + delta_term;
+    }
+  }
+}
+
 float getMinDepthInNeighborhood(const cv::Mat& depth, cv::Point2f center, float diameter){
     // Get neighbourhood area of keypoint
     int radius = (diameter - 1)/2;
@@ -788,6 +1165,11 @@ float getMinDepthInNeighborhood(const cv::Mat& depth, cv::Point2f center, float
 
     cv::Mat neigborhood(depth, cv::Range(top, bot), cv::Range(left,right));
     double minZ = std::numeric_limits<float>::quiet_NaN();
+    if(depth.type() == CV_16UC1){ //Millimeter, zero for missing values
+      double maxZ = 0.0;
+      cv::minMaxLoc(neigborhood, &minZ, &maxZ, NULL, NULL, neigborhood > 0);
+      return maxZ > 0.0 ? static_cast<float>(minZ * 0.001) : std::numeric_limits<float>::quiet_NaN();
+    }
     cv::minMaxLoc(neigborhood, &minZ);
     if(minZ == 0.0){ //FIXME: Why are there features with depth set to zero?
       ROS_WARN_THROTTLE(1,"Caught feature with zero in depth neighbourhood");
@@ -797,6 +1179,96 @@ float getMinDepthInNeighborhood(const cv::Mat& depth, cv::Point2f center, float
     return static_cast<float>(minZ);
 }
 
+///Minimum of the rows [top,bot) and columns [left,right)
+static inline float minInWindow(const cv::Mat& source, int top, int bot, int left, int right)
+{
+  float min_value = std::numeric_limits<float>::max();
+  for(int y = top; y < bot; y++){
+    const float* row = source.ptr<float>(y);
+    for(int x = left; x < right; x++){
+      min_value = row[x] < min_value ? row[x] : min_value;
+    }
+  }
+  return min_value;
+}
+
+void getMinDepthInNeighborhoods(const cv::Mat& depth, const std::vector<cv::KeyPoint>& keypoints, std::vector<float>& min_depths)
+{
+  ScopedTimer s(__FUNCTION__);
+  const float invalid = std::numeric_limits<float>::max();
+  const bool millimeter = depth.type() == CV_16UC1;
+  min_depths.resize(keypoints.size());
+
+  //Float copy of the depth in its original unit. Missing values (NaN or zero millimeter) become "invalid",
+  //so that they never win the minimum, as in the masked search of getMinDepthInNeighborhood
+  cv::Mat source(depth.size(), CV_32FC1);
+  for(int y = 0; y < depth.rows; y++){
+    float* out = source.ptr<float>(y);
+    if(millimeter){
+      const unsigned short* in = depth.ptr<unsigned short>(y);
+      for(int x = 0; x < depth.cols; x++) out[x] = in[x] > 0 ? (float)in[x] : invalid;
+    } else {
+      const float* in = depth.ptr<float>(y);
+      for(int x = 0; x < depth.cols; x++) out[x] = std::isnan(in[x]) ? invalid : in[x];
+    }
+  }
+
+  //Group the keypoints by the radius of their neighbourhood
+  std::map<int, std::vector<int> > by_radius;
+  for(unsigned int i = 0; i < keypoints.size(); i++){
+    int radius = (keypoints[i].size - 1)/2;
+    if(radius <= 0){ //Degenerate window, keep the exact semantics of the single lookup
+      min_depths[i] = getMinDepthInNeighborhood(depth, keypoints[i].pt, keypoints[i].size);
+      continue;
+    }
+    by_radius[radius].push_back(i);
+  }
+
+  const size_t pixel_count = depth.total();
+  int zero_depths = 0; //Counted instead of warning in the loop, ROS_WARN_THROTTLE keeps static state
+  for(std::map<int, std::vector<int> >::iterator it = by_radius.begin(); it != by_radius.end(); ++it){
+    const int radius = it->first;
+    const std::vector<int>& members = it->second;
+    //The window is [center-radius, center+radius) in both directions
+    //Erosion costs O(radius) per pixel, scanning O(radius^2) per keypoint
+    bool use_map = members.size() * radius * 8 > pixel_count;
+    cv::Mat eroded;
+    if(use_map){
+      cv::Mat kernel = cv::Mat::ones(2*radius, 2*radius, CV_8UC1); //rectangular kernels are applied separably
+      cv::erode(source, eroded, kernel, cv::Point(radius, radius), 1, cv::BORDER_CONSTANT, cv::morphologyDefaultBorderValue());
+    }
+    #pragma omp parallel for schedule(dynamic, 64) if(!use_map) reduction(+:zero_depths)
+    for(int m = 0; m < (int)members.size(); m++){
+      const cv::Point2f& center = keypoints[members[m]].pt;
+      //Window bounds computed exactly as in getMinDepthInNeighborhood
+      int top = center.y - radius, bot = center.y + radius;
+      int left = center.x - radius, right = center.x + radius;
+      int cx = center.x, cy = center.y;
+      float min_value;
+      if(use_map && top == cy - radius && bot == cy + radius && left == cx - radius && right == cx + radius){
+        min_value = eroded.at<float>(cy, cx); //The constant border of the erosion equals clipping the window
+      } else {
+        top = std::max(top, 0); bot = std::min(bot, depth.rows);
+        left = std::max(left, 0); right = std::min(right, depth.cols);
+        min_value = minInWindow(source, top, bot, left, right);
+      }
+      float min_depth;
+      if(!(min_value < invalid)){
+        min_depth = std::numeric_limits<float>::quiet_NaN();
+      } else if(millimeter){
+        min_depth = static_cast<float>(min_value * 0.001);
+      } else if(min_value == 0.0f){
+        zero_depths++;
+        min_depth = std::numeric_limits<float>::quiet_NaN();
+      } else {
+        min_depth = min_value;
+      }
+      min_depths[members[m]] = min_depth;
+    }
+  }
+  ROS_WARN_COND(zero_depths > 0, "Caught %d features with zero in depth neighbourhood", zero_depths);
+}
+
 
 //#include "parameter_server.h" //For pointcloud definitions
 #include <pcl/ros/conversions.h>
@@ -1135,3 +1607,41 @@ bool observation_criterion_met(unsigned int inliers, unsigned int outliers, unsi
   return both_criteria_met;
 }
 
+///Finalizer of splitmix64, spreads similar inputs (consecutive node ids) over the whole range
+static inline uint64 mixBits(uint64 z)
+{
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+///Entropy of this process for non-deterministic seeds. Read from /dev/urandom, falls back to wall clock and pid
+static uint64 processEntropy()
+{
+  uint64 entropy = 0;
+  std::ifstream urandom("/dev/urandom", std::ios::binary);
+  if(!urandom.read(reinterpret_cast<char*>(&entropy), sizeof(entropy))){
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    entropy = mixBits(((uint64)now.tv_sec << 20) ^ (uint64)now.tv_usec ^ ((uint64)getpid() << 40));
+  }
+  return entropy;
+}
+
+uint64 randomSeed(RandomStream stream, uint64 key1, uint64 key2)
+{
+  ParameterServer* ps = ParameterServer::instance();
+  uint64 base;
+  if(ps->get<bool>("deterministic")){
+    base = (uint64)ps->get<int>("random_seed");
+  } else {
+    //The call counter separates concurrent comparisons of the same nodes
+    static const uint64 entropy = processEntropy();
+    static QAtomicInt calls;
+    base = mixBits(entropy + 0x9e3779b97f4a7c15ULL * (uint64)(unsigned int)calls.fetchAndAddRelaxed(1));
+  }
+  uint64 seed = mixBits(base + 0x9e3779b97f4a7c15ULL * (uint64)stream);
+  seed = mixBits(seed ^ key1);
+  seed = mixBits(seed ^ key2);
+  return seed != 0 ? seed : 1; //cv::RNG replaces a zero state by its default
+}
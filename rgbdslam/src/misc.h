@@ -20,7 +20,9 @@
 #include <sensor_msgs/Image.h>
 #include <sensor_msgs/CameraInfo.h>
 #include <cv.h>
+#include <limits>
 #include "g2o/types/slam3d/vertex_se3.h"
+#include "feature_block.h"
 void printTransform(const char* name, const tf::Transform t) ;
 ///Write Transformation to textstream
 void logTransform(QTextStream& out, const tf::Transform& t, double timestamp, const char* label = NULL);
@@ -100,11 +102,31 @@ bool isSmallTrafo(const g2o::SE3Quat& t, double seconds = 1.0);
 /// Creates Feature Detector Objects accordingt to the type.
 /// Possible detectorTypes: FAST, STAR, SIFT, SURF, GFTT
 /// FAST and SURF are the self-adjusting versions (see http://opencv.willowgarage.com/documentation/cpp/features2d_common_interfaces_of_feature_detectors.html#DynamicAdaptedFeatureDetector)
-cv::FeatureDetector* createDetector( const std::string& detectorType );
+/// The keypoint bounds default to min_keypoints and max_keypoints from the parameter server
+cv::FeatureDetector* createDetector( const std::string& detectorType, int min_keypoints = -1, int max_keypoints = -1 );
 /// Create an object to extract features at keypoints. The Exctractor is passed to the Node constructor and must be the same for each node.
 cv::DescriptorExtractor* createDescriptorExtractor( const std::string& descriptorType );
-///Convert the CV_32FC1 image to CV_8UC1 with a fixed scale factor
-void depthToCV8UC1(cv::Mat& float_img, cv::Mat& mono8_img);
+/// Detect keypoints in the cells of a detector_grid_rows x detector_grid_cols grid in parallel. 
+/// Each cell gets its share of max_keypoints (in total not more than max_keypoints) and keeps its strongest keypoints,
+/// so the features are spread over the image. Uses own detector instances of type feature_detector_type, one per cell
+/// and calling thread, which are recreated when the KeypointBudget changes.
+void detectFeaturesTiled(const cv::Mat& image, const cv::Mat& mask, std::vector<cv::KeyPoint>& keypoints);
+/// Compute the descriptors for chunks of the keypoints in parallel, with own extractor instances of type feature_extractor_type.
+/// As cv::DescriptorExtractor::compute, keypoints for which no descriptor can be computed are removed
+void computeDescriptorsParallel(const cv::Mat& image, std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors);
+///Convert a CV_32FC1 (meter) or CV_16UC1 (uint16_scale meter per unit) depth image in a single pass.
+///Afterwards depth_img is CV_16UC1 in millimeter (0 where no depth was measured) if "depth_as_uint16" is set,
+///else CV_32FC1 in meter (NaN where no depth was measured). mono8_img gets a CV_8UC1 version with 
+///a fixed scale factor, for visualization and as mask for the keypoint detection.
+void convertDepth(cv::Mat& depth_img, cv::Mat& mono8_img, double uint16_scale = 0.001);
+///Depth in meter at the given pixel of an image produced by convertDepth. NaN if not measured
+inline float depthInMeter(const cv::Mat& depth, int row, int col){
+  if(depth.type() == CV_16UC1){
+    unsigned short mm = depth.at<unsigned short>(row, col);
+    return mm != 0 ? mm * 0.001f : std::numeric_limits<float>::quiet_NaN();
+  }
+  return depth.at<float>(row, col);
+}
 
 ///Return the macro string for the cv::Mat type integer
 std::string openCVCode2String(unsigned int code);
@@ -115,6 +137,14 @@ void printMatrixInfo(cv::Mat& image, std::string name = std::string(""));
 //!Return true if frames should be dropped because they are asynchronous
 bool asyncFrameDrop(ros::Time depth, ros::Time rgb);
 
+///Downsample intensity (to CV_32FC1 gray values) and depth (to CV_32FC1 meter, nearest neighbour, keeps NaNs) 
+///to the given width, for cheap comparisons of frames. depth may be empty.
+void computeThumbnails(const cv::Mat& visual, const cv::Mat& depth, 
+                       cv::Mat& intensity_thumb, cv::Mat& depth_thumb, int width = 80);
+///Mean absolute difference of two depth thumbnails over the pixels that are valid in both.
+///Returns infinity if there are too few of these pixels
+double meanDepthDifference(const cv::Mat& depth_thumb1, const cv::Mat& depth_thumb2);
+
 double errorFunction(const Eigen::Vector4f& x1, const double x1_depth_cov, 
                       const Eigen::Vector4f& x2, const double x2_depth_cov, 
                       const Eigen::Matrix4f& tf_1_to_2);
@@ -122,8 +152,22 @@ double errorFunction(const Eigen::Vector4f& x1, const double x1_depth_cov,
 double errorFunction2(const Eigen::Vector4f& x1, 
                       const Eigen::Vector4f& x2, 
                       const Eigen::Matrix4f& tf_1_to_2);
+///As above, with the depth covariances of the points given (see featureDepthCovariance)
+double errorFunction2(const Eigen::Vector4f& x1, double x1_depth_cov,
+                      const Eigen::Vector4f& x2, double x2_depth_cov,
+                      const Eigen::Matrix4f& tf_1_to_2);
+
+///errorFunction2 for all matches (queryIdx in block1, trainIdx in block2) in one batch in single precision. 
+///Only valid for features with depth. error_bounds[i] bounds the deviation of sqrd_distances[i] from errorFunction2.
+///Non-finite bounds or distances indicate, that the result has to be computed by errorFunction2
+void errorFunction2Batch(const FeatureBlock& block1, const FeatureBlock& block2,
+                         const std::vector<cv::DMatch>& matches, const Eigen::Matrix4f& tf_1_to_2,
+                         std::vector<float>& sqrd_distances, std::vector<float>& error_bounds);
 
 float getMinDepthInNeighborhood(const cv::Mat& depth, cv::Point2f center, float diameter);
+///Same result as getMinDepthInNeighborhood(depth, kp.pt, kp.size) for each keypoint, in one batch.
+///Keypoint sizes that occur often enough get a min-depth map (separable erosion), the others are scanned directly
+void getMinDepthInNeighborhoods(const cv::Mat& depth, const std::vector<cv::KeyPoint>& keypoints, std::vector<float>& min_depths);
 
 void observationLikelihood(const Eigen::Matrix4f& proposed_transformation,//new to old
                              pointcloud_type::Ptr new_pc,
@@ -145,6 +189,13 @@ double rejectionSignificance(const Eigen::Matrix4f& proposed_transformation,//ne
 ///Quality is output param
 bool observation_criterion_met(unsigned int inliers, unsigned int outliers, unsigned int all, double& quality);
 
+///Components drawing random numbers. Each has its own stream, s.t. e.g. a changed number 
+///of RANSAC iterations does not change the sampled edge candidates
+enum RandomStream { FEATURE_MATCHING_RANDOM = 1, RANSAC_RANDOM, EDGE_CANDIDATE_RANDOM };
+///Seed for a local generator (cv::RNG) of the given component. In "deterministic" mode it only depends
+///on "random_seed", the stream and the keys (e.g. the ids of the compared nodes), otherwise also on /dev/urandom
+uint64 randomSeed(RandomStream stream, uint64 key1, uint64 key2 = 0);
+
 /*
 cv::Point nearest_neighbor(const cv::Mat source&, const cv::Mat& destination, const Eigen::Matrix4f& transformation_source_to_destination, cv::Point query_point);
 Eigen::Vector3f nearest_neighbor(const cv::Mat source&, const cv::Mat& destination, const Eigen::Matrix4f& transformation_source_to_destination, Eigen::Vector3f query_point);
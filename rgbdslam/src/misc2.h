@@ -16,6 +16,7 @@
  * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cmath>
 
 inline double depth_std_dev(double depth)
 {
@@ -30,5 +31,21 @@ inline double depth_covariance(double depth)
   double stddev = depth_std_dev(depth);
   return stddev * stddev;
 }
+//Lateral covariances of a feature per meter of depth: 3 pixel standard deviation for a 640x480 camera with 58x45 degree field of view
+inline double rasterCovarianceX()
+{
+  static const double raster_stddev_x = 3*tan((58.0/180.0*M_PI)/640);
+  return raster_stddev_x * raster_stddev_x;
+}
+inline double rasterCovarianceY()
+{
+  static const double raster_stddev_y = 3*tan((45.0/180.0*M_PI)/480);
+  return raster_stddev_y * raster_stddev_y;
+}
+//Depth covariance of a feature for the error function. Unknown depth (NaN) gets a huge covariance
+inline double featureDepthCovariance(double depth)
+{
+  return std::isnan(depth) ? 1e9 : depth_covariance(depth);
+}
 
 #endif
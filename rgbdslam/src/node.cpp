@@ -18,9 +18,16 @@
 #include "node.h"
 #include "transformation_estimation.h"
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 #include "scoped_timer.h"
+#include <qtconcurrentrun.h>
+#include <QThreadPool>
+#include <QThread>
+#include <QMutex>
+#include <omp.h>
+#include <stdexcept>
 #include <Eigen/Geometry>
-#include <pcl/common/transformation_from_correspondences.h>
 
 #ifdef USE_SIFT_GPU
 #include "sift_gpu_wrapper.h"
@@ -29,6 +36,7 @@
 #include <fstream>
 
 #include "misc.h"
+#include "keypoint_budget.h"
 #include <pcl/filters/voxel_grid.h>
 #include <opencv/highgui.h>
 #ifdef USE_PCL_ICP
@@ -37,6 +45,18 @@
 
 QMutex Node::gicp_mutex;
 QMutex Node::siftgpu_mutex;
+QMutex Node::cloud_cache_mutex_;
+Node::CloudCache Node::cloud_cache_;
+
+//!Principal point and inverse focal lengths, from the parameters if set, else from cam_info
+static void getInverseIntrinsics(const sensor_msgs::CameraInfoConstPtr& cam_info, float& fx, float& fy, float& cx, float& cy)
+{
+  ParameterServer* ps = ParameterServer::instance();
+  fx = 1./ (ps->get<double>("depth_camera_fx") > 0 ? ps->get<double>("depth_camera_fx") : cam_info->K[0]);
+  fy = 1./ (ps->get<double>("depth_camera_fy") > 0 ? ps->get<double>("depth_camera_fy") : cam_info->K[4]);
+  cx = ps->get<double>("depth_camera_cx") > 0 ? ps->get<double>("depth_camera_cx") : cam_info->K[2];
+  cy = ps->get<double>("depth_camera_cy") > 0 ? ps->get<double>("depth_camera_cy") : cam_info->K[5];
+}
 
 //!Construct node without precomputed point cloud. Computes the point cloud on
 //!demand, possibly subsampled
@@ -62,7 +82,17 @@ Node::Node(const cv::Mat& visual,
   ParameterServer* ps = ParameterServer::instance();
 
   //Create point cloud inf necessary
-  if(ps->get<bool>("store_pointclouds") || 
+  if(ps->get<bool>("lazy_point_clouds"))
+  { //Keep only the compact data, see getPointCloud
+    if(depth.type() == CV_16UC1) depth_img_ = depth;
+    else depth.convertTo(depth_img_, CV_16UC1, 1000.0); //NaN becomes 0, i.e., no measurement
+    //Copy images that share external memory (e.g. the data of a ros message)
+    if(!depth_img_.refcount) depth_img_ = depth_img_.clone();
+    color_img_ = visual.refcount ? visual : visual.clone();
+    cam_info_ = cam_info;
+    pc_col = pointcloud_type::Ptr(new pointcloud_type());
+  }
+  else if(ps->get<bool>("store_pointclouds") || 
      ps->get<int>("emm__skip_step") > 0 ||
      ps->get<bool>("use_icp") ||
      (ps->get<bool>("use_glwidget") && ps->get<bool>("use_gui") && ! ps->get<bool>("glwidget_without_clouds")))
@@ -77,10 +107,11 @@ Node::Node(const cv::Mat& visual,
 
 #ifdef USE_PCL_ICP
   if(ps->get<bool>("use_icp")){
-    filterCloud(*pc_col, *filtered_pc_col, ps->get<int>("gicp_max_cloud_size")); 
+    filterCloud(*getPointCloud(), *filtered_pc_col, ps->get<int>("gicp_max_cloud_size")); 
   }
 #endif
 
+  const bool tiled_detection = ps->get<int>("detector_grid_rows") * ps->get<int>("detector_grid_cols") > 1;
   cv::Mat gray_img; 
   if(visual.type() == CV_8UC3){
     cvtColor(visual, gray_img, CV_RGB2GRAY);
@@ -100,8 +131,12 @@ Node::Node(const cv::Mat& visual,
 #endif
   {
     ScopedTimer s("Feature Detection");
-    ROS_FATAL_COND(detector.empty(), "No valid detector!");
-    detector->detect( gray_img, feature_locations_2d_, detection_mask);// fill 2d locations
+    if(tiled_detection){
+      detectFeaturesTiled(gray_img, detection_mask, feature_locations_2d_);
+    } else {
+      ROS_FATAL_COND(detector.empty(), "No valid detector!");
+      detector->detect( gray_img, feature_locations_2d_, detection_mask);// fill 2d locations
+    }
   }
 
   // project pixels to 3dPositions and create search structures for the gicp
@@ -115,7 +150,11 @@ Node::Node(const cv::Mat& visual,
   {
     projectTo3D(feature_locations_2d_, feature_locations_3d_, depth, cam_info);
     ScopedTimer s("Feature Extraction");
-    extractor->compute(gray_img, feature_locations_2d_, feature_descriptors_); //fill feature_descriptors_ with information 
+    if(tiled_detection){
+      computeDescriptorsParallel(gray_img, feature_locations_2d_, feature_descriptors_);
+    } else {
+      extractor->compute(gray_img, feature_locations_2d_, feature_descriptors_); //fill feature_descriptors_ with information 
+    }
   }
   assert(feature_locations_2d_.size() == feature_locations_3d_.size());
   assert(feature_locations_3d_.size() == (unsigned int)feature_descriptors_.rows); 
@@ -133,6 +172,15 @@ Node::Node(const cv::Mat& visual,
     gicp_mutex.unlock();
   }
 #endif
+  //The depth and color image of a lazily stored cloud are not needed anymore. If the cloud
+  //is shown in the 3D view, the images are released after rendering (see GraphManager::clearPointCloud)
+  if(!depth_img_.empty() &&
+     !ps->get<bool>("store_pointclouds") &&
+     ps->get<int>("emm__skip_step") <= 0 &&
+     !(ps->get<bool>("use_glwidget") && ps->get<bool>("use_gui") && !ps->get<bool>("glwidget_without_clouds")))
+  {
+    this->clearPointCloud();
+  }
   if(ps->get<bool>("use_root_sift") &&
      (ps->get<std::string>("feature_extractor_type") == "SIFTGPU" ||
       ps->get<std::string>("feature_extractor_type") == "SURF" ||
@@ -140,6 +188,14 @@ Node::Node(const cv::Mat& visual,
       ps->get<std::string>("feature_extractor_type") == "SIFT")){
     squareroot_descriptor_space(feature_descriptors_);
   }
+  feature_block_.assign(feature_locations_2d_, feature_locations_3d_);
+  float fx, fy, cx, cy;
+  getInverseIntrinsics(cam_info, fx, fy, cx, cy);
+  feature_block_.assignViewingRays(cx, cy, fx, fy); //for guided matching of features without depth
+  if(ps->get<bool>("quantize_descriptors")){
+    quantizeDescriptors();
+  }
+  startFlannIndexBuild();
 }
 
 
@@ -174,6 +230,7 @@ Node::Node(const cv::Mat visual,
   ROS_INFO_STREAM("Construction of Node with " << ps->get<std::string>("feature_detector_type") << " Features");
   ScopedTimer s("Node Constructor");
 
+  const bool tiled_detection = ps->get<int>("detector_grid_rows") * ps->get<int>("detector_grid_cols") > 1;
   cv::Mat gray_img; 
   if(visual.type() == CV_8UC3){ cvtColor(visual, gray_img, CV_RGB2GRAY); } 
   else { gray_img = visual; }
@@ -191,8 +248,12 @@ Node::Node(const cv::Mat visual,
   if(ps->get<std::string>("feature_detector_type") != "GICP")
   {
     ScopedTimer s("Feature Detection");
-    ROS_FATAL_COND(detector.empty(), "No valid detector!");
-    detector->detect( gray_img, feature_locations_2d_, detection_mask);// fill 2d locations
+    if(tiled_detection){
+      detectFeaturesTiled(gray_img, detection_mask, feature_locations_2d_);
+    } else {
+      ROS_FATAL_COND(detector.empty(), "No valid detector!");
+      detector->detect( gray_img, feature_locations_2d_, detection_mask);// fill 2d locations
+    }
   }
 
   // project pixels to 3dPositions and create search structures for the gicp
@@ -211,7 +272,11 @@ Node::Node(const cv::Mat visual,
     projectTo3D(feature_locations_2d_, feature_locations_3d_, pc_col); //takes less than 0.01 sec
     // projectTo3d need a dense cloud to use the points.at(px.x,px.y)-Call
     ScopedTimer s("Feature Extraction");
-    extractor->compute(gray_img, feature_locations_2d_, feature_descriptors_); //fill feature_descriptors_ with information 
+    if(tiled_detection){
+      computeDescriptorsParallel(gray_img, feature_locations_2d_, feature_descriptors_);
+    } else {
+      extractor->compute(gray_img, feature_locations_2d_, feature_descriptors_); //fill feature_descriptors_ with information 
+    }
   }
 
   if(ps->get<std::string>("feature_detector_type") != "GICP")
@@ -273,10 +338,111 @@ Node::Node(const cv::Mat visual,
       ps->get<std::string>("feature_extractor_type") == "SIFT")){
     squareroot_descriptor_space(feature_descriptors_);
   }
+  feature_block_.assign(feature_locations_2d_, feature_locations_3d_);
+  if(ps->get<bool>("quantize_descriptors")){
+    quantizeDescriptors();
+  }
+  startFlannIndexBuild();
+}
+
+void Node::quantizeDescriptors()
+{
+  if(feature_descriptors_.type() != CV_32FC1) return; //Binary descriptors are compact already
+  quantized_descriptors_.quantize(feature_descriptors_);
+  feature_descriptors_.release();
+  if(ParameterServer::instance()->get<std::string>("matcher_type") != "SIFTGPU"){
+    std::vector<float>().swap(siftgpu_descriptors);
+  }
+}
+
+cv::Mat Node::getDescriptors() const
+{
+  if(quantized_descriptors_.empty()) return feature_descriptors_;
+  cv::Mat descriptors;
+  quantized_descriptors_.dequantize(descriptors);
+  return descriptors;
 }
 
 Node::~Node() {
+    flann_index_future_.waitForFinished();
     delete flannIndex; flannIndex = NULL;
+    QMutexLocker locker(&cloud_cache_mutex_);
+    if(lookupCachedCloud()) cloud_cache_.pop_front();
+}
+
+pointcloud_type::Ptr Node::lookupCachedCloud() const
+{
+  for(CloudCache::iterator it = cloud_cache_.begin(); it != cloud_cache_.end(); ++it){
+    if(it->first == this){
+      cloud_cache_.splice(cloud_cache_.begin(), cloud_cache_, it); //move to front
+      return it->second;
+    }
+  }
+  return pointcloud_type::Ptr();
+}
+
+///True if the cached cloud still carries the header and sensor pose of pc_col
+static bool sameCloudMetadata(const pointcloud_type& cached, const pointcloud_type& original)
+{
+  return cached.header.stamp == original.header.stamp &&
+         cached.header.seq == original.header.seq &&
+         cached.header.frame_id == original.header.frame_id &&
+         cached.sensor_origin_ == original.sensor_origin_ &&
+         cached.sensor_orientation_.coeffs() == original.sensor_orientation_.coeffs();
+}
+
+pointcloud_type::Ptr Node::getPointCloud() const
+{
+  if(depth_img_.empty()) return pc_col; //Not stored lazily (or cleared)
+
+  //Cached clouds may be in use by other threads and are never modified. If the metadata of 
+  //pc_col changed (e.g. the pose before saving), the cloud is replaced instead
+  pointcloud_type::Ptr cloud;
+  {
+    QMutexLocker locker(&cloud_cache_mutex_);
+    cloud = lookupCachedCloud();
+    if(cloud && !sameCloudMetadata(*cloud, *pc_col)){
+      cloud_cache_.pop_front(); //lookupCachedCloud moved it to the front
+      cloud.reset();
+    }
+  }
+  if(!cloud){
+    pointcloud_type::Ptr new_cloud(createXYZRGBPointCloud(depth_img_, color_img_, cam_info_));
+    new_cloud->header = pc_col->header; //Not yet visible to other threads
+    new_cloud->sensor_origin_ = pc_col->sensor_origin_;
+    new_cloud->sensor_orientation_ = pc_col->sensor_orientation_;
+    QMutexLocker locker(&cloud_cache_mutex_);
+    cloud = lookupCachedCloud(); //Another thread may have been faster
+    if(cloud && !sameCloudMetadata(*cloud, *new_cloud)){
+      cloud_cache_.pop_front();
+      cloud.reset();
+    }
+    if(!cloud){
+      cloud = new_cloud;
+      cloud_cache_.push_front(std::make_pair(this, cloud));
+      size_t capacity = std::max(1, ParameterServer::instance()->get<int>("lazy_cloud_cache_size"));
+      while(cloud_cache_.size() > capacity) cloud_cache_.pop_back();
+    }
+  }
+  return cloud;
+}
+
+bool Node::ownsPointCloud(pointcloud_type const* pc) const
+{
+  if(pc_col.get() == pc) return true;
+  QMutexLocker locker(&cloud_cache_mutex_);
+  for(CloudCache::const_iterator it = cloud_cache_.begin(); it != cloud_cache_.end(); ++it){
+    if(it->first == this) return it->second.get() == pc; //Not via lookupCachedCloud, to keep the LRU order
+  }
+  return false;
+}
+
+size_t Node::getPointCloudSize() const
+{
+  if(depth_img_.empty()) return pc_col->size();
+  int step = ParameterServer::instance()->get<int>("cloud_creation_skip_step");
+  return static_cast<size_t>(ceil(depth_img_.rows / static_cast<float>(step))) * 
+         static_cast<size_t>(ceil(depth_img_.cols / static_cast<float>(step)));
 }
 
 void Node::setOdomTransform(tf::StampedTransform gt){
@@ -356,9 +522,10 @@ dgc::gicp::GICPPointSet* Node::getGICPStructure(unsigned int max_count) const
   }
 
   std::vector<dgc::gicp::GICPPoint> non_NaN;
-  non_NaN.reserve((*pc_col).points.size());
-  for (unsigned int i=0; i<(*pc_col).points.size(); i++ ){
-    point_type&  p = (*pc_col).points.at(i);
+  pointcloud_type::Ptr cloud = getPointCloud();
+  non_NaN.reserve(cloud->points.size());
+  for (unsigned int i=0; i<cloud->points.size(); i++ ){
+    point_type&  p = cloud->points.at(i);
     if (!isnan(p.z)) { // add points to candidate pointset for icp
       g_p.x=p.x;
       g_p.y=p.y;
@@ -395,26 +562,51 @@ dgc::gicp::GICPPointSet* Node::getGICPStructure(unsigned int max_count) const
 }
 #endif
 
-//Build flann index on demand
-const cv::flann::Index* Node::getFlannIndex() const {
-// build search structure for descriptor matching
-  if (flannIndex == NULL
-      && ParameterServer::instance()->get<std::string> ("matcher_type") == "FLANN" 
-      && ParameterServer::instance()->get<std::string> ("feature_detector_type") != "GICP"
-      && ParameterServer::instance()->get<std::string> ("feature_extractor_type") != "ORB")
+void Node::startFlannIndexBuild()
+{
+  ParameterServer* ps = ParameterServer::instance();
+  if (quantized_descriptors_.empty() && !feature_descriptors_.empty()
+      && ps->get<std::string> ("matcher_type") == "FLANN" 
+      && ps->get<std::string> ("feature_detector_type") != "GICP"
+      && ps->get<std::string> ("feature_extractor_type") != "ORB")
   {
-    ScopedTimer s(__FUNCTION__);
-    //KDTreeIndexParams When passing an object of this type the index constructed will 
-    //consist of a set of randomized kd-trees which will be searched in parallel.
-    flannIndex = new cv::flann::Index(feature_descriptors_, cv::flann::KDTreeIndexParams(4));
-    ROS_DEBUG("Built flannIndex (address %p) for Node %i", flannIndex, this->id_);
+    //The first comparison with this node usually happens right away. Matching falls back to brute force until the index is ready
+    flann_index_future_ = QtConcurrent::run(this, &Node::buildFlannIndex);
   }
+}
+
+void Node::buildFlannIndex()
+{
+  ScopedTimer s(__FUNCTION__);
+  //KDTreeIndexParams When passing an object of this type the index constructed will 
+  //consist of a set of randomized kd-trees which will be searched in parallel.
+  flannIndex = new cv::flann::Index(feature_descriptors_, cv::flann::KDTreeIndexParams(4));
+  ROS_DEBUG("Built flannIndex (address %p) for Node %i", flannIndex, this->id_);
+}
+
+const cv::flann::Index* Node::getFlannIndex() const {
+  //A default constructed future is finished. The future synchronizes the access to flannIndex with the building thread
+  if(!flann_index_future_.isFinished()) return NULL;
   return flannIndex;
 }
 
 
   
 
+//!Add a small random offset to the distances of the matches of nodes query_id and train_id
+/** Matches are later inserted to a set, which omits duplicates. These are found via the less-than
+ *  function, which works on the distance. Therefore equal distances need to be avoided, which happen
+ *  very often for ORB. Seeded per node pair, s.t. concurrent matching does not share state and all
+ *  matching variants use the same stream in deterministic mode.
+ */
+static void addTieBreakOffsets(std::vector<cv::DMatch>& matches, int query_id, int train_id)
+{
+  cv::RNG rng(randomSeed(FEATURE_MATCHING_RANDOM, query_id, train_id));
+  BOOST_FOREACH(cv::DMatch& m, matches){
+    m.distance += (float)rng/1000.0f;
+  }
+}
+
 //TODO: This function seems to be resistant to parallelization probably due to knnSearch
 unsigned int Node::featureMatching(const Node* other, std::vector<cv::DMatch>* matches) const 
 {
@@ -441,10 +633,36 @@ unsigned int Node::featureMatching(const Node* other, std::vector<cv::DMatch>* m
   }
   else
 #endif
-  //using BruteForceMatcher for ORB features
+  //Quantized float descriptors are matched by brute force with the integer kernel, also for the FLANN matcher_type
+  if (!quantized_descriptors_.empty() && !other->quantized_descriptors_.empty() &&
+      (ps->get<std::string> ("matcher_type") == "BRUTEFORCE" || ps->get<std::string> ("matcher_type") == "FLANN" ||
+       ps->get<std::string> ("matcher_type") == "L2"))
+  {
+    sum_distances = matchQuantizedDescriptors(quantized_descriptors_, other->quantized_descriptors_, ps->get<double>("nn_distance_ratio"), *matches);
+    addTieBreakOffsets(*matches, this->id_, other->id_);
+  }
+  else
+  //vectorized exhaustive matching of float descriptors
+  if (ps->get<std::string> ("matcher_type") == "L2" && feature_descriptors_.type() == CV_32FC1)
+  {
+    sum_distances = matchFloatDescriptors(feature_descriptors_, other->feature_descriptors_, ps->get<double>("nn_distance_ratio"),
+                                          ps->get<int>("sufficient_matches"), *matches);
+    addTieBreakOffsets(*matches, this->id_, other->id_);
+  }
+  else
+  //popcount based brute force matching of binary descriptors
+  if (ps->get<std::string> ("matcher_type") == "HAMMING" && feature_descriptors_.type() == CV_8UC1)
+  {
+    sum_distances = matchBinaryDescriptors(feature_descriptors_, other->feature_descriptors_, ps->get<double>("nn_distance_ratio"), *matches);
+    addTieBreakOffsets(*matches, this->id_, other->id_);
+  }
+  else
+  //using BruteForceMatcher for ORB features, and for FLANN while the index of the other node is not ready yet
   if (ps->get<std::string> ("matcher_type") == "BRUTEFORCE" || 
-      ps->get<std::string> ("feature_extractor_type") == "ORB")
+      ps->get<std::string> ("feature_extractor_type") == "ORB" ||
+      (ps->get<std::string> ("matcher_type") == "FLANN" && other->getFlannIndex() == NULL))
   {
+    ROS_DEBUG_COND(ps->get<std::string> ("matcher_type") == "FLANN", "Flann index of Node %i not ready, matching by brute force", other->id_);
     cv::Ptr<cv::DescriptorMatcher> matcher;
     std::string brute_force_type("BruteForce"); //L2 per default
     if(ps->get<std::string> ("feature_extractor_type") == "ORB"){
@@ -455,7 +673,7 @@ unsigned int Node::featureMatching(const Node* other, std::vector<cv::DMatch>* m
     matcher->knnMatch(feature_descriptors_, other->feature_descriptors_, bruteForceMatches, k);
     double max_dist_ratio_fac = ps->get<double>("nn_distance_ratio");
     //if ((int)bruteForceMatches.size() < min_kp) max_dist_ratio_fac = 1.0; //if necessary use possibly bad descriptors
-    srand((long)std::clock());
+    cv::RNG rng(randomSeed(FEATURE_MATCHING_RANDOM, this->id_, other->id_)); //local generator, s.t. concurrent matching does not share state
     std::set<int> train_indices;
     for(unsigned int i = 0; i < bruteForceMatches.size(); i++) {
         cv::DMatch m1 = bruteForceMatches[i][0];
@@ -468,7 +686,7 @@ unsigned int Node::featureMatching(const Node* other, std::vector<cv::DMatch>* m
               
             train_indices.insert(train_idx);
             sum_distances += m1.distance;
-            m1.distance = dist_ratio_fac + (float)rand()/(1000.0*RAND_MAX); //add a small random offset to the distance, since later the dmatches are inserted to a set, which omits duplicates and the duplicates are found via the less-than function, which works on the distance. Therefore we need to avoid equal distances, which happens very often for ORB
+            m1.distance = dist_ratio_fac + (float)rng/1000.0f; //add a small random offset to the distance, since later the dmatches are inserted to a set, which omits duplicates and the duplicates are found via the less-than function, which works on the distance. Therefore we need to avoid equal distances, which happens very often for ORB
             matches->push_back(m1);
         } 
 
@@ -478,10 +696,6 @@ unsigned int Node::featureMatching(const Node* other, std::vector<cv::DMatch>* m
   else if (ps->get<std::string>("matcher_type") == "FLANN" && 
            ps->get<std::string>("feature_extractor_type") != "ORB")
   {
-    if (other->getFlannIndex() == NULL) {//FIXME This shouldn't be required anymore
-        ROS_FATAL("Node %i in featureMatching: flann Index of Node %i was not initialized", this->id_, other->id_);
-        return -1;
-    }
     int start_feature = 0;
     int sufficient_matches = ps->get<int>("sufficient_matches");
     int num_segments = feature_descriptors_.rows / (sufficient_matches+100.0); //compute number of segments
@@ -576,6 +790,81 @@ unsigned int Node::featureMatching(const Node* other, std::vector<cv::DMatch>* m
 
 
 
+bool Node::batchFeatureMatching(const std::vector<const Node*>& others, std::vector<std::vector<cv::DMatch> >& matches) const
+{
+  ScopedTimer s(__FUNCTION__);
+  ParameterServer* ps = ParameterServer::instance();
+  const std::string matcher_type = ps->get<std::string>("matcher_type");
+  if(ps->get<std::string>("feature_detector_type") == "GICP" || matcher_type == "SIFTGPU"){
+    return false;
+  }
+  const bool quantized = !quantized_descriptors_.empty();
+  BOOST_FOREACH(const Node* other, others){
+    if(quantized != !other->quantized_descriptors_.empty() && !other->feature_locations_2d_.empty()) return false;
+  }
+  const float max_dist_ratio = ps->get<double>("nn_distance_ratio");
+  if(quantized){
+    std::vector<const QuantizedDescriptors*> trains;
+    BOOST_FOREACH(const Node* other, others){ trains.push_back(&other->quantized_descriptors_); }
+    matchQuantizedDescriptorsOneToMany(quantized_descriptors_, trains, max_dist_ratio, matches);
+  } else {
+    std::vector<cv::Mat> trains;
+    BOOST_FOREACH(const Node* other, others){ trains.push_back(other->feature_descriptors_); }
+    matchDescriptorsOneToMany(feature_descriptors_, trains, max_dist_ratio, matches);
+  }
+  for(unsigned int i = 0; i < others.size(); i++){
+    addTieBreakOffsets(matches[i], this->id_, others[i]->id_);
+    ROS_INFO_NAMED("statistics", "count_matrix(%3d, %3d) =  %4d;", this->id_+1, others[i]->id_+1, (int)matches[i].size());
+  }
+  return true;
+}
+
+unsigned int Node::guidedFeatureMatching(const Node* other, const Eigen::Matrix4f& predicted_transformation, std::vector<cv::DMatch>* matches) const
+{
+  ScopedTimer s(__FUNCTION__);
+  assert(matches->size()==0);
+  ParameterServer* ps = ParameterServer::instance();
+  if(ps->get<std::string>("feature_detector_type") == "GICP"){
+    return 0;
+  }
+  //Positions in normalized image coordinates (z = 1), s.t. no camera intrinsics are required here.
+  //Features without depth are matched along their viewing ray. Rays are unknown (NaN) only for
+  //features without depth in nodes constructed from a point cloud, these are not matched
+  const float radius = ps->get<double>("guided_matching_radius");
+  const FeatureBlock& train = other->feature_block_;
+  FeatureGrid grid;
+  grid.build(train.ray_x, train.ray_y, radius);
+
+  const Eigen::Matrix3f rotation = predicted_transformation.topLeftCorner<3,3>();
+  const Eigen::Vector3f translation = predicted_transformation.block<3,1>(0,3);
+  std::vector<std::vector<int> > candidates(feature_block_.size());
+  #pragma omp parallel for schedule(static)
+  for(int q = 0; q < (int)feature_block_.size(); q++){
+    Eigen::Vector3f predicted;
+    if(feature_block_.z[q] > 0){
+      predicted = rotation * feature_block_.position3(q) + translation;
+    } else { //Only the viewing direction is known
+      predicted = rotation * Eigen::Vector3f(feature_block_.ray_x[q], feature_block_.ray_y[q], 1.0f);
+    }
+    if(std::isnan(predicted(0))) continue; //Unknown viewing ray
+    if(predicted(2) <= 0) continue; //Behind the other camera
+    grid.radiusSearch(predicted(0) / predicted(2), predicted(1) / predicted(2), radius, candidates[q]);
+  }
+
+  double sum_distances = 0.0;
+  const float max_dist_ratio = ps->get<double>("nn_distance_ratio");
+  if(!quantized_descriptors_.empty() && !other->quantized_descriptors_.empty()){
+    sum_distances = matchQuantizedDescriptorsGuided(quantized_descriptors_, other->quantized_descriptors_, candidates, max_dist_ratio, *matches);
+  } else {
+    sum_distances = matchDescriptorsGuided(feature_descriptors_, other->feature_descriptors_, candidates, max_dist_ratio, *matches);
+  }
+  addTieBreakOffsets(*matches, this->id_, other->id_);
+  ROS_INFO_NAMED("statistics", "Guided Feature Matches between Nodes %3d (%4d features) and %3d (%4d features):\t%4d, avg. distance %f",
+                 this->id_, (int)feature_block_.size(), other->id_, (int)train.size(), (int)matches->size(), 
+                 matches->empty() ? 0.0 : sum_distances / matches->size());
+  return matches->size();
+}
+
 #ifdef USE_SIFT_GPU
 void Node::projectTo3DSiftGPU(std::vector<cv::KeyPoint>& feature_locations_2d,
                               std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> >& feature_locations_3d,
@@ -586,15 +875,11 @@ void Node::projectTo3DSiftGPU(std::vector<cv::KeyPoint>& feature_locations_2d,
 
   ScopedTimer s(__FUNCTION__);
 
-  double depth_scaling = ParameterServer::instance()->get<double>("depth_scaling_factor");
-  size_t max_keyp = ParameterServer::instance()->get<int>("max_keypoints");
+  size_t max_keyp = KeypointBudget::instance()->maxKeypoints();
   float x,y;//temp point, 
   //principal point and focal lengths:
-  ParameterServer* ps = ParameterServer::instance();
-  float fx = 1./ (ps->get<double>("depth_camera_fx") > 0 ? ps->get<double>("depth_camera_fx") : cam_info->K[0]); //(cloud->width >> 1) - 0.5f;
-  float fy = 1./ (ps->get<double>("depth_camera_fy") > 0 ? ps->get<double>("depth_camera_fy") : cam_info->K[4]); //(cloud->width >> 1) - 0.5f;
-  float cx = ps->get<double>("depth_camera_cx") > 0 ? ps->get<double>("depth_camera_cx") : cam_info->K[2]; //(cloud->width >> 1) - 0.5f;
-  float cy = ps->get<double>("depth_camera_cy") > 0 ? ps->get<double>("depth_camera_cy") : cam_info->K[5]; //(cloud->width >> 1) - 0.5f;
+  float fx, fy, cx, cy;
+  getInverseIntrinsics(cam_info, fx, fy, cx, cy);
   //float cx = 325.1;//cam_info->K[2]; //(cloud->width >> 1) - 0.5f;
   //float cy = 249.7;//cam_info->K[5]; //(cloud->height >> 1) - 0.5f;
   //float fx = 1.0/521.0;//1.0f / cam_info->K[0]; 
@@ -606,19 +891,15 @@ void Node::projectTo3DSiftGPU(std::vector<cv::KeyPoint>& feature_locations_2d,
     feature_locations_3d.clear();
   }
 
-  std::list<int> featuresUsed;
-  
-  int index = -1;
-  for(unsigned int i = 0; i < feature_locations_2d.size(); /*increment at end of loop*/){
-    ++index;
+  //Keep at most max_keyp+1 features, look up their depth at once
+  feature_locations_2d.resize(std::min(feature_locations_2d.size(), max_keyp+1));
+  std::vector<float> depths;
+  getKeypointDepths(depth, feature_locations_2d, depths);
+  feature_locations_3d.reserve(feature_locations_2d.size());
 
+  for(unsigned int i = 0; i < feature_locations_2d.size(); i++){
     p2d = feature_locations_2d[i].pt;
-    float Z;
-    if(ParameterServer::instance()->get<bool>("use_feature_min_depth")){
-      Z = getMinDepthInNeighborhood(depth, p2d, feature_locations_2d[i].size);
-    } else {
-      Z = depth.at<float>(p2d.y, p2d.x) * depth_scaling;
-    }
+    float Z = depths[i];
     // Check for invalid measurements
     if (std::isnan (Z))
     {
@@ -637,39 +918,9 @@ void Node::projectTo3DSiftGPU(std::vector<cv::KeyPoint>& feature_locations_2d,
     }
 
     feature_locations_3d.push_back(Eigen::Vector4f(x,y, Z, 1.0));
-    featuresUsed.push_back(index);  //save id for constructing the descriptor matrix
-    i++; //Only increment if no element is removed from vector
-    if(feature_locations_3d.size() > max_keyp) break;
-  }
-
-  //create descriptor matrix
-  int size = feature_locations_3d.size();
-  descriptors_out = cv::Mat(size, 128, CV_32F);
-  siftgpu_descriptors.resize(size * 128);
-  for (int y = 0; y < size && featuresUsed.size() > 0; ++y) {
-    int id = featuresUsed.front();
-    featuresUsed.pop_front();
-
-    for (int x = 0; x < 128; ++x) {
-      descriptors_out.at<float>(y, x) = descriptors_in[id * 128 + x];
-      siftgpu_descriptors[y * 128 + x] = descriptors_in[id * 128 + x];
-    }
   }
 
-  feature_locations_2d.resize(feature_locations_3d.size());
-  /*
-  //create descriptor matrix
-  int size = feature_locations_3d.size();
-  descriptors_out = cv::Mat(size, 128, CV_32F);
-  for (int y = 0; y < size && featuresUsed.size() > 0; ++y) {
-    int id = featuresUsed.front();
-    featuresUsed.pop_front();
-
-    for (int x = 0; x < 128; ++x) {
-      descriptors_out.at<float>(y, x) = descriptors_in[id * 128 + x];
-    }
-  }
-  */
+  copySiftGPUDescriptors(feature_locations_3d.size(), descriptors_in, descriptors_out);
 }
 
 void Node::projectTo3DSiftGPU(std::vector<cv::KeyPoint>& feature_locations_2d,
@@ -678,7 +929,7 @@ void Node::projectTo3DSiftGPU(std::vector<cv::KeyPoint>& feature_locations_2d,
                               std::vector<float>& descriptors_in, cv::Mat& descriptors_out)
 {
   ScopedTimer s(__FUNCTION__);
-  size_t max_keyp = ParameterServer::instance()->get<int>("max_keypoints");
+  size_t max_keyp = KeypointBudget::instance()->maxKeypoints();
   cv::Point2f p2d;
 
   if(feature_locations_3d.size()){
@@ -686,12 +937,7 @@ void Node::projectTo3DSiftGPU(std::vector<cv::KeyPoint>& feature_locations_2d,
     feature_locations_3d.clear();
   }
 
-  std::list<int> featuresUsed;
-
-  int index = -1;
   for(unsigned int i = 0; i < feature_locations_2d.size(); /*increment at end of loop*/){
-    ++index;
-
     p2d = feature_locations_2d[i].pt;
     point_type p3d = point_cloud->at((int) p2d.x,(int) p2d.y);
 
@@ -708,37 +954,45 @@ void Node::projectTo3DSiftGPU(std::vector<cv::KeyPoint>& feature_locations_2d,
     }
 
     feature_locations_3d.push_back(Eigen::Vector4f(p3d.x, p3d.y, p3d.z, 1.0));
-    featuresUsed.push_back(index);  //save id for constructing the descriptor matrix
     i++; //Only increment if no element is removed from vector
     if(feature_locations_3d.size() > max_keyp) break;
   }
 
-  //create descriptor matrix
-  int size = feature_locations_3d.size();
-  descriptors_out = cv::Mat(size, 128, CV_32F);
-  siftgpu_descriptors.resize(size * 128);
-  for (int y = 0; y < size && featuresUsed.size() > 0; ++y) {
-    int id = featuresUsed.front();
-    featuresUsed.pop_front();
-
-    for (int x = 0; x < 128; ++x) {
-      descriptors_out.at<float>(y, x) = descriptors_in[id * 128 + x];
-      siftgpu_descriptors[y * 128 + x] = descriptors_in[id * 128 + x];
-    }
-  }
-
   feature_locations_2d.resize(feature_locations_3d.size());
+  copySiftGPUDescriptors(feature_locations_3d.size(), descriptors_in, descriptors_out);
+}
 
+void Node::copySiftGPUDescriptors(size_t count, const std::vector<float>& descriptors_in, cv::Mat& descriptors_out)
+{
+  //No feature is removed in the projection, so the descriptors of the used features are the first ones
+  descriptors_out = cv::Mat(count, 128, CV_32F);
+  siftgpu_descriptors.assign(descriptors_in.begin(), descriptors_in.begin() + count * 128);
+  if(count > 0){
+    std::memcpy(descriptors_out.data, &descriptors_in[0], count * 128 * sizeof(float));
+  }
 }
 #endif
 
+void Node::getKeypointDepths(const cv::Mat& depth, const std::vector<cv::KeyPoint>& keypoints, std::vector<float>& depths) const
+{
+  if(ParameterServer::instance()->get<bool>("use_feature_min_depth")){
+    getMinDepthInNeighborhoods(depth, keypoints, depths);
+  } else {
+    double depth_scaling = ParameterServer::instance()->get<double>("depth_scaling_factor");
+    depths.resize(keypoints.size());
+    for(unsigned int i = 0; i < keypoints.size(); i++){
+      depths[i] = depthInMeter(depth, keypoints[i].pt.y, keypoints[i].pt.x) * depth_scaling;
+    }
+  }
+}
+
 void Node::projectTo3D(std::vector<cv::KeyPoint>& feature_locations_2d,
                        std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> >& feature_locations_3d,
                        pointcloud_type::ConstPtr point_cloud)
 {
   ScopedTimer s(__FUNCTION__);
 
-  size_t max_keyp = ParameterServer::instance()->get<int>("max_keypoints");
+  size_t max_keyp = KeypointBudget::instance()->maxKeypoints();
   cv::Point2f p2d;
 
   if(feature_locations_3d.size()){
@@ -780,15 +1034,11 @@ void Node::projectTo3D(std::vector<cv::KeyPoint>& feature_locations_2d,
                        const sensor_msgs::CameraInfoConstPtr& cam_info)
 {
   ScopedTimer s(__FUNCTION__);
-  double depth_scaling = ParameterServer::instance()->get<double>("depth_scaling_factor");
-  size_t max_keyp = ParameterServer::instance()->get<int>("max_keypoints");
+  size_t max_keyp = KeypointBudget::instance()->maxKeypoints();
   float x,y;//temp point, 
   //principal point and focal lengths:
-  ParameterServer* ps = ParameterServer::instance();
-  float fx = 1./ (ps->get<double>("depth_camera_fx") > 0 ? ps->get<double>("depth_camera_fx") : cam_info->K[0]); //(cloud->width >> 1) - 0.5f;
-  float fy = 1./ (ps->get<double>("depth_camera_fy") > 0 ? ps->get<double>("depth_camera_fy") : cam_info->K[4]); //(cloud->width >> 1) - 0.5f;
-  float cx = ps->get<double>("depth_camera_cx") > 0 ? ps->get<double>("depth_camera_cx") : cam_info->K[2]; //(cloud->width >> 1) - 0.5f;
-  float cy = ps->get<double>("depth_camera_cy") > 0 ? ps->get<double>("depth_camera_cy") : cam_info->K[5]; //(cloud->width >> 1) - 0.5f;
+  float fx, fy, cx, cy;
+  getInverseIntrinsics(cam_info, fx, fy, cx, cy);
   //float cx = 325.1;//cam_info->K[2]; //(cloud->width >> 1) - 0.5f;
   //float cy = 249.7;//cam_info->K[5]; //(cloud->height >> 1) - 0.5f;
   //float fx = 1.0/521.0;//1.0f / cam_info->K[0]; 
@@ -801,7 +1051,9 @@ void Node::projectTo3D(std::vector<cv::KeyPoint>& feature_locations_2d,
     feature_locations_3d.clear();
   }
 
-  for(unsigned int i = 0; i < feature_locations_2d.size(); /*increment at end of loop*/){
+  //Remove invalid keypoints and keep at most max_keyp+1
+  size_t valid_count = 0;
+  for(unsigned int i = 0; i < feature_locations_2d.size() && valid_count <= max_keyp; /*increment at end of loop*/){
     p2d = feature_locations_2d[i].pt;
     if (p2d.x >= depth.cols || p2d.x < 0 ||
         p2d.y >= depth.rows || p2d.y < 0 ||
@@ -810,38 +1062,29 @@ void Node::projectTo3D(std::vector<cv::KeyPoint>& feature_locations_2d,
       feature_locations_2d.erase(feature_locations_2d.begin()+i);
       continue;
     }
-    float Z;
-    if(ParameterServer::instance()->get<bool>("use_feature_min_depth")){
-      Z = getMinDepthInNeighborhood(depth, p2d, feature_locations_2d[i].size);
-    } else {
-      Z = depth.at<float>(p2d.y, p2d.x) * depth_scaling;
-    }
-    // Check for invalid measurements
-    if(std::isnan (Z))
-    {
-      ROS_DEBUG("Feature %d has been extracted at NaN depth. Omitting", i);
-      //FIXME Use parameter here to choose whether to use
-      //feature_locations_2d.erase(feature_locations_2d.begin()+i);
-      //continue;
-    }
-    x = (p2d.x - cx) * Z * fx;
-    y = (p2d.y - cy) * Z * fy;
-
-    feature_locations_3d.push_back(Eigen::Vector4f(x,y, Z, 1.0));
     i++; //Only increment if no element is removed from vector
-    if(feature_locations_3d.size() > max_keyp) break;
+    valid_count++;
   }
+  feature_locations_2d.resize(valid_count);
 
-  feature_locations_2d.resize(feature_locations_3d.size());
+  //Look up the depth of all keypoints at once, then project them
+  std::vector<float> depths;
+  getKeypointDepths(depth, feature_locations_2d, depths);
+  feature_locations_3d.resize(feature_locations_2d.size());
+  for(unsigned int i = 0; i < feature_locations_2d.size(); i++){
+    p2d = feature_locations_2d[i].pt;
+    float Z = depths[i]; //NaN depth yields a NaN position. Such features can validate, but not create a transformation
+    x = (p2d.x - cx) * Z * fx;
+    y = (p2d.y - cy) * Z * fy;
+    feature_locations_3d[i] = Eigen::Vector4f(x,y, Z, 1.0);
+  }
 }
 
 
 void Node::computeInliersAndError(const std::vector<cv::DMatch> & all_matches,
                                   const Eigen::Matrix4f& transformation,
-                                  const std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> >& origins,
-                                  //const std::vector<std::pair<float, float> > origins_depth_stats,
-                                  const std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> >& earlier,
-                                  //const std::vector<std::pair<float, float> > targets_depth_stats,
+                                  const FeatureBlock& origins,
+                                  const FeatureBlock& earlier,
                                   std::vector<cv::DMatch>& inliers, //pure output var
                                   double& mean_error,//pure output var: rms-mahalanobis-distance
                                   //std::vector<double>& errors,
@@ -854,16 +1097,24 @@ void Node::computeInliersAndError(const std::vector<cv::DMatch> & all_matches,
   assert(all_matches.size() > 0);
   mean_error = 0.0;
 
+  //All matches in single precision at once. Where the result is too close to the threshold
+  //to decide within the error bound, errorFunction2 decides in double precision
+  std::vector<float> batch_dists, error_bounds;
+  errorFunction2Batch(origins, earlier, all_matches, transformation, batch_dists, error_bounds);
 
-  BOOST_FOREACH(const cv::DMatch& m, all_matches)
+  for(unsigned int i = 0; i < all_matches.size(); i++)
   {
-    const Eigen::Vector4f& origin = origins[m.queryIdx];
-    const Eigen::Vector4f& target = earlier[m.trainIdx];
-    if(origin(2) == 0.0 || target(2) == 0.0 || //does NOT trigger on NaN
-        isnan(origin(2)) || isnan(target(2))){ 
+    const cv::DMatch& m = all_matches[i];
+    const int qi = m.queryIdx, ti = m.trainIdx;
+    if(origins.z[qi] == 0.0 || earlier.z[ti] == 0.0 || //does NOT trigger on NaN
+        isnan(origins.z[qi]) || isnan(earlier.z[ti])){ 
        continue;
     }
-    double mahal_dist = errorFunction2(origin, target, transformation);
+    double mahal_dist = batch_dists[i];
+    if(!(mahal_dist >= 0.0) || !(std::fabs(mahal_dist - squaredMaxInlierDistInM) > error_bounds[i])){
+      mahal_dist = errorFunction2(origins.position(qi), origins.depth_cov[qi], 
+                                  earlier.position(ti), earlier.depth_cov[ti], transformation);
+    }
     if(mahal_dist > squaredMaxInlierDistInM)
       continue; //ignore outliers
     if(!(mahal_dist >= 0.0)){
@@ -888,21 +1139,24 @@ void Node::computeInliersAndError(const std::vector<cv::DMatch> & all_matches,
 }
 
 ///Randomly choose <sample_size> of the matches
-std::vector<cv::DMatch> sample_matches_prefer_by_distance(unsigned int sample_size, std::vector<cv::DMatch>& matches_with_depth)
+std::vector<cv::DMatch> sample_matches_prefer_by_distance(unsigned int sample_size, std::vector<cv::DMatch>& matches_with_depth, cv::RNG& rng)
 {
     //Sample ids to pick matches lateron (because they are unique and the
     //DMatch operator< overload breaks uniqueness of the Matches if they have the
     //exact same distance, e.g., 0.0)
-    std::set<std::vector<cv::DMatch>::size_type> sampled_ids;
+    //The sample is tiny, a linear search for duplicates is cheaper than a std::set
+    std::vector<std::vector<cv::DMatch>::size_type> sampled_ids;
+    sampled_ids.reserve(sample_size);
     int safety_net = 0;
     while(sampled_ids.size() < sample_size && matches_with_depth.size() >= sample_size){
-      //generate a set of samples. Using a set solves the problem of drawing a sample more than once
-      int id1 = rand() % matches_with_depth.size();
-      int id2 = rand() % matches_with_depth.size();
+      int id1 = rng.uniform(0, (int)matches_with_depth.size());
+      int id2 = rng.uniform(0, (int)matches_with_depth.size());
       if(id1 > id2) id1 = id2; //use smaller one => increases chance for lower id
-      sampled_ids.insert(id1);
+      if(std::find(sampled_ids.begin(), sampled_ids.end(), (std::vector<cv::DMatch>::size_type)id1) == sampled_ids.end())
+        sampled_ids.push_back(id1);
       if(++safety_net > 10000){ ROS_ERROR("Infinite Sampling"); break; } 
     }
+    std::sort(sampled_ids.begin(), sampled_ids.end()); //same order as before
 
     //Given the ids, construct the resulting vector
     std::vector<cv::DMatch> sampled_matches;
@@ -914,7 +1168,7 @@ std::vector<cv::DMatch> sample_matches_prefer_by_distance(unsigned int sample_si
 }
 
 ///Randomly choose <sample_size> of the matches
-std::vector<cv::DMatch> sample_matches(unsigned int sample_size, std::vector<cv::DMatch>& matches_with_depth)
+std::vector<cv::DMatch> sample_matches(unsigned int sample_size, std::vector<cv::DMatch>& matches_with_depth, cv::RNG& rng)
 {
     //Sample ids to pick matches lateron (because they are unique and the
     //DMatch operator< overload breaks uniqueness of the Matches if they have the
@@ -923,7 +1177,7 @@ std::vector<cv::DMatch> sample_matches(unsigned int sample_size, std::vector<cv:
     int safety_net = 0;
     while(sampled_ids.size() < sample_size && matches_with_depth.size() >= sample_size){
       //generate a set of samples. Using a set solves the problem of drawing a sample more than once
-      sampled_ids.insert(rand() % matches_with_depth.size());
+      sampled_ids.insert(rng.uniform(0, (int)matches_with_depth.size()));
       if(++safety_net > 10000){ ROS_ERROR("Infinite Sampling"); break; } 
     }
 
@@ -936,7 +1190,153 @@ std::vector<cv::DMatch> sample_matches(unsigned int sample_size, std::vector<cv:
     return sampled_matches;
 }
 
+///PROSAC sampling (Chum and Matas, 2005): samples are drawn from the best n matches (sorted by quality),
+///where n grows with the iterations, s.t. the sampling is uniform after max_iterations.
+///The pool of every iteration is computed beforehand, s.t. the iterations can be sampled concurrently
+class ProsacSampler {
+public:
+  ProsacSampler(unsigned int sample_size, unsigned int match_count, int max_iterations)
+  : m_(sample_size), N_(match_count)
+  {
+    max_iterations = std::max(1, max_iterations);
+    pool_size_.resize(max_iterations);
+    include_newest_.resize(max_iterations);
+    //Average number of samples from the best m matches, in max_iterations samples
+    double T_n = max_iterations;
+    for(unsigned int i = 0; i < m_ && N_ > i; i++){
+      T_n *= static_cast<double>(m_ - i) / (N_ - i);
+    }
+    unsigned int n = m_;
+    int T_n_prime = 1;
+    for(int t = 1; t <= max_iterations; t++){
+      if(t >= T_n_prime && n < N_){ //Grow the sampling pool
+        double T_next = T_n * (n + 1) / (n + 1 - m_);
+        n++;
+        T_n_prime += static_cast<int>(std::ceil(T_next - T_n));
+        T_n = T_next;
+      }
+      //The growth function is designed for many more iterations than we use. Grow at least linearly, 
+      //s.t. all matches are in the pool at the last iteration
+      const unsigned int min_pool = m_ + static_cast<unsigned int>((N_ - m_) * std::min(1.0, t / (double)max_iterations));
+      if(n < min_pool){
+        n = min_pool;
+        T_n_prime = t - 1; //uniform from the pool
+      }
+      pool_size_[t-1] = n;
+      include_newest_[t-1] = T_n_prime >= t && n > m_;
+    }
+  }
+
+  ///Draw the sample of the given iteration (counted from zero) from sorted_matches (best first)
+  std::vector<cv::DMatch> sample(int iteration, const std::vector<cv::DMatch>& sorted_matches, cv::RNG& rng) const
+  {
+    assert(sorted_matches.size() == N_ && N_ >= m_);
+    const int t = std::max(0, std::min(iteration, (int)pool_size_.size() - 1));
+    const unsigned int n = pool_size_[t];
+    std::vector<cv::DMatch> sampled_matches;
+    sampled_matches.reserve(m_);
+    std::vector<unsigned int> ids;
+    ids.reserve(m_);
+    if(include_newest_[t]){ //The newest match of the pool and m-1 of the others
+      ids.push_back(n - 1);
+    }
+    const unsigned int pool = ids.empty() ? n : n - 1;
+    while(ids.size() < m_){
+      unsigned int id = rng.uniform(0, (int)pool);
+      if(std::find(ids.begin(), ids.end(), id) == ids.end()) ids.push_back(id);
+    }
+    for(unsigned int i = 0; i < ids.size(); i++){
+      sampled_matches.push_back(sorted_matches[ids[i]]);
+    }
+    return sampled_matches;
+  }
+
+private:
+  unsigned int m_, N_;
+  std::vector<unsigned int> pool_size_;
+  std::vector<bool> include_newest_;
+};
+
+///Number of iterations, s.t. with the given confidence at least one sample consists of inliers only.
+///Inlier_ratio is the fraction of the sampled matches, that are inliers
+static int requiredRansacIterations(double inlier_ratio, unsigned int sample_size, double confidence, int max_iterations)
+{
+  const double all_inliers = std::pow(inlier_ratio, (double)sample_size); //probability of an outlier free sample
+  if(all_inliers >= 1.0) return 1;
+  if(all_inliers <= std::numeric_limits<double>::epsilon()) return max_iterations;
+  const double required = std::ceil(std::log(1.0 - confidence) / std::log(1.0 - all_inliers));
+  return required < max_iterations ? std::max(1, (int)required) : max_iterations;
+}
+
+///Number of matches with depth in matches
+static unsigned int countMatchesWithDepth(const std::vector<cv::DMatch>& matches, const FeatureBlock& query, const FeatureBlock& train)
+{
+  unsigned int count = 0;
+  BOOST_FOREACH(const cv::DMatch& m, matches){
+    if(query.hasDepth(m.queryIdx) && train.hasDepth(m.trainIdx)) count++;
+  }
+  return count;
+}
+
 ///Find transformation with largest support, RANSAC style.
+///Threads for the hypotheses of one RANSAC. Concurrent comparisons (see GraphManager) run in the global
+///thread pool, each of them gets a fair share of the cores. Nested in another OpenMP region it runs sequentially
+static int ransacThreadCount(int iterations)
+{
+  int threads = ParameterServer::instance()->get<int>("ransac_threads");
+  if(threads <= 0){
+    int active = std::max(1, QThreadPool::globalInstance()->activeThreadCount());
+    threads = std::max(1, QThread::idealThreadCount() / active);
+  }
+  if(omp_in_parallel()) threads = 1;
+  //Starting a thread for a few iterations does not pay off
+  return std::max(1, std::min(threads, iterations / 8));
+}
+
+bool Node::refineRansacHypothesis(const Node* earlier_node,
+                                  const std::vector<cv::DMatch>& initial_matches,
+                                  std::vector<cv::DMatch>& inlier,
+                                  unsigned int min_inlier_threshold,
+                                  RigidTransformationEstimator& estimator,
+                                  float max_dist_m,
+                                  Eigen::Matrix4f& refined_transformation,
+                                  std::vector<cv::DMatch>& refined_matches,
+                                  double& refined_error) const
+{
+  refined_error = 1e6;
+  refined_matches.clear();
+  refined_transformation = Eigen::Matrix4f::Identity();
+  double inlier_error;
+  Eigen::Matrix4f transformation;
+  for(int refinements = 1; refinements < 20 /*got stuck?*/; refinements++) 
+  {
+      //false iff the sampled points clearly aren't inliers themself or the trafo contains NaN
+      if (!estimator.estimate(this->feature_block_, earlier_node->feature_block_, inlier, transformation))
+        break;
+
+      //test which features are inliers 
+      computeInliersAndError(initial_matches, transformation, 
+                             this->feature_block_, 
+                             earlier_node->feature_block_, 
+                             inlier, inlier_error, max_dist_m*max_dist_m*(4.0/refinements)); 
+      
+      if(inlier.size() < min_inlier_threshold || inlier_error > max_dist_m){
+        ROS_DEBUG_NAMED(__FILE__, "Skipped iteration: inliers: %i (min %i), inlier_error: %.2f (max %.2f)", (int)inlier.size(), (int) min_inlier_threshold,  inlier_error*100, max_dist_m*100);
+        break; //hopeless case
+      }
+
+      //superior to before?
+      if (inlier.size() > refined_matches.size() && inlier_error < refined_error) {
+        assert(inlier_error>=0);
+        refined_transformation = transformation;
+        refined_matches = inlier;
+        refined_error = inlier_error;
+      }
+      else break;
+  }  //END REFINEMENTS
+  return !refined_matches.empty();
+}
+
 ///Return false if no transformation can be found
 bool Node::getRelativeTransformationTo(const Node* earlier_node,
                                        std::vector<cv::DMatch>* initial_matches,
@@ -962,12 +1362,17 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
   }
 
   double inlier_error; //all squared errors
-  srand((long)std::clock());
+  //Every call has its own generator, the global rand() state would be shared between the matching threads
+  cv::RNG rng(randomSeed(RANSAC_RANDOM, this->id_, earlier_node->id_));
   
   // a point is an inlier if it's no more than max_dist_m m from its partner apart
   const float max_dist_m = ParameterServer::instance()->get<double>("max_dist_for_inliers");
   const int ransac_iterations = ParameterServer::instance()->get<int>("ransac_iterations");
   //std::vector<double> dummy;
+  //With a confidence, samples are drawn PROSAC style and RANSAC stops when the confidence is reached
+  const double confidence = ParameterServer::instance()->get<double>("ransac_confidence");
+  const bool adaptive = confidence > 0.0 && confidence < 1.0;
+  int required_iterations = ransac_iterations;
 
   // initialize result values of all iterations 
   matches.clear();
@@ -975,12 +1380,10 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
   rmse = 1e6;
   unsigned int valid_iterations = 0;//, best_inlier_cnt = 0;
   const unsigned int sample_size = 3;// chose this many randomly from the correspondences:
-  bool valid_tf = false; // valid is false iff the sampled points clearly aren't inliers themself 
 
   std::vector<cv::DMatch> matches_with_depth; //matches without depth can validate but not create the trafo
   BOOST_FOREACH(const cv::DMatch& m, *initial_matches){
-      if(!isnan(this->feature_locations_3d_[m.queryIdx](2)) 
-         && !isnan(earlier_node->feature_locations_3d_[m.trainIdx](2)))
+      if(this->feature_block_.hasDepth(m.queryIdx) && earlier_node->feature_block_.hasDepth(m.trainIdx))
         matches_with_depth.push_back(m);
   }
   std::sort(matches_with_depth.begin(), matches_with_depth.end()); //sort by distance, which is the nn_ratio
@@ -992,8 +1395,8 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
     std::vector<cv::DMatch> inlier; //result
     //test which samples are inliers 
     computeInliersAndError(*initial_matches, transformation, 
-                           this->feature_locations_3d_, //this->feature_depth_stats_, 
-                           earlier_node->feature_locations_3d_, //earlier_node->feature_depth_stats_, 
+                           this->feature_block_, 
+                           earlier_node->feature_block_, 
                            inlier, inlier_error, max_dist_m*max_dist_m); 
     
     //superior to before?
@@ -1004,70 +1407,98 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
       rmse = inlier_error;
       valid_iterations++;
       ROS_INFO("No-Motion guess for %i<->%i: inliers: %i (min %i), inlier_error: %.2f (max %.2f)", this->id_, earlier_node->id_, (int)matches.size(), (int) min_inlier_threshold,  rmse, max_dist_m);
+      if(adaptive && !matches_with_depth.empty()){
+        double inlier_ratio = countMatchesWithDepth(matches, feature_block_, earlier_node->feature_block_) / (double)matches_with_depth.size();
+        required_iterations = requiredRansacIterations(inlier_ratio, sample_size, confidence, ransac_iterations);
+      }
     }
   } //END IDENTITY AS GUESS
 
 
   //RANSAC
+  //Hypotheses are drawn and evaluated by several threads, each with its own generator. The best 
+  //hypothesis, the number of required iterations and the termination are shared
   int real_iterations = 0;
-  for(int n = 0; (n < ransac_iterations && matches_with_depth.size() >= sample_size); n++) //Without the minimum number of matches, the transformation can not be computed as usual TODO: implement monocular motion est
+  if(matches_with_depth.size() >= sample_size) //Without the minimum number of matches, the transformation can not be computed as usual TODO: implement monocular motion est
   {
-    //Initialize Results of refinement
-    double refined_error = 1e6;
-    std::vector<cv::DMatch> refined_matches; 
-    std::vector<cv::DMatch> inlier = sample_matches_prefer_by_distance(sample_size, matches_with_depth); //initialization with random samples 
-    //std::vector<cv::DMatch> inlier = sample_matches(sample_size, matches_with_depth); //initialization with random samples 
-    Eigen::Matrix4f refined_transformation = Eigen::Matrix4f::Identity();
-
-    real_iterations++;
-    for(int refinements = 1; refinements < 20 /*got stuck?*/; refinements++) 
+    const ProsacSampler prosac(sample_size, matches_with_depth.size(), ransac_iterations);
+    const double termination_pct = ParameterServer::instance()->get<double>("ransac_termination_inlier_pct");
+    const uint64 seed = ((uint64)rng.next() << 32) | rng.next();
+    const int threads = ransacThreadCount(required_iterations);
+    QMutex best_mutex; //guards the results, the iteration counters and the termination
+    int next_iteration = 0;
+    bool terminated = false;
+    bool failed = false;
+    std::string failure; //message of the first exception in the parallel region
+
+    #pragma omp parallel num_threads(threads)
     {
-        Eigen::Matrix4f transformation = getTransformFromMatches(this, earlier_node, inlier,valid_tf,max_dist_m);
-        if (!valid_tf || transformation!=transformation)  //Trafo Contains NaN?
-          break; // valid_tf is false iff the sampled points aren't inliers themself 
-
-        //test which features are inliers 
-        computeInliersAndError(*initial_matches, transformation, 
-                               this->feature_locations_3d_, //this->feature_depth_stats_, 
-                               earlier_node->feature_locations_3d_, //earlier_node->feature_depth_stats_, 
-                               inlier, inlier_error, max_dist_m*max_dist_m*(4.0/refinements)); 
-        
-        if(inlier.size() < min_inlier_threshold || inlier_error > max_dist_m){
-          ROS_DEBUG_NAMED(__FILE__, "Skipped iteration: inliers: %i (min %i), inlier_error: %.2f (max %.2f)", (int)inlier.size(), (int) min_inlier_threshold,  inlier_error*100, max_dist_m*100);
-          break; //hopeless case
-        }
-
-        //superior to before?
-        if (inlier.size() > refined_matches.size() && inlier_error < refined_error) {
-          assert(inlier_error>=0);
-          refined_transformation = transformation;
-          refined_matches = inlier;
-          refined_error = inlier_error;
-        }
-        else break;
-    }  //END REFINEMENTS
-    //Successful Iteration?
-    if(refined_matches.size() > 0){ //Valid?
-        valid_iterations++;
-        ROS_DEBUG("Valid iteration: inliers/matches: %lu/%lu (min %u), refined error: %.2f (max %.2f), global error: %.2f", 
-                refined_matches.size(), matches.size(), min_inlier_threshold,  refined_error, max_dist_m, rmse);
-
-        //Acceptable && superior to previous iterations?
-        if (refined_error < rmse &&  
-            refined_matches.size() > matches.size() && 
-            refined_matches.size() >= min_inlier_threshold)
+      //An exception must not leave the parallel region (std::terminate). It ends the RANSAC
+      //and is thrown again below, where the callers handle it as before
+      try {
+        cv::RNG thread_rng(seed + omp_get_thread_num());
+        RigidTransformationEstimator estimator(max_dist_m);
+        //Initialize Results of refinement
+        Eigen::Matrix4f refined_transformation;
+        std::vector<cv::DMatch> refined_matches; 
+        double refined_error;
+        while(true)
         {
-          ROS_INFO("Improvment in iteration %d: inliers: %i (min %i), inlier_error: %.2f (max %.2f)", real_iterations, (int)refined_matches.size(), (int) min_inlier_threshold,  refined_error, max_dist_m);
-          rmse = refined_error;
-          resulting_transformation = refined_transformation;
-          matches.assign(refined_matches.begin(), refined_matches.end());
-          //Performance hacks:
-          double percentage_of_inliers = refined_matches.size()/static_cast<double>(initial_matches->size()) * 100.0;
-          if (percentage_of_inliers > ParameterServer::instance()->get<double>("ransac_termination_inlier_pct")) break; ///Can this get better anyhow?
-        }
+          int n;
+          {
+            QMutexLocker locker(&best_mutex);
+            if(terminated || next_iteration >= required_iterations) break;
+            n = next_iteration++;
+            real_iterations++;
+          }
+          std::vector<cv::DMatch> inlier = adaptive ? prosac.sample(n, matches_with_depth, thread_rng) : //best matches first
+                                                      sample_matches_prefer_by_distance(sample_size, matches_with_depth, thread_rng); //initialization with random samples 
+          //std::vector<cv::DMatch> inlier = sample_matches(sample_size, matches_with_depth, thread_rng); //initialization with random samples 
+
+          //Successful Iteration?
+          if(!refineRansacHypothesis(earlier_node, *initial_matches, inlier, min_inlier_threshold, estimator, max_dist_m,
+                                     refined_transformation, refined_matches, refined_error))
+            continue;
+
+          QMutexLocker locker(&best_mutex);
+          valid_iterations++;
+          ROS_DEBUG("Valid iteration: inliers/matches: %lu/%lu (min %u), refined error: %.2f (max %.2f), global error: %.2f", 
+                  refined_matches.size(), matches.size(), min_inlier_threshold,  refined_error, max_dist_m, rmse);
+
+          //Acceptable && superior to previous iterations?
+          if (refined_error < rmse &&  
+              refined_matches.size() > matches.size() && 
+              refined_matches.size() >= min_inlier_threshold)
+          {
+            ROS_INFO("Improvment in iteration %d: inliers: %i (min %i), inlier_error: %.2f (max %.2f)", n+1, (int)refined_matches.size(), (int) min_inlier_threshold,  refined_error, max_dist_m);
+            rmse = refined_error;
+            resulting_transformation = refined_transformation;
+            matches.assign(refined_matches.begin(), refined_matches.end());
+            if(adaptive){ //Fewer iterations needed with more inliers
+              double inlier_ratio = countMatchesWithDepth(matches, feature_block_, earlier_node->feature_block_) / (double)matches_with_depth.size();
+              required_iterations = requiredRansacIterations(inlier_ratio, sample_size, confidence, ransac_iterations);
+              ROS_DEBUG("Inlier ratio %.2f: %d RANSAC iterations required for confidence %.3f", inlier_ratio, required_iterations, confidence);
+            }
+            //Performance hacks:
+            double percentage_of_inliers = refined_matches.size()/static_cast<double>(initial_matches->size()) * 100.0;
+            if (percentage_of_inliers > termination_pct) terminated = true; ///Can this get better anyhow?
+          }
+        } //iterations
+      } catch (std::exception& e) {
+        QMutexLocker locker(&best_mutex);
+        if(!failed) failure = e.what();
+        failed = terminated = true;
+      } catch (...) {
+        QMutexLocker locker(&best_mutex);
+        if(!failed) failure = "unknown exception";
+        failed = terminated = true;
+      }
+    } //omp parallel
+    if(failed){
+      throw std::runtime_error("RANSAC failed: " + failure);
     }
-  } //iterations
-  ROS_INFO("%i good iterations (from %i), inlier pct %i, inlier cnt: %i, error (MHD): %.2f",valid_iterations, ransac_iterations, (int) (matches.size()*1.0/initial_matches->size()*100),(int) matches.size(),rmse);
+  }
+  ROS_INFO("%i good iterations (from %i), inlier pct %i, inlier cnt: %i, error (MHD): %.2f",valid_iterations, real_iterations, (int) (matches.size()*1.0/initial_matches->size()*100),(int) matches.size(),rmse);
   
   //ROS_INFO_STREAM("Transformation estimated:\n" << resulting_transformation);
   
@@ -1085,8 +1516,8 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
 
     //Evaluate the new transformation
     computeInliersAndError(*initial_matches, transformation, 
-                           this->feature_locations_3d_, //this->feature_depth_stats_, 
-                           earlier_node->feature_locations_3d_, //earlier_node->feature_depth_stats_, 
+                           this->feature_block_, 
+                           earlier_node->feature_block_, 
                            inlier,inlier_error, //Output!
                            max_dist_m*max_dist_m); 
     ROS_INFO_STREAM("Transformation estimated to Node " << earlier_node->id_ << ":\n" << transformation);
@@ -1097,8 +1528,8 @@ bool Node::getRelativeTransformationTo(const Node* earlier_node,
         //Refine using the new inliers
         getTransformFromMatchesG2O(earlier_node, this,inlier, transformation, g2o_iterations);
         computeInliersAndError(*initial_matches, transformation, 
-                               this->feature_locations_3d_, //this->feature_depth_stats_, 
-                               earlier_node->feature_locations_3d_, //earlier_node->feature_depth_stats_, 
+                               this->feature_block_, 
+                               earlier_node->feature_block_, 
                                inlier,inlier_error, max_dist_m*max_dist_m); 
       }
       ROS_INFO("G2o optimization result for %i<->%i: inliers: %i (min %i), inlier_error: %.2f (max %.2f)", this->id_, earlier_node->id_, (int)inlier.size(), (int) min_inlier_threshold,  inlier_error, max_dist_m);
@@ -1249,7 +1680,7 @@ MatchingResult Node::matchNodePair(const Node* older_node)
 {
   MatchingResult mr;
   ///First check if this node has the information required
-  if(older_node->pc_col->size() == 0 || older_node->feature_locations_2d_.size() == 0){
+  if(older_node->getPointCloudSize() == 0 || older_node->feature_locations_2d_.size() == 0){
     ROS_WARN("Tried to match against a cleared node (%d). Skipping.", older_node->id_); 
     return mr;
   }
@@ -1260,50 +1691,99 @@ MatchingResult Node::matchNodePair(const Node* older_node)
 
   try{
     ///FEATURE MATCHING+RANSAC
-    bool found_transformation = false;
-
     this->featureMatching(older_node, &mr.all_matches); 
-    double ransac_quality = 0;
-    if (mr.all_matches.size() < (unsigned int) ps->get<int>("min_matches")){
-        ROS_INFO("Too few inliers between %i and %i for RANSAC method. Only %i correspondences to begin with.",
-                 older_node->id_,this->id_,(int)mr.all_matches.size());
-    } 
-    else {//All good for feature based transformation estimation
-        if(getRelativeTransformationTo(older_node,&mr.all_matches, mr.ransac_trafo, mr.rmse, mr.inlier_matches))
-        {
-          pairwiseObservationLikelihood(this, older_node, mr);
-          bool valid_tf = observation_criterion_met(mr.inlier_points, mr.outlier_points, mr.occluded_points + mr.inlier_points + mr.outlier_points, ransac_quality);
-          if(valid_tf){
-            edgeFromMatchingResult(this, older_node, mr.ransac_trafo, mr);
-            printNNRatioInfo("valid", mr.inlier_matches);
-            found_transformation = true;
-          }
-        } 
-        else {//Informational output only
-          printNNRatioInfo("invalid", mr.all_matches);
-        }
-        if(!found_transformation) mr.inlier_matches.clear();
-    } 
+    transformationFromMatches(older_node, mr);
+  }
+  catch (std::exception e){//Catch exceptions: Unexpected problems shouldn't crash the application
+    ROS_ERROR("Caught Exception in comparison of Nodes %i and %i: %s", this->id_, older_node->id_, e.what());
+  }
 
-#if  defined USE_ICP_CODE || defined USE_ICP_CODE
-    ///ICP - This sets the icp transformation in "mr", if the icp alignment is better than the ransac_quality
-    found_transformation = found_transformation || edge_from_icp_alignment(found_transformation, this, older_node, mr, ransac_quality);
-#endif
+  return mr;
+}
 
-    if(found_transformation) {
-        ROS_INFO("Returning Valid Edge");
-        ++initial_node_matches_; //trafo is accepted
-    } else {
-        mr.edge.id1 = mr.edge.id2 = -1;
+MatchingResult Node::matchNodePairGuided(const Node* older_node, const Eigen::Matrix4f& predicted_transformation)
+{
+  if(older_node->getPointCloudSize() == 0 || older_node->feature_locations_2d_.size() == 0 ||
+     (ParameterServer::instance()->get<int>("max_connections") > 0 && 
+      initial_node_matches_ > ParameterServer::instance()->get<int>("max_connections")))
+  {
+    return matchNodePair(older_node); //Handles these cases
+  }
+  MatchingResult mr;
+  try{
+    this->guidedFeatureMatching(older_node, predicted_transformation, &mr.all_matches); 
+    if(transformationFromMatches(older_node, mr)){
+      return mr;
     }
   }
   catch (std::exception e){//Catch exceptions: Unexpected problems shouldn't crash the application
-    ROS_ERROR("Caught Exception in comparison of Nodes %i and %i: %s", this->id_, older_node->id_, e.what());
+    ROS_ERROR("Caught Exception in guided comparison of Nodes %i and %i: %s", this->id_, older_node->id_, e.what());
   }
+  ROS_INFO("Guided matching of Nodes %i and %i failed (%d matches). Matching globally", this->id_, older_node->id_, (int)mr.all_matches.size());
+  return matchNodePair(older_node);
+}
 
+MatchingResult Node::matchNodePairWithMatches(const Node* older_node, const std::vector<cv::DMatch>& matches)
+{
+  MatchingResult mr;
+  if(older_node->getPointCloudSize() == 0 || older_node->feature_locations_2d_.size() == 0){
+    ROS_WARN("Tried to match against a cleared node (%d). Skipping.", older_node->id_); 
+    return mr;
+  }
+  ParameterServer* ps = ParameterServer::instance();
+  if(ps->get<int>("max_connections") > 0 && initial_node_matches_ > ps->get<int>("max_connections")) {
+    return mr; //enough is enough
+  }
+  try{
+    mr.all_matches = matches;
+    transformationFromMatches(older_node, mr);
+  }
+  catch (std::exception e){//Catch exceptions: Unexpected problems shouldn't crash the application
+    ROS_ERROR("Caught Exception in comparison of Nodes %i and %i: %s", this->id_, older_node->id_, e.what());
+  }
   return mr;
 }
 
+bool Node::transformationFromMatches(const Node* older_node, MatchingResult& mr)
+{
+  ParameterServer* ps = ParameterServer::instance();
+  bool found_transformation = false;
+  double ransac_quality = 0;
+  if (mr.all_matches.size() < (unsigned int) ps->get<int>("min_matches")){
+      ROS_INFO("Too few inliers between %i and %i for RANSAC method. Only %i correspondences to begin with.",
+               older_node->id_,this->id_,(int)mr.all_matches.size());
+  } 
+  else {//All good for feature based transformation estimation
+      if(getRelativeTransformationTo(older_node,&mr.all_matches, mr.ransac_trafo, mr.rmse, mr.inlier_matches))
+      {
+        pairwiseObservationLikelihood(this, older_node, mr);
+        bool valid_tf = observation_criterion_met(mr.inlier_points, mr.outlier_points, mr.occluded_points + mr.inlier_points + mr.outlier_points, ransac_quality);
+        if(valid_tf){
+          edgeFromMatchingResult(this, older_node, mr.ransac_trafo, mr);
+          printNNRatioInfo("valid", mr.inlier_matches);
+          found_transformation = true;
+        }
+      } 
+      else {//Informational output only
+        printNNRatioInfo("invalid", mr.all_matches);
+      }
+      if(!found_transformation) mr.inlier_matches.clear();
+  } 
+
+#if  defined USE_ICP_CODE || defined USE_ICP_CODE
+  ///ICP - This sets the icp transformation in "mr", if the icp alignment is better than the ransac_quality
+  found_transformation = found_transformation || edge_from_icp_alignment(found_transformation, this, older_node, mr, ransac_quality);
+#endif
+
+  if(found_transformation) {
+      ROS_INFO("Returning Valid Edge");
+      ++initial_node_matches_; //trafo is accepted
+  } else {
+      mr.edge.id1 = mr.edge.id2 = -1;
+  }
+  return found_transformation;
+}
+
 void Node::clearFeatureInformation(){
   //clear feature info, by swapping data with empty vector (so mem really gets freed)
   ROS_INFO("Deleting feature information of Node %i", this->id_);
@@ -1312,11 +1792,14 @@ void Node::clearFeatureInformation(){
 
 	std::vector<cv::KeyPoint> f_l_2d; 
   f_l_2d.swap(feature_locations_2d_);
+  feature_block_.clear();
 
 	std::vector<float> f_l_siftgpu; 
   f_l_siftgpu.swap(siftgpu_descriptors);
 
+  flann_index_future_.waitForFinished(); //The build reads the descriptors
   feature_descriptors_.release();
+  quantized_descriptors_.release();
   delete flannIndex; flannIndex = NULL;
   matchable_ = false;
 }
@@ -1324,7 +1807,9 @@ void Node::addPointCloud(pointcloud_type::Ptr new_pc){
   pc_col = new_pc;
 }
 void Node::reducePointCloud(double vfs){
-  if(vfs > 0.0){
+  if(!depth_img_.empty()){
+    ROS_DEBUG("Point cloud of Node %d is computed on demand, not reducing it", this->id_);
+  } else if(vfs > 0.0){
     ROS_INFO("Reducing points (%d) of Node %d", (int)pc_col->size(), this->id_);
     pcl::VoxelGrid<point_type> sor;
     sor.setLeafSize(vfs,vfs,vfs);
@@ -1344,7 +1829,7 @@ long Node::getMemoryFootprint(bool write_to_log)
   ROS_INFO_COND(write_to_log, "Base Size of Node Class: %zu bytes", tmp); 
   size += tmp;
 
-  tmp = feature_descriptors_.step * feature_descriptors_.rows;  
+  tmp = feature_descriptors_.step * feature_descriptors_.rows + quantized_descriptors_.memoryFootprint();  
   ROS_INFO_COND(write_to_log, "Descriptor Information: %zu bytes", tmp);
   size += tmp;
 
@@ -1360,9 +1845,23 @@ long Node::getMemoryFootprint(bool write_to_log)
   ROS_INFO_COND(write_to_log, "Feature 3D Location Information: %zu bytes", tmp);
   size += tmp;
 
+  tmp = feature_block_.memoryFootprint();
+  ROS_INFO_COND(write_to_log, "Feature Block (structure of arrays): %zu bytes", tmp);
+  size += tmp;
+
   tmp = pc_col->size() * sizeof(point_type);
+  {
+    QMutexLocker locker(&cloud_cache_mutex_);
+    for(CloudCache::const_iterator it = cloud_cache_.begin(); it != cloud_cache_.end(); ++it){
+      if(it->first == this) tmp += it->second->size() * sizeof(point_type); //lazily computed
+    }
+  }
   ROS_INFO_COND(write_to_log, "Point Cloud: %zu bytes", tmp);
   size += tmp;
+
+  tmp = depth_img_.step * depth_img_.rows + color_img_.step * color_img_.rows;
+  ROS_INFO_COND(write_to_log, "Depth and Color Image (lazy point cloud): %zu bytes", tmp);
+  size += tmp;
   ROS_INFO_COND(write_to_log, "Rough Summary: %zu Kbytes", size/1024);
   ROS_WARN("Rough Summary: %zu Kbytes", size/1024);
   return size;
@@ -1370,6 +1869,12 @@ long Node::getMemoryFootprint(bool write_to_log)
 
 void Node::clearPointCloud(){
     ROS_INFO("Deleting points of Node %i", this->id_);
+    depth_img_.release();
+    color_img_.release();
+    {
+      QMutexLocker locker(&cloud_cache_mutex_);
+      if(lookupCachedCloud()) cloud_cache_.pop_front();
+    }
     //clear only points, by swapping data with empty vector (so mem really gets freed)
     pc_col->width = 0;
     pc_col->height = 0;
@@ -1401,12 +1906,13 @@ void pairwiseObservationLikelihood(const Node* newer_node, const Node* older_nod
 { 
       double likelihood, confidence;
       unsigned int inlier_points = 0, outlier_points = 0, all_points = 0, occluded_points = 0;
+      pointcloud_type::Ptr newer_cloud = newer_node->getPointCloud(), older_cloud = older_node->getPointCloud();
       #pragma omp parallel sections reduction (+: inlier_points, outlier_points, all_points, occluded_points)
       {
         #pragma omp section
         {
           unsigned int inlier_pts = 0, outlier_pts = 0, occluded_pts = 0, all_pts = 0;
-          observationLikelihood(mr.final_trafo, newer_node->pc_col, older_node->pc_col, likelihood, confidence, inlier_pts, outlier_pts, occluded_pts, all_pts) ;
+          observationLikelihood(mr.final_trafo, newer_cloud, older_cloud, likelihood, confidence, inlier_pts, outlier_pts, occluded_pts, all_pts) ;
           ROS_INFO("Observation Likelihood: %d projected to %d: good_point_ratio: %d/%d: %g, occluded points: %d", newer_node->id_, older_node->id_, inlier_pts, inlier_pts+outlier_pts, ((float)inlier_pts)/(inlier_pts+outlier_pts), occluded_pts);
           //rejectionSignificance(mr.final_trafo, newer_node->pc_col, older_node->pc_col);
           inlier_points += inlier_pts;
@@ -1418,7 +1924,7 @@ void pairwiseObservationLikelihood(const Node* newer_node, const Node* older_nod
         #pragma omp section
         {
           unsigned int inlier_pts = 0, outlier_pts = 0, occluded_pts = 0, all_pts = 0;
-          observationLikelihood(mr.final_trafo.inverse(), older_node->pc_col, newer_node->pc_col, likelihood, confidence, inlier_pts, outlier_pts, occluded_pts, all_pts) ;
+          observationLikelihood(mr.final_trafo.inverse(), older_cloud, newer_cloud, likelihood, confidence, inlier_pts, outlier_pts, occluded_pts, all_pts) ;
           ROS_INFO("Observation Likelihood: %d projected to %d: good_point_ratio: %d/%d: %g, occluded points: %d", older_node->id_, newer_node->id_, inlier_pts, inlier_pts+outlier_pts, ((float)inlier_pts)/(inlier_pts+outlier_pts), occluded_pts);
           //rejectionSignificance(mr.final_trafo, newer_node->pc_col, older_node->pc_col);
           inlier_points += inlier_pts;
@@ -1455,37 +1961,10 @@ Eigen::Matrix4f getTransformFromMatches(const Node* newer_node,
                                         bool& valid, 
                                         const float max_dist_m) 
 {
-  pcl::TransformationFromCorrespondences tfc;
-  valid = true;
-  std::vector<Eigen::Vector3f> t, f;
-
-  BOOST_FOREACH(const cv::DMatch& m, matches)
-  {
-    Eigen::Vector3f from = newer_node->feature_locations_3d_[m.queryIdx].head<3>();
-    Eigen::Vector3f to = earlier_node->feature_locations_3d_[m.trainIdx].head<3>();
-    if(isnan(from(2)) || isnan(to(2)))
-      continue;
-    //Validate that 3D distances are corresponding
-    if (max_dist_m > 0) {  //storing is only necessary, if max_dist is given
-      if(f.size() >= 1)
-      {
-        float delta_f = (from - f.back()).squaredNorm();//distance to the previous query point
-        float delta_t = (to   - t.back()).squaredNorm();//distance from one to the next train point
-
-        if ( abs(delta_f-delta_t) > max_dist_m * max_dist_m ) {
-          valid = false;
-          return Eigen::Matrix4f();
-        }
-      }
-      f.push_back(from);
-      t.push_back(to);    
-    }
-
-    tfc.add(from, to,1.0);// 1.0/(to(2)*to(2)));//the further, the less weight b/c of quadratic accuracy decay
-  }
-
-  // get relative movement from samples
-  return tfc.getTransformation().matrix();
+  RigidTransformationEstimator estimator(max_dist_m);
+  Eigen::Matrix4f transformation;
+  valid = estimator.estimate(newer_node->feature_block_, earlier_node->feature_block_, matches, transformation);
+  return valid ? transformation : Eigen::Matrix4f();
 }
 
 Eigen::Matrix4f getTransformFromMatchesUmeyama(const Node* newer_node,
@@ -1495,8 +1974,8 @@ Eigen::Matrix4f getTransformFromMatchesUmeyama(const Node* newer_node,
   Eigen::Matrix<float, 3, Eigen::Dynamic> tos(3,matches.size()), froms(3,matches.size());
   std::vector<cv::DMatch>::const_iterator it = matches.begin();
   for (int i = 0 ;it!=matches.end(); it++, i++) {
-    Eigen::Vector3f f = newer_node->feature_locations_3d_[it->queryIdx].head<3>(); //Oh my god, c++
-    Eigen::Vector3f t = earlier_node->feature_locations_3d_[it->trainIdx].head<3>();
+    Eigen::Vector3f f = newer_node->feature_block_.position3(it->queryIdx);
+    Eigen::Vector3f t = earlier_node->feature_block_.position3(it->trainIdx);
     if(isnan(f(2)) || isnan(t(2)))
       continue;
     froms.col(i) = f;
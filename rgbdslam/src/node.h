@@ -33,6 +33,7 @@
 //for ground truth
 #include <tf/transform_datatypes.h>
 #include <QMutex>
+#include <QFuture>
 
 #ifdef USE_ICP_BIN
 #include "gicp-fallback.h"
@@ -44,12 +45,16 @@
 #endif
 
 #include "matching_result.h" 
+#include "feature_matching.h"
+#include "feature_block.h"
+#include "rigid_transformation.h"
 #include <Eigen/StdVector>
+#include <list>
 typedef std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > std_vector_of_eigen_vector4f;
 //!Holds the data for one graph node and provides functionality to compute relative transformations to other Nodes.
 class Node {
 public:
-	///Visual must be CV_8UC1, depth CV_32FC1, 
+	///Visual must be CV_8UC1, depth CV_32FC1 (meter) or CV_16UC1 (millimeter, see convertDepth), 
 	///detection_mask must be CV_8UC1 with non-zero 
 	///at potential keypoint locations
 	Node(const cv::Mat& visual,
@@ -74,6 +79,12 @@ public:
 
 	///Compare the features of two nodes and compute the transformation
   MatchingResult matchNodePair(const Node* older_node);
+  ///As matchNodePair, but the features are only compared within guided_matching_radius of their position
+  ///predicted by predicted_transformation (from this to older_node). Falls back to matchNodePair, if no valid 
+  ///transformation is found this way
+  MatchingResult matchNodePairGuided(const Node* older_node, const Eigen::Matrix4f& predicted_transformation);
+  ///As matchNodePair, with the feature matches computed beforehand, e.g. by batchFeatureMatching
+  MatchingResult matchNodePairWithMatches(const Node* older_node, const std::vector<cv::DMatch>& matches);
   //MatchingResult matchNodePair2(const Node* older_node);
 
   ///Transform, e.g., from Joint/Wheel odometry
@@ -106,6 +117,11 @@ public:
   //!Fills "matches" and returns ratio of "good" features 
   //!in the sense of distinction via the "nn_distance_ratio" setting (see parameter server)
 	unsigned int featureMatching(const Node* other, std::vector<cv::DMatch>* matches) const;
+  //!Feature matching against several nodes in one pass over the features of this node. 
+  //!matches[i] corresponds to others[i]. Returns false, if the matcher_type or descriptors do not allow it
+  bool batchFeatureMatching(const std::vector<const Node*>& others, std::vector<std::vector<cv::DMatch> >& matches) const;
+  //!As featureMatching, but compare only features that are close in the image, given the predicted transformation from this to other
+  unsigned int guidedFeatureMatching(const Node* other, const Eigen::Matrix4f& predicted_transformation, std::vector<cv::DMatch>* matches) const;
 
 #ifdef USE_ICP_CODE
 	bool getRelativeTransformationTo_ICP_code(const Node* target_node,
@@ -133,6 +149,14 @@ public:
   void addPointCloud(pointcloud_type::Ptr pc_col);
 
 
+  //!Returns the point cloud. If the node only stores depth and color image (see parameter
+  //!lazy_point_clouds), the cloud is computed on demand and kept in a small LRU cache shared by all nodes.
+  //!Header and sensor pose of the returned cloud are taken from pc_col. Thread-safe.
+  pointcloud_type::Ptr getPointCloud() const;
+  //!Number of points of the cloud returned by getPointCloud(), without computing it
+  size_t getPointCloudSize() const;
+  //!True if pc is pc_col or the cached cloud computed from the lazily stored images
+  bool ownsPointCloud(pointcloud_type const* pc) const;
   //!erase the points from the cloud to save memory
   void clearPointCloud();
   //!reduce the points from the cloud using a voxelgrid_filter to save memory
@@ -144,15 +168,22 @@ public:
 	int vertex_id_;   //<id of the corresponding vertex in the g2o graph
   bool valid_tf_estimate_;      //<Flags whether the data of this node should be considered for postprocessing steps, e.g., visualization, trajectory, map creation
   bool matchable_;        //< Flags whether the data for matching is (still) available
+  ///The point cloud. Empty (except for header and sensor pose) if the node stores the data lazily. Use getPointCloud() to get the points
   pointcloud_type::Ptr pc_col;
 #ifdef USE_PCL_ICP
   pointcloud_type::Ptr filtered_pc_col; //<Used for icp. May not contain NaN
 #endif
-  ///descriptor definitions
+  ///descriptor definitions. Empty if the descriptors are quantized
 	cv::Mat feature_descriptors_;         
+  ///8 bit representation of float descriptors, see quantize_descriptors. Empty otherwise
+  QuantizedDescriptors quantized_descriptors_;
+  ///The (possibly dequantized) descriptors. Returns a copy if the descriptors are quantized
+  cv::Mat getDescriptors() const;
 
   ///backprojected 3d descriptor locations relative to cam position in homogeneous coordinates (last dimension is 1.0)
 	std_vector_of_eigen_vector4f feature_locations_3d_;  
+  ///Positions and precomputed depth covariances of the features as structure of arrays, for RANSAC
+  FeatureBlock feature_block_;
 	std::vector<float> siftgpu_descriptors;
 
   ///Where in the image are the descriptors
@@ -168,6 +199,7 @@ public:
   // std::set<int> visible_landmarks;
 #endif
 
+  ///The flann index of the descriptors. NULL while it is still being built in the background, or if not used
   const cv::flann::Index* getFlannIndex() const;
   void knnSearch(cv::Mat& query,
                  cv::Mat& indices,
@@ -182,7 +214,26 @@ public:
 protected:
   static QMutex gicp_mutex;
   static QMutex siftgpu_mutex;
+  ///Most recently used lazily computed point clouds first
+  typedef std::list<std::pair<const Node*, pointcloud_type::Ptr> > CloudCache;
+  static CloudCache cloud_cache_;
+  static QMutex cloud_cache_mutex_;
+  ///Returns the cached cloud of this node (and marks it as recently used) or an empty pointer. Requires cloud_cache_mutex_
+  pointcloud_type::Ptr lookupCachedCloud() const;
+  ///Replace float descriptors by quantized_descriptors_ (and drop the SiftGPU copy, if it is not used for matching)
+  void quantizeDescriptors();
+  ///Compact storage for lazy_point_clouds: depth in millimeter (CV_16UC1), color image and intrinsics
+  cv::Mat depth_img_;
+  cv::Mat color_img_;
+  sensor_msgs::CameraInfoConstPtr cam_info_;
 	mutable cv::flann::Index* flannIndex;
+  ///Started once at the end of the construction, see startFlannIndexBuild()
+  QFuture<void> flann_index_future_;
+  ///Build the flann index in the background, if the FLANN matcher is used
+  void startFlannIndexBuild();
+  void buildFlannIndex();
+  ///RANSAC (and ICP, if enabled) on mr.all_matches. Fills mr and returns whether a valid transformation was found
+  bool transformationFromMatches(const Node* older_node, MatchingResult& mr);
   tf::StampedTransform base2points_; //!<contains the transformation from the base (defined on param server) to the point_cloud
   tf::StampedTransform ground_truth_transform_;//!<contains the transformation from the mocap system
   tf::StampedTransform odom_transform_;        //!<contains the transformation from the wheel encoders/joint states
@@ -201,7 +252,11 @@ protected:
                           const cv::Mat& depth,
                           const sensor_msgs::CameraInfoConstPtr& cam_info,
                           std::vector<float>& descriptors_in, cv::Mat& descriptors_out);
+  //! copy the descriptors of the first count features to descriptors_out and siftgpu_descriptors
+  void copySiftGPUDescriptors(size_t count, const std::vector<float>& descriptors_in, cv::Mat& descriptors_out);
 #endif
+  //! depth in meter of all keypoints in one batch, either at the keypoint or the minimum in its neighbourhood (use_feature_min_depth)
+  void getKeypointDepths(const cv::Mat& depth, const std::vector<cv::KeyPoint>& keypoints, std::vector<float>& depths) const;
 	//! return the 3D projection of valid keypoints using information from the point cloud and remove invalid keypoints (NaN depth) 
 	void projectTo3D(std::vector<cv::KeyPoint>& feature_locations_2d,
                    std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> >& feature_locations_3d,
@@ -215,13 +270,22 @@ protected:
   
   ///Retrieves and stores the transformation from base to point cloud at capturing time 
   void retrieveBase2CamTransformation();
+  ///One RANSAC hypothesis: estimates the transformation from the sample (in inlier) and refines it 
+  ///iteratively with its inliers. Returns false if no acceptable hypothesis results
+  bool refineRansacHypothesis(const Node* earlier_node,
+                              const std::vector<cv::DMatch>& initial_matches,
+                              std::vector<cv::DMatch>& inlier, //sample, overwritten
+                              unsigned int min_inlier_threshold,
+                              RigidTransformationEstimator& estimator, //scratch space, see getTransformFromMatches
+                              float max_dist_m,
+                              Eigen::Matrix4f& refined_transformation, //pure output var
+                              std::vector<cv::DMatch>& refined_matches, //pure output var
+                              double& refined_error) const; //pure output var
 	// helper for ransac
 	void computeInliersAndError(const std::vector<cv::DMatch> & initial_matches,
                               const Eigen::Matrix4f& transformation,
-                              const std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> >& origins,
-                              //const std::vector<std::pair<float, float> > origins_depth_stats,
-                              const std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> >& targets,
-                              //const std::vector<std::pair<float, float> > targets_depth_stats,
+                              const FeatureBlock& origins,
+                              const FeatureBlock& targets,
                               std::vector<cv::DMatch>& new_inliers, //pure output var
                               double& mean_error, //pure output var //std::vector<double>& errors,
                               double squaredMaxInlierDistInM = 0.0009) const; //output var;
@@ -233,7 +297,7 @@ public:
 void pairwiseObservationLikelihood(const Node* newer_node, const Node* older_node, MatchingResult& mr);
 ///Compute the RootSIFT from SIFT according to Arandjelovic and Zisserman
 void squareroot_descriptor_space(cv::Mat& feature_descriptors);
-// Compute the transformation from matches using pcl::TransformationFromCorrespondences
+// Compute the transformation from matches using the RigidTransformationEstimator (closed form for three matches)
 Eigen::Matrix4f getTransformFromMatches(const Node* newer_node,
                                         const Node* older_node, 
                                         const std::vector<cv::DMatch> & matches,
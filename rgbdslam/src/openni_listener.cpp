@@ -27,6 +27,7 @@
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <algorithm>
 #include <cv.h>
 //#include <ctime>
 #include <sensor_msgs/PointCloud2.h>
@@ -43,6 +44,9 @@
 
 #include "parameter_server.h"
 #include "scoped_timer.h"
+#include "tum_dataset.h"
+#include "keypoint_budget.h"
+#include <QThreadPool>
 //for comparison with ground truth from mocap and movable cameras on robots
 #include <tf/transform_listener.h>
 
@@ -51,11 +55,15 @@ typedef message_filters::Subscriber<sensor_msgs::CameraInfo> cinfo_sub_type;
 typedef message_filters::Subscriber<sensor_msgs::PointCloud2> pc_sub_type;      
 typedef message_filters::Subscriber<sensor_msgs::PointCloud2> pc_sub_type;      
 
+///Length of the tf cache for bagfiles in seconds. Only the buffered transforms take memory, so it may exceed any bagfile
+static const double offline_tf_cache_length = 24 * 3600.0;
+
 
 
 
 OpenNIListener::OpenNIListener(GraphManager* graph_mgr)
 : graph_mgr_(graph_mgr),
+  detector_generation_(0),
   stereo_sync_(NULL), kinect_sync_(NULL), no_cloud_sync_(NULL),
   visua_sub_(NULL), depth_sub_(NULL), cloud_sub_(NULL),
   depth_mono8_img_(cv::Mat()),
@@ -63,6 +71,12 @@ OpenNIListener::OpenNIListener(GraphManager* graph_mgr)
   pause_(ParameterServer::instance()->get<bool>("start_paused")),
   getOneFrame_(false),
   first_frame_(true),
+  pipeline_active_(false),
+  next_frame_sequence_(0),
+  next_insertion_sequence_(0),
+  frames_in_pipeline_(0),
+  static_frames_skipped_(0),
+  gui_worker_active_(false),
   data_id_(0),
   image_encoding_("rgb8")
 {
@@ -73,8 +87,12 @@ OpenNIListener::OpenNIListener(GraphManager* graph_mgr)
   std::string depth_tpc = ps->get<std::string>("topic_image_depth");
   std::string cinfo_tpc = ps->get<std::string>("camera_info_topic");
   ros::NodeHandle nh;
-  tflistener_ = new tf::TransformListener(nh);
   if(bagfile_name.empty()){
+    tflistener_ = new tf::TransformListener(nh);
+  } else { //bufferTransforms loads the /tf data of the whole bagfile at once, the cache needs to hold it
+    tflistener_ = new tf::TransformListener(nh, ros::Duration(offline_tf_cache_length));
+  }
+  if(bagfile_name.empty() && ps->get<std::string>("tum_dataset_dir").empty()){
     std::string cloud_tpc = ps->get<std::string>("topic_points");
     std::string widev_tpc = ps->get<std::string>("wide_topic");
     std::string widec_tpc = ps->get<std::string>("wide_cloud_topic");
@@ -110,16 +128,12 @@ OpenNIListener::OpenNIListener(GraphManager* graph_mgr)
       ROS_INFO_STREAM("Listening to " << widev_tpc << " and " << widec_tpc );
     } 
 
+    detector_generation_ = KeypointBudget::instance()->generation();
     detector_ = createDetector(ps->get<std::string>("feature_detector_type"));
     extractor_ = createDescriptorExtractor(ps->get<std::string>("feature_extractor_type"));
 
-    if(ps->get<bool>("concurrent_node_construction")){
-      ROS_DEBUG("Threads used by QThreadPool on this Computer %i. Will increase this by one, b/c the QtRos Thread is very lightweight", QThread::idealThreadCount());
-      //QThreadPool::globalInstance()->setMaxThreadCount(QThread::idealThreadCount()*2+2);
-    }
-
   } 
-  else //Bagfile given
+  else //Bagfile or dataset directory given
   {
     tf_pub_ = nh.advertise<tf::tfMessage>("/tf", 10);
     //All information from Kinect
@@ -134,9 +148,107 @@ OpenNIListener::OpenNIListener(GraphManager* graph_mgr)
       ROS_INFO_STREAM("Listening to " << visua_tpc << " and " << depth_tpc);
     } 
 
+    detector_generation_ = KeypointBudget::instance()->generation();
     detector_ = createDetector(ps->get<std::string>("feature_detector_type"));
     extractor_ = createDescriptorExtractor(ps->get<std::string>("feature_extractor_type"));
   }
+  rgba_buffers_.resize(3); //Only used by the gui image worker
+
+  if(ps->get<bool>("use_gui")){
+    startGUIWorker();
+  }
+  if(ps->get<bool>("concurrent_node_construction")){
+    startPipeline();
+  }
+}
+
+void OpenNIListener::startPipeline()
+{
+  ParameterServer* ps = ParameterServer::instance();
+  int depth = ps->get<int>("pipeline_queue_depth");
+  BackpressurePolicy policy = backpressurePolicyFromString(ps->get<std::string>("pipeline_backpressure"));
+  frame_queue_.configure(depth, policy);
+  node_queue_.configure(depth, policy);
+
+  //The stage workers run for the lifetime of the listener. Add threads to the pool, s.t. 
+  //they don't take away the threads used for the concurrent edge construction
+  int construction_threads = ps->get<int>("node_construction_threads");
+  int stage_count = construction_threads + 1;
+  QThreadPool::globalInstance()->setMaxThreadCount(QThreadPool::globalInstance()->maxThreadCount() + stage_count);
+  ROS_DEBUG("Threads used by QThreadPool on this Computer %i. Added %i for the frame pipeline", QThread::idealThreadCount(), stage_count);
+
+  for(int i = 0; i < construction_threads; i++){
+    node_construction_futures_.push_back(QtConcurrent::run(this, &OpenNIListener::nodeConstructionLoop));
+  }
+  graph_insertion_future_ = QtConcurrent::run(this, &OpenNIListener::graphInsertionLoop);
+  pipeline_active_ = true;
+  ROS_INFO("Frame pipeline started with %i node construction threads, queue depth %i and backpressure policy \"%s\"", construction_threads, depth, ps->get<std::string>("pipeline_backpressure").c_str());
+}
+
+void OpenNIListener::stopPipeline()
+{
+  if(!pipeline_active_) return;
+  frame_queue_.close();
+  for(unsigned int i = 0; i < node_construction_futures_.size(); i++){
+    node_construction_futures_[i].waitForFinished();
+  }
+  node_construction_futures_.clear();
+  node_queue_.close();
+  graph_insertion_future_.waitForFinished();
+  pipeline_active_ = false;
+}
+
+void OpenNIListener::startGUIWorker()
+{
+  ParameterServer* ps = ParameterServer::instance();
+  visualization_queue_.configure(ps->get<int>("pipeline_queue_depth"), 
+                                 backpressurePolicyFromString(ps->get<std::string>("pipeline_visualization_backpressure")));
+  QThreadPool::globalInstance()->setMaxThreadCount(QThreadPool::globalInstance()->maxThreadCount() + 1);
+  visualization_future_ = QtConcurrent::run(this, &OpenNIListener::visualizationLoop);
+  gui_worker_active_ = true;
+}
+
+void OpenNIListener::stopGUIWorker()
+{
+  if(!gui_worker_active_) return;
+  gui_worker_active_ = false;
+  visualization_queue_.close();
+  visualization_future_.waitForFinished();
+}
+
+bool OpenNIListener::guiImageDue(const char* signal, ros::WallTime& last_publication)
+{
+  //Without a connected viewer, no conversion cost should be paid at all
+  if(!gui_worker_active_ || receivers(signal) == 0) return false;
+  double rate = ParameterServer::instance()->get<double>("gui_image_rate");
+  QMutexLocker locker(&gui_rate_mutex_);
+  ros::WallTime now = ros::WallTime::now();
+  if(rate > 0.0 && (now - last_publication).toSec() < 1.0 / rate) return false;
+  last_publication = now;
+  return true;
+}
+
+void OpenNIListener::publishSensorImages(const cv::Mat& visual_img, const cv::Mat& depth_mono8_img, const MessageTracker& tracked_msgs)
+{
+  VisualizationData vis, dropped;
+  vis.visual_img = visual_img;
+  vis.depth_mono8_img = depth_mono8_img;
+  vis.tracked_msgs = tracked_msgs;
+  visualization_queue_.push(vis, dropped); //Dropped images are simply discarded
+}
+
+void OpenNIListener::waitForPipeline()
+{
+  QMutexLocker locker(&pipeline_mutex_);
+  while(frames_in_pipeline_ > 0){
+    pipeline_idle_.wait(&pipeline_mutex_);
+  }
+}
+
+void OpenNIListener::frameLeftPipeline()
+{
+  QMutexLocker locker(&pipeline_mutex_);
+  if(--frames_in_pipeline_ <= 0) pipeline_idle_.wakeAll();
 }
 
  
@@ -174,76 +286,85 @@ void OpenNIListener::loadBag(const std::string &filename)
     topics.push_back(cinfo_tpc);
     topics.push_back(tf_tpc);
 
-    rosbag::View view(bag, rosbag::TopicQuery(topics));
-   // int lc=0; 
-    // Simulate sending of the messages in the bagfile
-    std::deque<sensor_msgs::Image::ConstPtr> vis_images;
-    std::deque<sensor_msgs::Image::ConstPtr> dep_images;
-    std::deque<sensor_msgs::CameraInfo::ConstPtr> cam_infos;
-    ros::Time last_tf=ros::Time(0);
-    BOOST_FOREACH(rosbag::MessageInstance const m, view)
-    {
-    //  if(lc++ > 1000) break;
-      do{ 
-        usleep(150);
-        if(!ros::ok()) return;
-      } while(pause_);
-
-      if (m.getTopic() == visua_tpc || ("/" + m.getTopic() == visua_tpc))
+    if(ps->get<bool>("bagfile_offline_replay")){
+      replayBagOffline(bag, topics);
+      if(!ros::ok()) return;
+    } else {
+      rosbag::View view(bag, rosbag::TopicQuery(topics));
+     // int lc=0; 
+      // Simulate sending of the messages in the bagfile
+      std::deque<sensor_msgs::Image::ConstPtr> vis_images;
+      std::deque<sensor_msgs::Image::ConstPtr> dep_images;
+      std::deque<sensor_msgs::CameraInfo::ConstPtr> cam_infos;
+      ros::Time last_tf=ros::Time(0);
+      BOOST_FOREACH(rosbag::MessageInstance const m, view)
       {
-        sensor_msgs::Image::ConstPtr rgb_img = m.instantiate<sensor_msgs::Image>();
-        if (rgb_img) vis_images.push_back(rgb_img);
-        ROS_DEBUG("Found Message of %s", visua_tpc.c_str());
-      }
+      //  if(lc++ > 1000) break;
+        do{ 
+          usleep(150);
+          if(!ros::ok()) return;
+        } while(pause_);
+
+        if (m.getTopic() == visua_tpc || ("/" + m.getTopic() == visua_tpc))
+        {
+          sensor_msgs::Image::ConstPtr rgb_img = m.instantiate<sensor_msgs::Image>();
+          if (rgb_img) vis_images.push_back(rgb_img);
+          ROS_DEBUG("Found Message of %s", visua_tpc.c_str());
+        }
       
-      if (m.getTopic() == depth_tpc || ("/" + m.getTopic() == depth_tpc))
-      {
-        sensor_msgs::Image::ConstPtr depth_img = m.instantiate<sensor_msgs::Image>();
-        //if (depth_img) depth_img_sub_->newMessage(depth_img);
-        if (depth_img) dep_images.push_back(depth_img);
-        ROS_DEBUG("Found Message of %s", depth_tpc.c_str());
-      }
-      if (m.getTopic() == cinfo_tpc || ("/" + m.getTopic() == cinfo_tpc))
-      {
-        sensor_msgs::CameraInfo::ConstPtr cam_info = m.instantiate<sensor_msgs::CameraInfo>();
-        //if (cam_info) cam_info_sub_->newMessage(cam_info);
-        if (cam_info) cam_infos.push_back(cam_info);
-        ROS_DEBUG("Found Message of %s", cinfo_tpc.c_str());
-      }
-      if (m.getTopic() == tf_tpc|| ("/" + m.getTopic() == tf_tpc)){
-        tf::tfMessage::ConstPtr tf_msg = m.instantiate<tf::tfMessage>();
-        if (tf_msg) {
-          //if(tf_msg->transforms[0].header.frame_id == "/kinect") continue;//avoid destroying tf tree if odom is used
-          //prevents missing callerid warning
-          boost::shared_ptr<std::map<std::string, std::string> > msg_header_map = tf_msg->__connection_header;
-          (*msg_header_map)["callerid"] = "rgbdslam";
-          tf_pub_.publish(tf_msg);
-          ROS_DEBUG("Found Message of %s", tf_tpc.c_str());
-          last_tf = tf_msg->transforms[0].header.stamp;
-          last_tf -= ros::Duration(1.0);
+        if (m.getTopic() == depth_tpc || ("/" + m.getTopic() == depth_tpc))
+        {
+          sensor_msgs::Image::ConstPtr depth_img = m.instantiate<sensor_msgs::Image>();
+          //if (depth_img) depth_img_sub_->newMessage(depth_img);
+          if (depth_img) dep_images.push_back(depth_img);
+          ROS_DEBUG("Found Message of %s", depth_tpc.c_str());
+        }
+        if (m.getTopic() == cinfo_tpc || ("/" + m.getTopic() == cinfo_tpc))
+        {
+          sensor_msgs::CameraInfo::ConstPtr cam_info = m.instantiate<sensor_msgs::CameraInfo>();
+          //if (cam_info) cam_info_sub_->newMessage(cam_info);
+          if (cam_info) cam_infos.push_back(cam_info);
+          ROS_DEBUG("Found Message of %s", cinfo_tpc.c_str());
+        }
+        if (m.getTopic() == tf_tpc|| ("/" + m.getTopic() == tf_tpc)){
+          tf::tfMessage::ConstPtr tf_msg = m.instantiate<tf::tfMessage>();
+          if (tf_msg) {
+            //if(tf_msg->transforms[0].header.frame_id == "/kinect") continue;//avoid destroying tf tree if odom is used
+            //prevents missing callerid warning
+            boost::shared_ptr<std::map<std::string, std::string> > msg_header_map = tf_msg->__connection_header;
+            (*msg_header_map)["callerid"] = "rgbdslam";
+            tf_pub_.publish(tf_msg);
+            ROS_DEBUG("Found Message of %s", tf_tpc.c_str());
+            last_tf = tf_msg->transforms[0].header.stamp;
+            last_tf -= ros::Duration(1.0);
+          }
+        }
+        while(!vis_images.empty() && vis_images.front()->header.stamp < last_tf){
+            rgb_img_sub_->newMessage(vis_images.front());
+            vis_images.pop_front();
+        }
+        while(!dep_images.empty() && dep_images.front()->header.stamp < last_tf){
+            depth_img_sub_->newMessage(dep_images.front());
+            dep_images.pop_front();
+        }
+        while(!cam_infos.empty() && cam_infos.front()->header.stamp < last_tf){
+            cam_info_sub_->newMessage(cam_infos.front());
+            cam_infos.pop_front();
         }
-      }
-      while(!vis_images.empty() && vis_images.front()->header.stamp < last_tf){
-          rgb_img_sub_->newMessage(vis_images.front());
-          vis_images.pop_front();
-      }
-      while(!dep_images.empty() && dep_images.front()->header.stamp < last_tf){
-          depth_img_sub_->newMessage(dep_images.front());
-          dep_images.pop_front();
-      }
-      while(!cam_infos.empty() && cam_infos.front()->header.stamp < last_tf){
-          cam_info_sub_->newMessage(cam_infos.front());
-          cam_infos.pop_front();
-      }
 
+      }
     }
     ROS_WARN_NAMED("eval", "Finished processing of Bagfile");
     bag.close();
   }
+  finishOfflineProcessing(filename, eval_landmarks);
+}
+
+//! Wait until all frames are processed, then run the final optimization and store the results (if batch_processing is set)
+void OpenNIListener::finishOfflineProcessing(const std::string& filename, bool eval_landmarks)
+{
   do{ 
-    if(!future_.isFinished()){
-      future_.waitForFinished(); //Wait if GraphManager ist still computing. 
-    }
+    waitForPipeline(); //Wait if frames are still queued or GraphManager ist still computing. 
     usleep(1000000); //give it a chance to receive further messages
     if(!ros::ok()) return;
     ROS_WARN("Waiting for processing to finish.");
@@ -322,6 +443,198 @@ void OpenNIListener::loadBag(const std::string &filename)
 }
 
 
+///Decode the images of a dataset frame into the format of the ros callbacks. Runs in the thread pool
+static FrameData decodeTUMFrame(const TUMDataset* dataset, size_t i, std::string frame_id)
+{
+  FrameData frame;
+  if(!dataset->loadFrame(i, frame.visual_img, frame.depth_img)) return frame; //empty images
+  convertDepth(frame.depth_img, frame.depth_mono8_img, TUMDataset::depth_scale);
+  frame.depth_header.seq = i;
+  frame.depth_header.stamp = dataset->depthStamp(i);
+  frame.depth_header.frame_id = frame_id;
+  return frame;
+}
+
+//! Load data from a directory of the TUM RGB-D benchmark
+/**Reads the file lists (rgb.txt, depth.txt, groundtruth.txt) and the PNG images
+ * directly, without rosbag. The images are decoded in the thread pool, up to 
+ * dataset_prefetch_size frames ahead of the processing. The frames are handed
+ * to the node construction in the order of the dataset. */
+void OpenNIListener::loadTUMDataset(const std::string& directory)
+{
+  ScopedTimer s(__FUNCTION__);
+  ParameterServer* ps = ParameterServer::instance();
+  bool eval_landmarks = ps->get<bool>("optimize_landmarks");
+  ps->set<bool>("optimize_landmarks", false);
+
+  TUMDataset dataset;
+  if(!dataset.open(directory)){
+    ROS_FATAL("Opening dataset %s failed. Quitting!", directory.c_str());
+    ros::shutdown();
+    return;
+  }
+  //Never drop frames, to get the same result for every run
+  frame_queue_.configure(ps->get<int>("pipeline_queue_depth"), BLOCK);
+  node_queue_.configure(ps->get<int>("pipeline_queue_depth"), BLOCK);
+
+  //Intrinsics of the sequence (default: those recommended by the benchmark). The depth_camera_* parameters take precedence (see createXYZRGBPointCloud)
+  sensor_msgs::CameraInfoPtr cam_info(new sensor_msgs::CameraInfo());
+  cam_info->width = 640; cam_info->height = 480;
+  cam_info->K[0] = ps->get<double>("tum_dataset_fx"); cam_info->K[2] = ps->get<double>("tum_dataset_cx");
+  cam_info->K[4] = ps->get<double>("tum_dataset_fy"); cam_info->K[5] = ps->get<double>("tum_dataset_cy");
+  cam_info->K[8] = 1.0;
+
+  //The camera is the base. The ground truth is the pose of the color camera
+  const std::string base_frame = ps->get<std::string>("base_frame_name");
+  const std::string gt_frame   = ps->get<std::string>("ground_truth_frame_name");
+  const std::string frame_id   = ps->get<std::string>("tum_dataset_frame_id");
+  const std::string camera_frame = ps->get<std::string>("tum_dataset_camera_frame");
+  const int skip_first_n_frames = ps->get<int>("skip_first_n_frames");
+  const int data_skip_step = ps->get<int>("data_skip_step");
+  const size_t prefetch_size = std::max(1, ps->get<int>("dataset_prefetch_size"));
+  image_encoding_ = "rgb8";
+
+  std::deque<QFuture<FrameData> > prefetched;
+  size_t next = 0;
+  while(ros::ok())
+  {
+    while(prefetched.size() < prefetch_size && next < dataset.size()){
+      if(++data_id_ < skip_first_n_frames || data_id_ % data_skip_step != 0){
+        next++;
+        continue;
+      }
+      prefetched.push_back(QtConcurrent::run(decodeTUMFrame, &dataset, next++, frame_id));
+    }
+    if(prefetched.empty()) break; //End of dataset
+
+    FrameData frame = prefetched.front().result(); //Blocks until decoded
+    prefetched.pop_front();
+    if(frame.visual_img.empty()) continue; //Failed to load
+
+    while(pause_ && !getOneFrame_ && ros::ok()){ usleep(10000); }
+    getOneFrame_ = false;
+
+    frame.cam_info = cam_info;
+    frame.use_tf = false;
+    ros::Time stamp = frame.depth_header.stamp;
+    frame.base2points = tf::StampedTransform(tf::Transform::getIdentity(), stamp, base_frame, frame.depth_header.frame_id);
+    if(!gt_frame.empty()){
+      tf::Transform gt_pose;
+      if(dataset.groundTruth(stamp, gt_pose)){
+        frame.ground_truth = tf::StampedTransform(gt_pose, stamp, gt_frame, camera_frame);
+      } else {
+        ROS_WARN_THROTTLE(5, "No ground truth for %f - Using Identity (This message is throttled to 1 per 5 seconds)", stamp.toSec());
+        frame.ground_truth = tf::StampedTransform(tf::Transform::getIdentity(), stamp, "missing_ground_truth", camera_frame);
+      }
+    }
+
+    if(guiImageDue(SIGNAL(newVisualImage(QImage)), last_sensor_image_time_)){
+      publishSensorImages(frame.visual_img, frame.depth_mono8_img, MessageTracker());
+    }
+    enqueueFrame(frame); //Blocks if the pipeline is full
+  }
+  //Wait for the remaining decoding jobs, as they reference the dataset
+  for(size_t i = 0; i < prefetched.size(); i++) prefetched[i].waitForFinished();
+  if(!ros::ok()) return;
+  ROS_WARN_NAMED("eval", "Finished processing of dataset");
+
+  std::string basename = directory;
+  while(basename.size() > 1 && basename[basename.size()-1] == '/') basename.erase(basename.size()-1);
+  finishOfflineProcessing(basename, eval_landmarks);
+}
+
+void OpenNIListener::bufferTransforms(rosbag::Bag& bag, const std::string& tf_topic)
+{
+  ScopedTimer s(__FUNCTION__);
+  std::vector<std::string> tf_topics;
+  tf_topics.push_back(tf_topic);
+  tf_topics.push_back(tf_topic.substr(1)); //without leading slash
+  rosbag::View tf_view(bag, rosbag::TopicQuery(tf_topics));
+  if(tf_view.size() == 0) return;
+
+  //The cache of the listener needs to cover the whole bagfile. Usually it has been created long enough
+  ros::Duration bag_duration = tf_view.getEndTime() - tf_view.getBeginTime();
+  if(tflistener_->getCacheLength() < bag_duration + ros::Duration(10.0)){
+    waitForPipeline(); //The construction workers look up transforms in retrieveTransformations
+    ros::NodeHandle nh;
+    delete tflistener_;
+    tflistener_ = new tf::TransformListener(nh, bag_duration + ros::Duration(10.0));
+  }
+
+  unsigned int counter = 0;
+  BOOST_FOREACH(rosbag::MessageInstance const m, tf_view)
+  {
+    tf::tfMessage::ConstPtr tf_msg = m.instantiate<tf::tfMessage>();
+    if(!tf_msg) continue;
+    for(unsigned int i = 0; i < tf_msg->transforms.size(); i++){
+      tf::StampedTransform st;
+      tf::transformStampedMsgToTF(tf_msg->transforms[i], st);
+      tflistener_->setTransform(st, "rgbdslam_bagfile");
+      counter++;
+    }
+  }
+  ROS_INFO("Buffered %u transforms from the bagfile", counter);
+}
+
+void OpenNIListener::prefetchBagMessages(rosbag::View* view, BoundedQueue<BagMessage>* queue)
+{
+  ParameterServer* ps = ParameterServer::instance();
+  std::string visua_tpc = ps->get<std::string>("topic_image_mono");
+  std::string depth_tpc = ps->get<std::string>("topic_image_depth");
+  std::string cinfo_tpc = ps->get<std::string>("camera_info_topic");
+  BOOST_FOREACH(rosbag::MessageInstance const m, *view)
+  {
+    BagMessage msg;
+    const std::string topic = m.getTopic();
+    if (topic == visua_tpc || ("/" + topic == visua_tpc)) {
+      msg.rgb_img = m.instantiate<sensor_msgs::Image>();
+    } else if (topic == depth_tpc || ("/" + topic == depth_tpc)) {
+      msg.depth_img = m.instantiate<sensor_msgs::Image>();
+    } else if (topic == cinfo_tpc || ("/" + topic == cinfo_tpc)) {
+      msg.cam_info = m.instantiate<sensor_msgs::CameraInfo>();
+    } else { 
+      continue;
+    }
+    BagMessage dropped;
+    if(!queue->push(msg, dropped)) break; //queue has been closed by the consumer
+  }
+  queue->close(); //End of bagfile
+}
+
+void OpenNIListener::replayBagOffline(rosbag::Bag& bag, const std::vector<std::string>& topics)
+{
+  ScopedTimer s(__FUNCTION__);
+  ParameterServer* ps = ParameterServer::instance();
+  //Images are only handed on after the whole /tf data is known, s.t. the 
+  //lookups in retrieveTransformations do not depend on timing
+  bufferTransforms(bag, std::string("/tf"));
+
+  //Never drop frames, to get the same result for every run
+  frame_queue_.configure(ps->get<int>("pipeline_queue_depth"), BLOCK);
+  node_queue_.configure(ps->get<int>("pipeline_queue_depth"), BLOCK);
+
+  std::vector<std::string> image_topics;
+  for(unsigned int i = 0; i < topics.size(); i++){
+    if(topics[i] != "/tf") image_topics.push_back(topics[i]);
+  }
+  rosbag::View view(bag, rosbag::TopicQuery(image_topics));
+  BoundedQueue<BagMessage> prefetch_queue(ps->get<int>("bagfile_prefetch_size"), BLOCK);
+  QFuture<void> prefetch_future = QtConcurrent::run(this, &OpenNIListener::prefetchBagMessages, &view, &prefetch_queue);
+
+  //Messages are passed to the synchronizer in the order of the bagfile. Blocks, if the pipeline is full.
+  BagMessage msg;
+  while(prefetch_queue.pop(msg))
+  {
+    while(pause_ && ros::ok()){ usleep(10000); }
+    if(!ros::ok()) break;
+    if(msg.rgb_img)   rgb_img_sub_->newMessage(msg.rgb_img);
+    if(msg.depth_img) depth_img_sub_->newMessage(msg.depth_img);
+    if(msg.cam_info)  cam_info_sub_->newMessage(msg.cam_info);
+  }
+  prefetch_queue.close(); //Stops the prefetching if aborted
+  prefetch_future.waitForFinished();
+}
+
 void OpenNIListener::stereoCallback(const sensor_msgs::ImageConstPtr& visual_img_msg, const sensor_msgs::PointCloud2ConstPtr& point_cloud)
 {
     ScopedTimer s(__FUNCTION__);
@@ -350,9 +663,9 @@ void OpenNIListener::stereoCallback(const sensor_msgs::ImageConstPtr& visual_img
         }
     }
 
-    //Get images into OpenCV format
-    //sensor_msgs::CvBridge bridge;
-    cv::Mat visual_img =  cv_bridge::toCvCopy(visual_img_msg, "mono8")->image;
+    //Get images into OpenCV format. Shares the message data if it is already mono8
+    cv_bridge::CvImageConstPtr visual_cv_img = cv_bridge::toCvShare(visual_img_msg, "mono8");
+    cv::Mat visual_img = visual_cv_img->image;
     if(visual_img.rows != depth_img.rows ||
        visual_img.cols != depth_img.cols ||
        point_cloud->width != (uint32_t) visual_img.cols ||
@@ -369,16 +682,17 @@ void OpenNIListener::stereoCallback(const sensor_msgs::ImageConstPtr& visual_img
        bagfile_mutex.unlock();
        if(pause_) return;
     }
-    pointcloud_type::Ptr pc_col(new pointcloud_type());//will belong to node
-    if(ParameterServer::instance()->get<bool>("use_gui")){
-      Q_EMIT newVisualImage(cvMat2QImage(visual_img, 0)); //visual_idx=0
-      Q_EMIT newDepthImage (cvMat2QImage(depth_img,1));//overwrites last cvMat2QImage
+    MessageTracker tracked_msgs;
+    tracked_msgs.push_back(visual_cv_img);
+    if(guiImageDue(SIGNAL(newVisualImage(QImage)), last_sensor_image_time_)){
+      publishSensorImages(visual_img, depth_img, tracked_msgs);
     }
-    pcl::fromROSMsg(*point_cloud,*pc_col);
-    cameraCallback(visual_img, pc_col, depth_img);
+    cameraCallback(visual_img, point_cloud, depth_img, tracked_msgs);
 }
 
 OpenNIListener::~OpenNIListener(){
+  stopPipeline();
+  stopGUIWorker();
   delete tflistener_;
 }
 
@@ -396,11 +710,15 @@ void OpenNIListener::noCloudCallback (const sensor_msgs::ImageConstPtr& visual_i
   { 
   // If only a subset of frames are used, skip computations but visualize if gui is running
     ROS_INFO_THROTTLE(1, "Skipping Frame %i because of data_skip_step setting (this msg is only shown once a sec)", data_id_);
-    if(ps->get<bool>("use_gui")){//Show the image, even if not using it
+    if(guiImageDue(SIGNAL(newVisualImage(QImage)), last_sensor_image_time_)){//Show the image, even if not using it
       //sensor_msgs::CvBridge bridge;
-      cv::Mat depth_float_img = cv_bridge::toCvCopy(depth_img_msg)->image;
+      //The shared data is only read (convertDepth does not modify it)
+      MessageTracker tracked_msgs;
+      tracked_msgs.push_back(depth_img_msg);
+      tracked_msgs.push_back(visual_img_msg);
+      cv::Mat depth_float_img = cv_bridge::toCvShare(depth_img_msg)->image;
       //const cv::Mat& depth_float_img_big = cv_bridge::toCvShare(depth_img_msg)->image;
-      cv::Mat visual_img =  cv_bridge::toCvCopy(visual_img_msg)->image;
+      cv::Mat visual_img =  cv_bridge::toCvShare(visual_img_msg)->image;
       //const cv::Mat& visual_img_big =  cv_bridge::toCvShare(visual_img_msg)->image;
       //cv::Mat visual_img, depth_float_img;
       //cv::resize(visual_img_big, visual_img, cv::Size(), 0.25, 0.25);
@@ -410,29 +728,30 @@ void OpenNIListener::noCloudCallback (const sensor_msgs::ImageConstPtr& visual_i
         ROS_ERROR("depth and visual image differ in size! Ignoring Data");
         return;
       }
-      depthToCV8UC1(depth_float_img, depth_mono8_img_); //float can't be visualized or used as mask in float format TODO: reprogram keypoint detector to use float values with nan to mask
+      convertDepth(depth_float_img, depth_mono8_img_); //float can't be visualized or used as mask in float format TODO: reprogram keypoint detector to use float values with nan to mask
       image_encoding_ = visual_img_msg->encoding;
-      Q_EMIT newVisualImage(cvMat2QImage(visual_img, 0)); //visual_idx=0
-      Q_EMIT newDepthImage (cvMat2QImage(depth_mono8_img_,1));//overwrites last cvMat2QImage
+      publishSensorImages(visual_img, depth_mono8_img_, tracked_msgs);
     }
     return;
   }
 
 
   //Convert images to OpenCV format
-  //sensor_msgs::CvBridge bridge;
-  //cv::Mat depth_float_img = bridge.imgMsgToCv(depth_img_msg);
-  //cv::Mat visual_img =  bridge.imgMsgToCv(visual_img_msg);
-  cv::Mat depth_float_img = cv_bridge::toCvCopy(depth_img_msg)->image;
+  //The cv::Mats share the data of the messages. The messages are kept alive 
+  //by tracked_msgs as long as the frame is processed. Data which is mutated later
+  //(e.g. by drawing the feature flow) is copied at that place.
+  MessageTracker tracked_msgs;
+  tracked_msgs.push_back(depth_img_msg);
+  cv::Mat depth_float_img = cv_bridge::toCvShare(depth_img_msg)->image;
   //const cv::Mat& depth_float_img_big = cv_bridge::toCvShare(depth_img_msg)->image;
   cv::Mat visual_img;
   if(image_encoding_ == "bayer_grbg8"){
-    cv_bridge::toCvShare(visual_img_msg);
     ROS_INFO("Converting from Bayer to RGB");
-    cv::cvtColor(cv_bridge::toCvCopy(visual_img_msg)->image, visual_img, CV_BayerGR2RGB, 3);
+    cv::cvtColor(cv_bridge::toCvShare(visual_img_msg)->image, visual_img, CV_BayerGR2RGB, 3);
   } else{
     ROS_DEBUG_STREAM("Encoding: " << visual_img_msg->encoding);
-    visual_img =  cv_bridge::toCvCopy(visual_img_msg)->image;
+    visual_img =  cv_bridge::toCvShare(visual_img_msg)->image;
+    tracked_msgs.push_back(visual_img_msg);
   }
   //const cv::Mat& visual_img_big =  cv_bridge::toCvShare(visual_img_msg)->image;
   //cv::Size newsize(320, 240);
@@ -446,7 +765,7 @@ void OpenNIListener::noCloudCallback (const sensor_msgs::ImageConstPtr& visual_i
   }
   image_encoding_ = visual_img_msg->encoding;
 
-  depthToCV8UC1(depth_float_img, depth_mono8_img_); //float can't be visualized or used as mask in float format TODO: reprogram keypoint detector to use float values with nan to mask
+  convertDepth(depth_float_img, depth_mono8_img_); //float can't be visualized or used as mask in float format TODO: reprogram keypoint detector to use float values with nan to mask
 
   if(asyncFrameDrop(depth_img_msg->header.stamp, visual_img_msg->header.stamp)) 
     return;
@@ -459,13 +778,12 @@ void OpenNIListener::noCloudCallback (const sensor_msgs::ImageConstPtr& visual_i
      bagfile_mutex.unlock();
   }
 
-  if(ps->get<bool>("use_gui")){
-    Q_EMIT newVisualImage(cvMat2QImage(visual_img, 0)); //visual_idx=0
-    Q_EMIT newDepthImage (cvMat2QImage(depth_mono8_img_,1));//overwrites last cvMat2QImage
+  if(guiImageDue(SIGNAL(newVisualImage(QImage)), last_sensor_image_time_)){
+    publishSensorImages(visual_img, depth_mono8_img_, tracked_msgs);
   }
   if(pause_ && !getOneFrame_) return;
 
-  noCloudCameraCallback(visual_img, depth_float_img, depth_mono8_img_, depth_img_msg->header, cam_info_msg);
+  noCloudCameraCallback(visual_img, depth_float_img, depth_mono8_img_, depth_img_msg->header, cam_info_msg, tracked_msgs);
 }
 
 
@@ -485,11 +803,15 @@ void OpenNIListener::kinectCallback (const sensor_msgs::ImageConstPtr& visual_im
   { 
   // If only a subset of frames are used, skip computations but visualize if gui is running
     ROS_INFO_THROTTLE(1, "Skipping Frame %i because of data_skip_step setting (this msg is only shown once a sec)", data_id_);
-    if(ps->get<bool>("use_gui")){//Show the image, even if not using it
+    if(guiImageDue(SIGNAL(newVisualImage(QImage)), last_sensor_image_time_)){//Show the image, even if not using it
       //sensor_msgs::CvBridge bridge;
-      cv::Mat depth_float_img = cv_bridge::toCvCopy(depth_img_msg)->image;
+      //The shared data is only read (convertDepth does not modify it)
+      MessageTracker tracked_msgs;
+      tracked_msgs.push_back(depth_img_msg);
+      tracked_msgs.push_back(visual_img_msg);
+      cv::Mat depth_float_img = cv_bridge::toCvShare(depth_img_msg)->image;
       //const cv::Mat& depth_float_img_big = cv_bridge::toCvShare(depth_img_msg)->image;
-      cv::Mat visual_img =  cv_bridge::toCvCopy(visual_img_msg)->image;
+      cv::Mat visual_img =  cv_bridge::toCvShare(visual_img_msg)->image;
       //const cv::Mat& visual_img_big =  cv_bridge::toCvShare(visual_img_msg)->image;
       //cv::Mat visual_img, depth_float_img;
       //cv::resize(visual_img_big, visual_img, cv::Size(), 0.25, 0.25);
@@ -499,20 +821,19 @@ void OpenNIListener::kinectCallback (const sensor_msgs::ImageConstPtr& visual_im
         ROS_ERROR("depth and visual image differ in size! Ignoring Data");
         return;
       }
-      depthToCV8UC1(depth_float_img, depth_mono8_img_); //float can't be visualized or used as mask in float format TODO: reprogram keypoint detector to use float values with nan to mask
+      convertDepth(depth_float_img, depth_mono8_img_); //float can't be visualized or used as mask in float format TODO: reprogram keypoint detector to use float values with nan to mask
       image_encoding_ = visual_img_msg->encoding;
-      Q_EMIT newVisualImage(cvMat2QImage(visual_img, 0)); //visual_idx=0
-      Q_EMIT newDepthImage (cvMat2QImage(depth_mono8_img_,1));//overwrites last cvMat2QImage
+      publishSensorImages(visual_img, depth_mono8_img_, tracked_msgs);
     }
     return;
   }
 
-  //Get images into OpenCV format
-  //sensor_msgs::CvBridge bridge;
-  //cv::Mat depth_float_img = bridge.imgMsgToCv(depth_img_msg);
-  //cv::Mat visual_img =  bridge.imgMsgToCv(visual_img_msg);
-  cv::Mat depth_float_img = cv_bridge::toCvCopy(depth_img_msg)->image;
-  cv::Mat visual_img =  cv_bridge::toCvCopy(visual_img_msg)->image;
+  //Get images into OpenCV format, sharing the data of the messages (see noCloudCallback)
+  MessageTracker tracked_msgs;
+  tracked_msgs.push_back(depth_img_msg);
+  tracked_msgs.push_back(visual_img_msg);
+  cv::Mat depth_float_img = cv_bridge::toCvShare(depth_img_msg)->image;
+  cv::Mat visual_img =  cv_bridge::toCvShare(visual_img_msg)->image;
   if(visual_img.rows != depth_float_img.rows || 
      visual_img.cols != depth_float_img.cols ||
      point_cloud->width != (uint32_t) visual_img.cols ||
@@ -521,7 +842,7 @@ void OpenNIListener::kinectCallback (const sensor_msgs::ImageConstPtr& visual_im
     return;
   }
   image_encoding_ = visual_img_msg->encoding;
-  depthToCV8UC1(depth_float_img, depth_mono8_img_); //float can't be visualized or used as mask in float format TODO: reprogram keypoint detector to use float values with nan to mask
+  convertDepth(depth_float_img, depth_mono8_img_); //float can't be visualized or used as mask in float format TODO: reprogram keypoint detector to use float values with nan to mask
 
   if(asyncFrameDrop(depth_img_msg->header.stamp, visual_img_msg->header.stamp)) 
     return;
@@ -535,36 +856,35 @@ void OpenNIListener::kinectCallback (const sensor_msgs::ImageConstPtr& visual_im
      bagfile_mutex.unlock();
   }
 
-  if(ParameterServer::instance()->get<bool>("use_gui")){
-    Q_EMIT newVisualImage(cvMat2QImage(visual_img, 0)); //visual_idx=0
-    Q_EMIT newDepthImage (cvMat2QImage(depth_mono8_img_,1));//overwrites last cvMat2QImage
+  if(guiImageDue(SIGNAL(newVisualImage(QImage)), last_sensor_image_time_)){
+    publishSensorImages(visual_img, depth_mono8_img_, tracked_msgs);
   }
 
   if(pause_ && !getOneFrame_) { return; }//Visualization and nothing else
 
-  pointcloud_type::Ptr pc_col(new pointcloud_type());//will belong to node
-  pcl::fromROSMsg(*point_cloud,*pc_col);
-  cameraCallback(visual_img, pc_col, depth_mono8_img_);
+  cameraCallback(visual_img, point_cloud, depth_mono8_img_, tracked_msgs);
 }
 
 
 
 
 void OpenNIListener::cameraCallback(cv::Mat visual_img, 
-                                    pointcloud_type::Ptr point_cloud, 
-                                    cv::Mat depth_mono8_img)
+                                    const sensor_msgs::PointCloud2ConstPtr& point_cloud, 
+                                    cv::Mat depth_mono8_img,
+                                    const MessageTracker& tracked_msgs)
 {
   ScopedTimer s(__FUNCTION__);
   ROS_WARN_COND(point_cloud ==NULL, "Nullpointer for pointcloud");
   if(getOneFrame_) { getOneFrame_ = false; }//if getOneFrame_ is set, unset it and skip check for  pause
   else if(pause_) { return; }//Visualization and nothing else
 
-  //######### Main Work: create new node ##############################################################
-  Q_EMIT setGUIStatus("Computing Keypoints and Features");
-  Node* node_ptr = new Node(visual_img, detector_, extractor_, point_cloud, depth_mono8_img);
-
-  retrieveTransformations(pcl_conversions::fromPCL(point_cloud->header), node_ptr);
-  callProcessing(visual_img, node_ptr);
+  FrameData frame;
+  frame.visual_img = visual_img;
+  frame.depth_mono8_img = depth_mono8_img;
+  frame.cloud_msg = point_cloud;
+  frame.depth_header = point_cloud->header;
+  frame.tracked_msgs = tracked_msgs;
+  enqueueFrame(frame);
 }
 
 
@@ -576,7 +896,8 @@ void OpenNIListener::noCloudCameraCallback(cv::Mat visual_img,
                                            cv::Mat depth, 
                                            cv::Mat depth_mono8_img,
                                            std_msgs::Header depth_header,
-                                           const sensor_msgs::CameraInfoConstPtr& cam_info)
+                                           const sensor_msgs::CameraInfoConstPtr& cam_info,
+                                           const MessageTracker& tracked_msgs)
 {
   if(getOneFrame_) { //if getOneFrame_ is set, unset it and skip check for  pause
       getOneFrame_ = false;
@@ -584,75 +905,239 @@ void OpenNIListener::noCloudCameraCallback(cv::Mat visual_img,
     return; 
   }
   ScopedTimer s(__FUNCTION__);
+  FrameData frame;
+  frame.visual_img = visual_img;
+  frame.depth_img = depth;
+  frame.depth_mono8_img = depth_mono8_img;
+  frame.cam_info = cam_info;
+  frame.depth_header = depth_header;
+  frame.tracked_msgs = tracked_msgs;
+  enqueueFrame(frame);
+}
+
+bool OpenNIListener::isStaticFrame(const FrameData& frame)
+{
+  ScopedTimer s(__FUNCTION__);
+  ParameterServer* ps = ParameterServer::instance();
+  cv::Mat intensity_thumb, depth_thumb;
+  computeThumbnails(frame.visual_img, frame.depth_img, intensity_thumb, depth_thumb);
+
+  bool is_static = false;
+  if(!last_intensity_thumb_.empty() && last_intensity_thumb_.size() == intensity_thumb.size()){
+    double intensity_change = cv::norm(intensity_thumb, last_intensity_thumb_, cv::NORM_L1) / intensity_thumb.total();
+    double depth_change = 0.0; //If there is no depth image, decide on the intensity only
+    if(!depth_thumb.empty() && !last_depth_thumb_.empty()){
+      depth_change = meanDepthDifference(depth_thumb, last_depth_thumb_);
+    }
+    is_static = intensity_change < ps->get<double>("static_frame_max_intensity_change") &&
+                depth_change < ps->get<double>("static_frame_max_depth_change");
+    ROS_DEBUG("Change to last accepted frame: intensity %f, depth %f", intensity_change, depth_change);
+  }
+  if(is_static) {
+    static_frames_skipped_++;
+    ROS_INFO_THROTTLE(1, "Skipped static frame. %u frames skipped in total", static_frames_skipped_);
+  } else { //Frame is accepted and becomes the reference
+    last_intensity_thumb_ = intensity_thumb;
+    last_depth_thumb_ = depth_thumb;
+  }
+  return is_static;
+}
+
+void OpenNIListener::enqueueFrame(const FrameData& frame)
+{
+  if(ParameterServer::instance()->get<bool>("skip_static_frames") && isStaticFrame(frame)){
+    return;
+  }
+  if(!pipeline_active_){ //Non-concurrent
+    KeypointBudget* budget = KeypointBudget::instance();
+    if(budget->generation() != detector_generation_){ //Adapt to the new keypoint budget
+      detector_generation_ = budget->generation();
+      detector_ = createDetector(ParameterServer::instance()->get<std::string>("feature_detector_type"));
+    }
+    Node* node_ptr = createNode(frame, detector_, extractor_);
+    callProcessing(frame.visual_img, node_ptr, frame.depth_mono8_img, frame.tracked_msgs);
+    return;
+  }
+  //The callbacks convert the next depth image into depth_mono8_img_. Detach it from the
+  //queued frame, otherwise it would be overwritten in-place
+  depth_mono8_img_ = cv::Mat();
+
+  { QMutexLocker locker(&pipeline_mutex_); ++frames_in_pipeline_; }
+  std::clock_t parallel_wait_time=std::clock();
+  FrameData sequenced_frame = frame;
+  sequenced_frame.sequence = next_frame_sequence_++;
+  FrameData dropped;
+  if(!frame_queue_.push(sequenced_frame, dropped)){
+    ROS_WARN_THROTTLE(1, "Frame pipeline full, dropped frame with stamp %f (%u dropped in total)", dropped.depth_header.stamp.toSec(), frame_queue_.droppedCount());
+    NodeData gap; //Otherwise the graph insertion would wait for the dropped frame forever
+    gap.sequence = dropped.sequence;
+    reorderNode(gap);
+    frameLeftPipeline();
+  }
+  double waiting_time = ( std::clock() - parallel_wait_time ) / (double)CLOCKS_PER_SEC;
+  ROS_INFO_STREAM_COND_NAMED(waiting_time > 0.001, "timings", "waiting time: "<< waiting_time <<"sec"); 
+}
+
+Node* OpenNIListener::createNode(const FrameData& frame, cv::Ptr<cv::FeatureDetector> detector, cv::Ptr<cv::DescriptorExtractor> extractor)
+{
   //######### Main Work: create new node ##############################################################
   Q_EMIT setGUIStatus("Computing Keypoints and Features");
-  Node* node_ptr = new Node(visual_img, depth, depth_mono8_img, cam_info, depth_header, detector_, extractor_);
-
-  retrieveTransformations(depth_header, node_ptr);//Retrieve the transform between the lens and the base-link at capturing time;
+  ScopedTimer s(__FUNCTION__);
+  Node* node_ptr = NULL;
+  if(frame.cloud_msg){
+    pointcloud_type::Ptr pc_col(new pointcloud_type());//will belong to node
+    pcl::fromROSMsg(*frame.cloud_msg, *pc_col);
+    node_ptr = new Node(frame.visual_img, detector, extractor, pc_col, frame.depth_mono8_img);
+  } else {
+    node_ptr = new Node(frame.visual_img, frame.depth_img, frame.depth_mono8_img, frame.cam_info, frame.depth_header, detector, extractor);
+  }
+  if(frame.use_tf){
+    retrieveTransformations(frame.depth_header, node_ptr);//Retrieve the transform between the lens and the base-link at capturing time;
+  } else { //Transformations come with the frame
+    tf::StampedTransform base2points = frame.base2points;
+    node_ptr->setBase2PointsTransform(base2points);
+    if(!frame.ground_truth.frame_id_.empty()){
+      node_ptr->setGroundTruthTransform(frame.ground_truth);
+    }
+  }
+  KeypointBudget::instance()->reportExtraction(s.elapsed(), (int)node_ptr->feature_locations_2d_.size());
+  return node_ptr;
+}
 
-  callProcessing(visual_img, node_ptr);
+void OpenNIListener::nodeConstructionLoop()
+{
+  //Every worker has its own detector and extractor. They keep internal state and are not safe to share
+  ParameterServer* ps = ParameterServer::instance();
+  KeypointBudget* budget = KeypointBudget::instance();
+  unsigned int generation = budget->generation();
+  cv::Ptr<cv::FeatureDetector> detector = createDetector(ps->get<std::string>("feature_detector_type"));
+  cv::Ptr<cv::DescriptorExtractor> extractor = createDescriptorExtractor(ps->get<std::string>("feature_extractor_type"));
+  FrameData frame;
+  while(frame_queue_.pop(frame)){
+    if(budget->generation() != generation){ //Adapt to the new keypoint budget
+      generation = budget->generation();
+      detector = createDetector(ps->get<std::string>("feature_detector_type"));
+    }
+    NodeData data;
+    data.node = createNode(frame, detector, extractor);
+    data.visual_img = frame.visual_img;
+    data.depth_mono8_img = frame.depth_mono8_img;
+    data.tracked_msgs = frame.tracked_msgs;
+    data.sequence = frame.sequence;
+    reorderNode(data);
+  }
 }
 
-//Call function either regularly or as background thread
-void OpenNIListener::callProcessing(cv::Mat visual_img, Node* node_ptr)
+void OpenNIListener::reorderNode(const NodeData& data)
 {
-  std::clock_t parallel_wait_time=std::clock();
-  if(!future_.isFinished()){
-    future_.waitForFinished(); //Wait if GraphManager ist still computing. 
-    ROS_INFO_STREAM_NAMED("timings", "waiting time: "<< ( std::clock() - parallel_wait_time ) / (double)CLOCKS_PER_SEC  <<"sec"); 
-  }
-
-  //update for visualization of the feature flow
-  visualization_img_ = visual_img; //No copy
-  visualization_depth_mono8_img_ = depth_mono8_img_;//No copy
-  //With this define, processNode runs in the background and after finishing visualizes the results
-  //Thus another Callback can be started in the meantime, to create a new node in parallel
-  if(ParameterServer::instance()->get<bool>("concurrent_node_construction")) {
-    ROS_DEBUG("Processing Node in parallel to the construction of the next node");
-    if(ParameterServer::instance()->get<bool>("use_gui")){
-      //visual_img points to the data received in the callback - which might be deallocated after the callback returns. 
-      //This will happen before visualization if processNode is running in background, therefore the data needs to be cloned
-      visualization_img_ = visual_img.clone();
-      visualization_depth_mono8_img_ = depth_mono8_img_.clone();
+  QMutexLocker locker(&reorder_mutex_);
+  reorder_buffer_[data.sequence] = data;
+  //Hand on all nodes whose predecessors have been handed on. The lock is held while
+  //pushing, otherwise two workers could overtake each other at the node queue
+  std::map<unsigned int, NodeData>::iterator it;
+  while((it = reorder_buffer_.find(next_insertion_sequence_)) != reorder_buffer_.end()){
+    NodeData next = it->second;
+    reorder_buffer_.erase(it);
+    ++next_insertion_sequence_;
+    if(next.node != NULL){
+      callProcessing(next.visual_img, next.node, next.depth_mono8_img, next.tracked_msgs);
     }
-    future_ = QtConcurrent::run(this, &OpenNIListener::processNode, node_ptr); 
   }
-  else { //Non-concurrent
-    processNode(node_ptr);//regular function call
+  ROS_DEBUG_COND(!reorder_buffer_.empty(), "%zu constructed nodes wait for their predecessors", reorder_buffer_.size());
+}
+
+//Call function either regularly or in the graph insertion stage
+void OpenNIListener::callProcessing(cv::Mat visual_img, Node* node_ptr, cv::Mat depth_mono8_img, const MessageTracker& tracked_msgs)
+{
+  if(!pipeline_active_) { //Non-concurrent
+    processNode(node_ptr, visual_img, depth_mono8_img, tracked_msgs);//regular function call
+    return;
+  }
+  ROS_DEBUG("Processing Node in parallel to the construction of the next node");
+  NodeData data;
+  data.node = node_ptr;
+  data.visual_img = visual_img;
+  data.depth_mono8_img = depth_mono8_img;
+  data.tracked_msgs = tracked_msgs;
+  NodeData dropped;
+  if(!node_queue_.push(data, dropped)){
+    ROS_WARN_THROTTLE(1, "Graph insertion stage full, dropped node (%u dropped in total)", node_queue_.droppedCount());
+    delete dropped.node;
+    frameLeftPipeline();
+  }
+}
+
+void OpenNIListener::graphInsertionLoop()
+{
+  NodeData data;
+  while(node_queue_.pop(data)){
+    processNode(data.node, data.visual_img, data.depth_mono8_img, data.tracked_msgs);
+    frameLeftPipeline();
   }
 }
 
-void OpenNIListener::processNode(Node* new_node)
+void OpenNIListener::processNode(Node* new_node, cv::Mat visual_img, cv::Mat depth_mono8_img, const MessageTracker& tracked_msgs)
 {
   ScopedTimer s(__FUNCTION__);
   Q_EMIT setGUIStatus("Adding Node to Graph");
   bool has_been_added = graph_mgr_->addNode(new_node);
+  KeypointBudget::instance()->reportMatching(s.elapsed());
 
   //######### Visualization code  #############################################
-  if(ParameterServer::instance()->get<bool>("use_gui")){
+  //The feature flow is drawn here, as it requires the graph. The conversion to QImage is done in the gui image worker
+  if(guiImageDue(SIGNAL(newFeatureFlowImage(QImage)), last_feature_flow_time_)){
+    VisualizationData vis;
+    vis.feature_flow = true;
+    vis.visual_img = visual_img;
+    vis.depth_mono8_img = depth_mono8_img;
+    vis.tracked_msgs = tracked_msgs;
     if(has_been_added){
       if(ParameterServer::instance()->get<bool>("visualize_mono_depth_overlay")){
-        cv::Mat feature_img = cv::Mat::zeros( visualization_img_.rows, visualization_img_.cols, CV_8UC1); 
-        graph_mgr_->drawFeatureFlow(feature_img);
-        Q_EMIT newFeatureFlowImage(cvMat2QImage(visualization_img_,visualization_depth_mono8_img_, feature_img, 2)); //show registration
+        vis.feature_img = cv::Mat::zeros( visual_img.rows, visual_img.cols, CV_8UC1); 
+        graph_mgr_->drawFeatureFlow(vis.feature_img);
       } else {
-        graph_mgr_->drawFeatureFlow(visualization_img_, cv::Scalar(0,0,255), cv::Scalar(0,128,0) );
-        Q_EMIT newFeatureFlowImage(cvMat2QImage(visualization_img_, 2)); //show registration
+        vis.visual_img = visual_img.clone(); //May share the data of the received message
+        graph_mgr_->drawFeatureFlow(vis.visual_img, cv::Scalar(0,0,255), cv::Scalar(0,128,0) );
       }
     } else {
       if(ParameterServer::instance()->get<bool>("visualize_mono_depth_overlay")){
-        cv::Mat feature_img = cv::Mat( visualization_img_.rows, visualization_img_.cols, CV_8UC1); 
-        cv::drawKeypoints(feature_img, new_node->feature_locations_2d_, feature_img, cv::Scalar(155), 5);
-        Q_EMIT newFeatureFlowImage(cvMat2QImage(visualization_img_,visualization_depth_mono8_img_, feature_img, 2)); //show registration
+        vis.feature_img = cv::Mat( visual_img.rows, visual_img.cols, CV_8UC1); 
+        cv::drawKeypoints(vis.feature_img, new_node->feature_locations_2d_, vis.feature_img, cv::Scalar(155), 5);
       } else {
-        cv::drawKeypoints(visualization_img_, new_node->feature_locations_2d_, visualization_img_, cv::Scalar(0, 100,0), 5);
-        Q_EMIT newFeatureFlowImage(cvMat2QImage(visualization_img_, 2)); //show registration
+        vis.visual_img = visual_img.clone(); //May share the data of the received message
+        cv::drawKeypoints(vis.visual_img, new_node->feature_locations_2d_, vis.visual_img, cv::Scalar(0, 100,0), 5);
       }
     }
+    VisualizationData dropped;
+    visualization_queue_.push(vis, dropped); //Dropped visualizations are simply discarded
   }
   if(!has_been_added) delete new_node;
 }
 
+void OpenNIListener::visualizationLoop()
+{
+  //The gui images should not take cpu time from the processing
+  QThread::currentThread()->setPriority(QThread::LowestPriority);
+  VisualizationData vis;
+  while(visualization_queue_.pop(vis)){
+    emitGUIImages(vis);
+  }
+  QThread::currentThread()->setPriority(QThread::NormalPriority); //The thread returns to the pool
+}
+
+void OpenNIListener::emitGUIImages(VisualizationData& vis)
+{
+  ScopedTimer s(__FUNCTION__);
+  if(!vis.feature_flow){
+    Q_EMIT newVisualImage(cvMat2QImage(vis.visual_img, 0)); //visual_idx=0
+    Q_EMIT newDepthImage (cvMat2QImage(vis.depth_mono8_img,1));//overwrites last cvMat2QImage
+  } else if(!vis.feature_img.empty()){
+    Q_EMIT newFeatureFlowImage(cvMat2QImage(vis.visual_img, vis.depth_mono8_img, vis.feature_img, 2)); //show registration
+  } else {
+    Q_EMIT newFeatureFlowImage(cvMat2QImage(vis.visual_img, 2)); //show registration
+  }
+}
+
 
 void OpenNIListener::toggleBagRecording(){
   bagfile_mutex.lock();
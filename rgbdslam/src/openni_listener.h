@@ -30,7 +30,11 @@
 #include "graph_manager.h"
 #include <qtconcurrentrun.h>
 #include <QImage> //for cvMat2QImage not listet here but defined in cpp file
+#include <QWaitCondition>
 #include <rosbag/bag.h>
+#include <rosbag/view.h>
+#include "bounded_queue.h"
+#include <map>
 
 //forward-declare to avoid including tf
 ///\cond
@@ -66,6 +70,52 @@ public:
   }
 };
 
+///Keeps the ros messages alive, whose data is shared by the cv::Mats of a frame (see cv_bridge::toCvShare)
+typedef std::vector<boost::shared_ptr<void const> > MessageTracker;
+
+///Input of the node construction stage of the frame pipeline
+struct FrameData {
+  FrameData() : use_tf(true), sequence(0) {}
+  cv::Mat visual_img;
+  cv::Mat depth_img;                       ///<Empty if the point cloud is given
+  cv::Mat depth_mono8_img;
+  sensor_msgs::PointCloud2ConstPtr cloud_msg; ///<NULL if the cloud is to be computed from depth_img
+  sensor_msgs::CameraInfoConstPtr cam_info;
+  std_msgs::Header depth_header;
+  MessageTracker tracked_msgs;
+  bool use_tf;                             ///<If false, base2points and ground_truth are used instead of looking them up in tf
+  tf::StampedTransform base2points;
+  tf::StampedTransform ground_truth;       ///<Ignored if frame_id_ is empty
+  unsigned int sequence;                   ///<Position in the input stream. Restores the order after the concurrent node construction
+};
+
+///Input of the graph insertion stage of the frame pipeline
+struct NodeData {
+  NodeData() : node(NULL), sequence(0) {}
+  Node* node;                              ///<NULL if the frame has been dropped before node construction
+  cv::Mat visual_img;
+  cv::Mat depth_mono8_img;
+  MessageTracker tracked_msgs;
+  unsigned int sequence;
+};
+
+///Input of the gui image worker: Either the sensor images or a feature flow visualization
+struct VisualizationData {
+  VisualizationData(): feature_flow(false){}
+  bool feature_flow; ///<If false, visual and depth image are emitted as newVisualImage and newDepthImage
+  cv::Mat visual_img;
+  cv::Mat depth_mono8_img;
+  cv::Mat feature_img; ///<If non-empty, visual, depth and feature image are shown as overlay
+  MessageTracker tracked_msgs;
+};
+
+///One deserialized message of a bagfile, handed from the prefetch thread to loadBag
+struct BagMessage {
+  sensor_msgs::Image::ConstPtr rgb_img;
+  sensor_msgs::Image::ConstPtr depth_img;
+  sensor_msgs::CameraInfo::ConstPtr cam_info;
+};
+
 //!Handles most of the ROS-based communication
 
 /** The purpose of this class is to listen to 
@@ -126,7 +176,17 @@ class OpenNIListener : public QObject {
     void stereoCallback(const sensor_msgs::ImageConstPtr& visual_img_msg, const sensor_msgs::PointCloud2ConstPtr& point_cloud);
 
     void loadBag(const std::string &filename);
+    //! Process a directory of the TUM RGB-D benchmark (rgb.txt, depth.txt, groundtruth.txt and PNG images)
+    void loadTUMDataset(const std::string &directory);
   protected:
+    //!Wait until all frames are processed, then optimize and save the results (if batch_processing is set)
+    void finishOfflineProcessing(const std::string& filename, bool eval_landmarks);
+    //!Replay as fast as the pipeline accepts the frames. Buffers all of /tf beforehand and deserializes in a prefetch thread
+    void replayBagOffline(rosbag::Bag& bag, const std::vector<std::string>& topics);
+    //!Insert all transforms of the bagfile into the tf listener
+    void bufferTransforms(rosbag::Bag& bag, const std::string& tf_topic);
+    //!Read the images and camera infos from the view, deserialize them and push them into the queue
+    void prefetchBagMessages(rosbag::View* view, BoundedQueue<BagMessage>* queue);
     //! Create a QImage from one image. 
     ///The QImage stores its data in the rgba_buffers_ indexed by idx (reused/overwritten each call)
     QImage cvMat2QImage(const cv::Mat& image, unsigned int idx); 
@@ -136,21 +196,55 @@ class OpenNIListener : public QObject {
     //!Retrieve the transform between the lens and the base-link at capturing time
     void retrieveTransformations(std_msgs::Header depth_header, Node* node_ptr);
 
-    //!Call processNode either regularly or as background thread
-    void callProcessing(cv::Mat gray_img, Node* node_ptr);
-    //!processNode is called by cameraCallback in a separate thread and after finishing visualizes the results
-    void processNode(Node* new_node);
+    //!Hand the node to the graph insertion stage, or call processNode directly if the pipeline is not active
+    void callProcessing(cv::Mat visual_img, Node* node_ptr, cv::Mat depth_mono8_img, const MessageTracker& tracked_msgs);
+    //!Adds the node to the graph and passes the feature flow on to the visualization
+    void processNode(Node* new_node, cv::Mat visual_img, cv::Mat depth_mono8_img, const MessageTracker& tracked_msgs);
+    //!Convert the images to QImages and emit them. Runs in the gui image worker
+    void emitGUIImages(VisualizationData& vis);
+    //!Whether a viewer is connected to the signal and the last image was published longer than 1/gui_image_rate ago.
+    ///If so, the time of the last publication is updated
+    bool guiImageDue(const char* signal, ros::WallTime& last_publication);
+    //!Hand visual and depth image to the gui image worker. The images must not be modified afterwards
+    void publishSensorImages(const cv::Mat& visual_img, const cv::Mat& depth_mono8_img, const MessageTracker& tracked_msgs);
+    //!Start/stop the low priority thread that converts and emits the images for the gui
+    void startGUIWorker();
+    void stopGUIWorker();
+
+    //!Construct a node from the frame and retrieve its transformations (cloud, features and projection stage)
+    Node* createNode(const FrameData& frame, cv::Ptr<cv::FeatureDetector> detector, cv::Ptr<cv::DescriptorExtractor> extractor);
+    //!Collect the nodes of the construction workers and pass them on to the graph insertion stage in the order of their sequence number.
+    ///Nodes of dropped frames are NULL and only fill the gap in the sequence
+    void reorderNode(const NodeData& data);
+    //!Queue the frame for node construction, or construct and process it directly if the pipeline is not active
+    void enqueueFrame(const FrameData& frame);
+    //!Cheap test, whether the frame hardly differs from the last accepted one (compares downsampled intensity and depth)
+    bool isStaticFrame(const FrameData& frame);
+    //!Start the worker threads of the frame pipeline
+    void startPipeline();
+    //!Close the queues and wait for the worker threads to finish
+    void stopPipeline();
+    //!Block until all frames handed to the pipeline have been inserted into the graph (or dropped)
+    void waitForPipeline();
+    //!Mark a frame as done (processed or dropped)
+    void frameLeftPipeline();
+    //!Worker loops of the pipeline stages. There are node_construction_threads node construction loops
+    void nodeConstructionLoop();
+    void graphInsertionLoop();
+    void visualizationLoop();
 
-    //! common processing 
+    //! common processing. The point cloud is converted in the node construction stage
     void cameraCallback(cv::Mat visual_img, 
-                        pointcloud_type::Ptr point_cloud, 
-                        cv::Mat depth_mono8_img);
+                        const sensor_msgs::PointCloud2ConstPtr& point_cloud, 
+                        cv::Mat depth_mono8_img,
+                        const MessageTracker& tracked_msgs);
     //! as cameraCallback, but create Node without cloud
     void noCloudCameraCallback(cv::Mat visual_img, 
                                cv::Mat depth, 
                                cv::Mat depth_mono8_img,
                                std_msgs::Header depth_header,
-                               const sensor_msgs::CameraInfoConstPtr& cam_info);
+                               const sensor_msgs::CameraInfoConstPtr& cam_info,
+                               const MessageTracker& tracked_msgs);
     ///The GraphManager uses the Node objects to do the actual SLAM
     ///Public, s.t. the qt signals can be connected to by the holder of the OpenNIListener
     GraphManager* graph_mgr_;
@@ -158,6 +252,8 @@ class OpenNIListener : public QObject {
     //Variables
     cv::Ptr<cv::FeatureDetector> detector_;
     cv::Ptr<cv::DescriptorExtractor> extractor_;
+    ///KeypointBudget::generation() at the creation of detector_
+    unsigned int detector_generation_;
 
     message_filters::Synchronizer<StereoSyncPolicy>* stereo_sync_;
     message_filters::Synchronizer<KinectSyncPolicy>* kinect_sync_;
@@ -172,11 +268,36 @@ class OpenNIListener : public QObject {
     BagSubscriber<sensor_msgs::CameraInfo>* cam_info_sub_;
 
     cv::Mat depth_mono8_img_;
-    ///The depth mono img is stored here for visualization purposes
-    cv::Mat visualization_depth_mono8_img_;
-    ///The visual img is stored here for visualization purposes here
-    cv::Mat visualization_img_;
     std::vector<cv::Mat> rgba_buffers_;
+
+    ///Frame pipeline: decode (ros callbacks) -> node construction -> graph insertion
+    bool pipeline_active_;
+    BoundedQueue<FrameData> frame_queue_;
+    BoundedQueue<NodeData> node_queue_;
+    std::vector<QFuture<void> > node_construction_futures_;
+    QFuture<void> graph_insertion_future_;
+    ///The node construction workers finish in arbitrary order. Early nodes wait here for their predecessors
+    std::map<unsigned int, NodeData> reorder_buffer_;
+    unsigned int next_frame_sequence_;
+    unsigned int next_insertion_sequence_;
+    QMutex reorder_mutex_;
+    ///Number of frames that have been handed to the pipeline and are not yet in the graph
+    int frames_in_pipeline_;
+    QMutex pipeline_mutex_;
+    QWaitCondition pipeline_idle_;
+
+    ///Thumbnails of the last frame accepted by isStaticFrame
+    cv::Mat last_intensity_thumb_;
+    cv::Mat last_depth_thumb_;
+    unsigned int static_frames_skipped_;
+
+    ///Gui images are converted to QImages in a low priority worker, at most gui_image_rate times per second
+    bool gui_worker_active_;
+    BoundedQueue<VisualizationData> visualization_queue_;
+    QFuture<void> visualization_future_;
+    ros::WallTime last_sensor_image_time_;
+    ros::WallTime last_feature_flow_time_;
+    QMutex gui_rate_mutex_;
     
     rosbag::Bag bag;
     bool save_bag_file;
@@ -186,7 +307,6 @@ class OpenNIListener : public QObject {
     bool pause_;
     bool getOneFrame_;
     bool first_frame_;
-    QFuture<void> future_;
     QMutex bagfile_mutex;
     tf::TransformListener* tflistener_; //!this being a pointer saves the include (using the above forward declaration)
     tf::TransformBroadcaster tf_br_;
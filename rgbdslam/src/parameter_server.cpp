@@ -31,7 +31,18 @@ void ParameterServer::defaultConfig() {
   addOption("subscriber_queue_size",         static_cast<int> (4),                      "Cache incoming data (carefully, RGB-D Clouds are 10MB each)");
   addOption("drop_async_frames",             static_cast<bool> (false),                 "Check timestamps of depth and visual image, reject if not in sync ");
   addOption("depth_scaling_factor",          static_cast<double> (1.0),                 "Some kinects have a wrongly scaled depth");
+  addOption("depth_as_uint16",               static_cast<bool> (false),                 "Keep the depth images of queued frames and nodes as 16 bit millimeter instead of 32 bit float meter. Halves the depth memory, resolution is limited to 1mm.");
   addOption("bagfile_name",                  std::string(""),                           "Read data from a bagfile, make sure to enter the right topics above");
+  addOption("bagfile_offline_replay",        static_cast<bool> (false),                 "Process the bagfile as fast as possible: Buffer all of /tf before processing, deserialize messages in a background thread and never drop frames in the pipeline (see pipeline_backpressure). /tf is not republished.");
+  addOption("tum_dataset_dir",               std::string(""),                           "Read data directly from a directory of the TUM RGB-D benchmark (rgb.txt, depth.txt, groundtruth.txt and the PNG images). Ignored if bagfile_name is given");
+  addOption("dataset_prefetch_size",         static_cast<int> (8),                      "Number of frames of tum_dataset_dir to decode ahead of processing (in parallel)");
+  addOption("tum_dataset_fx",                static_cast<double> (525.0),               "Focal length (horizontal) of the camera of tum_dataset_dir. The default is the one recommended by the benchmark. depth_camera_fx takes precedence");
+  addOption("tum_dataset_fy",                static_cast<double> (525.0),               "Focal length (vertical) of the camera of tum_dataset_dir. depth_camera_fy takes precedence");
+  addOption("tum_dataset_cx",                static_cast<double> (319.5),               "Horizontal image center of the camera of tum_dataset_dir. depth_camera_cx takes precedence");
+  addOption("tum_dataset_cy",                static_cast<double> (239.5),               "Vertical image center of the camera of tum_dataset_dir. depth_camera_cy takes precedence");
+  addOption("tum_dataset_frame_id",          std::string("/openni_rgb_optical_frame"),  "Frame id of the images of tum_dataset_dir");
+  addOption("tum_dataset_camera_frame",      std::string("/openni_camera"),             "Frame of the ground truth poses of tum_dataset_dir (child frame of ground_truth_frame_name)");
+  addOption("bagfile_prefetch_size",         static_cast<int> (30),                     "Number of messages to deserialize ahead of processing in bagfile_offline_replay");
   addOption("data_skip_step",                static_cast<int> (1),                      "Skip every n-th frame completely  ");
   addOption("cloud_creation_skip_step",      static_cast<int> (1),                      "Downsampling factor (rows and colums, so size reduction is quadratic) for the point cloud. Only active if cloud is computed (i.e. \"topic_points\" is empty. This value multiplies to emm__skip_step and visualization_skip_step.");
   addOption("maximum_depth",                 static_cast<double> (dInf),                "Clip far points when reconstructing the cloud. In meter.");
@@ -45,6 +56,8 @@ void ParameterServer::defaultConfig() {
 
   // Output data settings
   addOption("store_pointclouds",             static_cast<bool> (true),                  "If the point clouds are not needed online, setting this to false saves lots of memory ");
+  addOption("lazy_point_clouds",             static_cast<bool> (false),                 "Instead of the point cloud, nodes store the depth (16 bit) and color image and compute the cloud when it is needed (ICP, octomap, 3D view, saving). Only for depth image input");
+  addOption("lazy_cloud_cache_size",         static_cast<int> (8),                      "Number of point clouds computed for lazy_point_clouds that are kept in memory");
   addOption("individual_cloud_out_topic",    std::string("/rgbdslam/batch_clouds"),     "Use this topic when sending the individual clouds with the computed transforms, e.g. for octomap_server");
   addOption("aggregate_cloud_out_topic",     std::string("/rgbdslam/aggregate_clouds"), "Use this topic when sending the all points in one big registered cloud");
   addOption("send_clouds_rate",              static_cast<double> (5),                   "When sending the point clouds (e.g. to RVIZ or Octomap Server) limit sending to this many clouds per second");
@@ -86,23 +99,36 @@ void ParameterServer::defaultConfig() {
   // Visual Features, to activate GPU-based features see CMakeLists.txt 
   addOption("feature_detector_type",         std::string("SURF"),                       "SURF, SIFT or ORB");
   addOption("feature_extractor_type",        std::string("SURF"),                       "SURF, SIFT or ORB");
-  addOption("matcher_type",                  std::string("FLANN"),                      "SIFTGPU or FLANN or BRUTEFORCE");
+  addOption("matcher_type",                  std::string("FLANN"),                      "SIFTGPU or FLANN or BRUTEFORCE or HAMMING (popcount brute force matcher for binary descriptors, e.g. ORB) or L2 (SIMD brute force matcher for float descriptors, e.g. SURF or SIFT, honors sufficient_matches)");
   addOption("max_keypoints",                 static_cast<int> (1000),                   "Extract no more than this many keypoints ");
   addOption("min_keypoints",                 static_cast<int> (000),                    "Extract no less than this many keypoints ");
+  addOption("frame_latency_target",          static_cast<double> (0.0),                 "Adapt the keypoint budget (max_keypoints, min_keypoints) and the detector threshold at runtime, s.t. feature extraction and matching of a frame take about this many seconds. Zero disables the adaptation");
+  addOption("keypoint_budget_min",           static_cast<int> (100),                    "With frame_latency_target, never reduce max_keypoints below this value");
+  addOption("keypoint_budget_max",           static_cast<int> (3000),                   "With frame_latency_target, never increase max_keypoints beyond this value");
+  addOption("detector_grid_rows",            static_cast<int> (1),                      "Split the image into a grid of detector_grid_rows x detector_grid_cols cells and detect features in each cell in parallel, with an equal share of max_keypoints. Spreads the features over the image. 1x1 disables the grid. Not used for SIFTGPU");
+  addOption("detector_grid_cols",            static_cast<int> (1),                      "See detector_grid_rows");
   addOption("min_matches",                   static_cast<int> (20),                     "Don't try RANSAC if less than this many matches (if using SiftGPU and GLSL you should use max. 60 matches)");
   addOption("sufficient_matches",            static_cast<int> (1e9),                    "Extract no less than this many only honored by the adjustable SURF and FAST features");
   addOption("adjuster_max_iterations",       static_cast<int> (10),                     "If outside of bounds for max_kp and min_kp, retry this many times with adapted threshold");
   addOption("use_feature_min_depth",         static_cast<bool>(false),                   "Consider the nearest point in the neighborhood of the feature as its depth, as it will dominate the motion");
   addOption("use_feature_mask",              static_cast<bool>(false),                  "Whether to extract features without depth");
   addOption("use_root_sift",                 static_cast<bool>(true),                   "Whether to use euclidean distance or Hellman kernel for feature comparison");
+  addOption("guided_matching",               static_cast<bool>(false),                  "Match a new node against its predecessor only within guided_matching_radius of the feature positions predicted by the previous motion (constant velocity). Falls back to global matching, if no valid transformation is found this way");
+  addOption("guided_matching_radius",        static_cast<double> (0.05),                "Search radius of guided_matching in normalized image coordinates (pixel distance divided by the focal length), i.e. about 25 pixels for a focal length of 525");
+  addOption("quantize_descriptors",          static_cast<bool>(false),                  "Store float descriptors (SURF, SIFT, RootSIFT) with 8 bit per component and a scale per descriptor. Needs a quarter of the memory. BRUTEFORCE matching then uses an integer brute force matcher on the quantized descriptors. FLANN becomes this brute force matcher as well: no kd-tree is built, since it would need a float copy of the descriptors. Not used for the SIFTGPU matcher");
 
   // Frontend settings 
+  addOption("skip_static_frames",            static_cast<bool> (false),                 "Compare downsampled intensity and depth of a new frame to the last accepted frame and skip it before any feature computation if both changed less than the thresholds below");
+  addOption("static_frame_max_intensity_change", static_cast<double> (2.0),             "Mean absolute change of the (downsampled) gray values below which a frame is considered static");
+  addOption("static_frame_max_depth_change", static_cast<double> (0.01),                "Mean absolute change of the (downsampled) depth in meter below which a frame is considered static");
   addOption("max_translation_meter",         static_cast<double> (1e10),                "Sanity check for smooth motion.");
   addOption("max_rotation_degree",           static_cast<int> (360),                    "Sanity check for smooth motion.");
   addOption("min_translation_meter",         static_cast<double> (0.05),                "Frames with motion less than this, will be omitted ");
   addOption("min_rotation_degree",           static_cast<double> (2.5),                 "Frames with motion less than this, will be omitted ");
   addOption("max_dist_for_inliers",          static_cast<double> (3),                   "Mahalanobis distance for matches to be considered inliers by ransac");
   addOption("ransac_iterations",             static_cast<int> (100),                    "These are fast, so high values are ok ");
+  addOption("ransac_confidence",             static_cast<double> (0.0),                 "If in (0,1): draw the RANSAC samples from the best matches first (PROSAC) and stop as soon as an outlier free sample has been drawn with this probability, given the inlier ratio of the best hypothesis. At most 'ransac_iterations'. Zero disables this");
+  addOption("ransac_threads",                static_cast<int> (0),                      "Threads evaluating the RANSAC hypotheses of one comparison. Zero: share the cores among the concurrent comparisons. One: sequential");
   addOption("ransac_termination_inlier_pct", static_cast<double> (60.0),                "Percentage of matches that need to be inliers to succesfully terminate ransac before the 'ransac_iterations' have been reached");
   addOption("g2o_transformation_refinement", static_cast<int> (0),                      "Use g2o to refine the ransac result for that many iterations, i.e. optimize the Mahalanobis distance in a final step. Use zero to disable.");
   addOption("max_connections",               static_cast<int> (-1),                     "Stop frame comparisons after this many succesfully found spation relations. Negative value: No limit.");
@@ -130,6 +156,7 @@ void ParameterServer::defaultConfig() {
   addOption("use_gui",                       static_cast<bool> (true),                  "GUI vs Headless Mode");
   addOption("glwidget_without_clouds",       static_cast<bool> (false),                 "3D view should only display the graph");
   addOption("visualize_mono_depth_overlay",  static_cast<bool> (false),                 "Show Depth and Monochrome image as overlay in featureflow");
+  addOption("gui_image_rate",                static_cast<double> (10.0),                "Maximum rate (Hz) at which the 2D images in the gui are updated. Non-positive values show every frame.");
   addOption("visualization_skip_step",       static_cast<int> (1),                      "Draw only every nth pointcloud row and line, high values require higher squared_meshing_threshold ");
   addOption("visualize_keyframes_only",      static_cast<bool> (false),                 "Do not render point cloud of non-keyframes.");
   addOption("fast_rendering_step",           static_cast<int> (1),                      "Draw only every nth pointcloud during user interaction");
@@ -146,7 +173,14 @@ void ParameterServer::defaultConfig() {
   addOption("start_paused",                  static_cast<bool> (true),                  "Whether to directly start mapping with the first input image, or to wait for the user to start manually");
   addOption("batch_processing",              static_cast<bool> (false),                 "Store results and close after bagfile has been processed");
   addOption("concurrent_node_construction",  static_cast<bool> (true),                  "Detect+extract features for new frame, while current frame is inserted into graph ");
+  addOption("node_construction_threads",     static_cast<int> (1),                      "With concurrent_node_construction, construct this many nodes at the same time. Each thread has its own feature detector and extractor. The nodes are inserted into the graph in the order of the frames");
+  addOption("pipeline_queue_depth",          static_cast<int> (2),                      "With concurrent_node_construction, this many frames may wait in front of each stage of the frame pipeline (node construction, graph insertion, visualization)");
+  addOption("pipeline_backpressure",         std::string("block"),                      "What to do if a stage of the frame pipeline is full: block (drop nothing), drop_oldest (discard the oldest waiting frame) or drop_newest (discard the incoming frame)");
+  addOption("pipeline_visualization_backpressure", std::string("drop_oldest"),          "As pipeline_backpressure, but for the visualization stage");
+  addOption("batch_matching",                static_cast<bool> (false),                 "Match the features of a new node against all comparison candidates in one brute force pass over its features, instead of one matcher call per candidate. Always exhaustive and without the sufficient_matches early exit, so the matches may differ from those of the configured matcher_type (e.g. the approximate FLANN matcher). Not used for SIFTGPU");
   addOption("concurrent_edge_construction",  static_cast<bool> (true),                  "Compare current frame to many predecessors in parallel. Note that SIFTGPU matcher and GICP are mutex'ed for thread-safety");
+  addOption("deterministic",                 static_cast<bool> (false),                 "Reproducible runs: identical input and parameters give an identical graph. All random numbers derive from random_seed, RANSAC runs in one thread per comparison, the graph is optimized in the calling thread, frames are never dropped, the keypoint budget is not adapted to the timing and max_connections is disabled. The FLANN matcher_type is replaced by BRUTEFORCE, since its randomized kd-trees are not reproducible. Concurrent node and edge construction stay enabled, their results are inserted in a fixed order");
+  addOption("random_seed",                   static_cast<int> (0),                      "Seed of all random number streams (feature matching, RANSAC, edge candidate sampling) in deterministic mode");
   addOption("concurrent_io",                 static_cast<bool> (true),                  "Whether saving/sending should be done in background threads.");
   addOption("voxelfilter_size",              static_cast<double> (-1.0),                "In meter voxefilter displayed and stored pointclouds, useful to reduce the time for, e.g., octomap generation. Set negative to disable");
   addOption("nn_distance_ratio",             static_cast<double> (0.6),                 "Feature correspondence is valid if distance to nearest neighbour is smaller than this parameter times the distance to the 2nd neighbour. This needs to be 0.9-1.0 for SIFTGPU w/ FLANN, since SIFTGPU Features are normalized");
@@ -216,6 +250,76 @@ void ParameterServer::checkValues() {
         ROS_WARN("Cannot use concurrent node construction with SiftGPU matcher! 'concurrent_node_construction' was set to false. Everything should work fine, but the CPU-threading won't happen (because you are using the GPU instead).");
     }
 
+    const char* policy_params[] = {"pipeline_backpressure", "pipeline_visualization_backpressure"};
+    for(int i = 0; i < 2; i++){
+      std::string policy = get<std::string>(policy_params[i]);
+      if(policy != "block" && policy != "drop_oldest" && policy != "drop_newest"){
+        ROS_WARN("Unknown value \"%s\" for '%s'. Using \"block\".", policy.c_str(), policy_params[i]);
+        config[policy_params[i]] = std::string("block");
+      }
+    }
+    if (get<int>("pipeline_queue_depth") < 1) {
+        config["pipeline_queue_depth"] = static_cast<int>(1);
+        ROS_WARN("'pipeline_queue_depth' must be at least one. Set to 1.");
+    }
+    if (get<std::string>("matcher_type").compare("SIFTGPU") == 0
+            && get<bool>("quantize_descriptors") == true) {
+        config["quantize_descriptors"] = static_cast<bool>(false);
+        ROS_WARN("The SiftGPU matcher needs float descriptors. 'quantize_descriptors' was set to false.");
+    }
+    //ORB is the only extractor with binary descriptors
+    bool binary_descriptors = get<std::string>("feature_extractor_type").compare("ORB") == 0;
+    if (get<std::string>("matcher_type").compare("HAMMING") == 0 && !binary_descriptors) {
+        config["matcher_type"] = std::string("BRUTEFORCE");
+        ROS_WARN("The HAMMING matcher needs binary descriptors, but '%s' extracts float descriptors. 'matcher_type' was set to BRUTEFORCE.", get<std::string>("feature_extractor_type").c_str());
+    }
+    if (get<std::string>("matcher_type").compare("L2") == 0 && binary_descriptors) {
+        config["matcher_type"] = std::string("HAMMING");
+        ROS_WARN("The L2 matcher needs float descriptors, but ORB extracts binary descriptors. 'matcher_type' was set to HAMMING.");
+    }
+    if (get<std::string>("matcher_type").compare("FLANN") == 0
+            && get<bool>("quantize_descriptors") == true) {
+        ROS_WARN("The FLANN matcher matches quantized descriptors by brute force (O(n*m) per node pair). No kd-tree is built for them.");
+    }
+    if (get<int>("keypoint_budget_min") > get<int>("keypoint_budget_max")) {
+        config["keypoint_budget_max"] = static_cast<int>(get<int>("keypoint_budget_min"));
+        ROS_WARN("'keypoint_budget_max' must not be smaller than 'keypoint_budget_min'. Set to %d.", get<int>("keypoint_budget_min"));
+    }
+    if (get<int>("node_construction_threads") < 1) {
+        config["node_construction_threads"] = static_cast<int>(1);
+        ROS_WARN("'node_construction_threads' must be at least one. Set to 1.");
+    }
+
+    if (get<bool>("deterministic")) {
+        //Everything that depends on the timing of the threads
+        if (get<bool>("concurrent_optimization")) {
+            config["concurrent_optimization"] = static_cast<bool>(false);
+            ROS_WARN("Deterministic mode: 'concurrent_optimization' was set to false.");
+        }
+        if (get<int>("ransac_threads") != 1) {
+            config["ransac_threads"] = static_cast<int>(1);
+            ROS_WARN("Deterministic mode: 'ransac_threads' was set to 1.");
+        }
+        if (get<std::string>("pipeline_backpressure") != "block") {
+            config["pipeline_backpressure"] = std::string("block");
+            ROS_WARN("Deterministic mode: 'pipeline_backpressure' was set to \"block\".");
+        }
+        if (get<double>("frame_latency_target") > 0) {
+            config["frame_latency_target"] = static_cast<double>(0.0);
+            ROS_WARN("Deterministic mode: 'frame_latency_target' was set to 0, the keypoint budget would depend on the timing.");
+        }
+        if (get<std::string>("matcher_type") == "FLANN") {
+            //The randomized kd-trees draw from the global rand(), in the order in which the concurrent builds run
+            config["matcher_type"] = std::string("BRUTEFORCE");
+            ROS_WARN("Deterministic mode: 'matcher_type' FLANN was set to BRUTEFORCE, the randomized kd-trees are not reproducible.");
+        }
+        if (get<int>("max_connections") > 0) {
+            //The accepted transformations are counted while the comparisons run concurrently
+            config["max_connections"] = static_cast<int>(-1);
+            ROS_WARN("Deterministic mode: 'max_connections' was set to -1 (no limit).");
+        }
+    }
+
     if (get<double>("voxelfilter_size") > 0 && get<double>("observability_threshold") > 0) {
         ROS_ERROR("You cannot use the voxelfilter (param: voxelfilter_size) in combination with the environment measurement model (param: observability_threshold)");
     }
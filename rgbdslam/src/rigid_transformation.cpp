@@ -0,0 +1,116 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "rigid_transformation.h"
+#include <Eigen/Geometry>
+#include <Eigen/SVD>
+#include <cmath>
+
+RigidTransformationEstimator::RigidTransformationEstimator(float max_dist_m)
+: max_dist_m_(max_dist_m), count_(0)
+{
+}
+
+bool RigidTransformationEstimator::estimate(const FeatureBlock& newer, const FeatureBlock& older,
+                                            const std::vector<cv::DMatch>& matches,
+                                            Eigen::Matrix4f& transformation)
+{
+  count_ = 0;
+  sum_from_.setZero();
+  sum_to_.setZero();
+  sum_cross_.setZero();
+  Eigen::Vector3f previous_from, previous_to;
+  const float max_sqrd_dist_diff = max_dist_m_ * max_dist_m_;
+
+  for(unsigned int i = 0; i < matches.size(); i++)
+  {
+    const int qi = matches[i].queryIdx, ti = matches[i].trainIdx;
+    if(std::isnan(newer.z[qi]) || std::isnan(older.z[ti]))
+      continue;
+    const Eigen::Vector3f from = newer.position3(qi);
+    const Eigen::Vector3f to = older.position3(ti);
+    //Validate that 3D distances are corresponding
+    if(max_dist_m_ > 0 && count_ >= 1){
+      float delta_f = (from - previous_from).squaredNorm();//distance to the previous query point
+      float delta_t = (to   - previous_to).squaredNorm();//distance from one to the next train point
+      if(std::fabs(delta_f - delta_t) > max_sqrd_dist_diff) return false;
+    }
+    previous_from = from;
+    previous_to = to;
+
+    const Eigen::Vector3d f = from.cast<double>(), t = to.cast<double>();
+    if(count_ < 3){
+      from_[count_] = f;
+      to_[count_] = t;
+    }
+    sum_from_ += f;
+    sum_to_ += t;
+    sum_cross_.noalias() += f * t.transpose();
+    count_++;
+  }
+  if(count_ < 3) return false;
+
+  Eigen::Matrix3d rotation;
+  if(count_ > 3 || !estimateThreePoints(rotation)){
+    estimateUmeyama(rotation);
+  }
+  const Eigen::Vector3d translation = (sum_to_ - rotation * sum_from_) / count_;
+
+  transformation.setIdentity();
+  transformation.topLeftCorner<3,3>() = rotation.cast<float>();
+  transformation.topRightCorner<3,1>() = translation.cast<float>();
+  return transformation == transformation; //false if NaN
+}
+
+bool RigidTransformationEstimator::estimateThreePoints(Eigen::Matrix3d& rotation) const
+{
+  const Eigen::Vector3d centroid_from = sum_from_ / 3.0, centroid_to = sum_to_ / 3.0;
+  const Eigen::Vector3d edge_f1 = from_[1] - from_[0], edge_f2 = from_[2] - from_[0];
+  const Eigen::Vector3d edge_t1 = to_[1] - to_[0], edge_t2 = to_[2] - to_[0];
+  Eigen::Vector3d normal_from = edge_f1.cross(edge_f2);
+  Eigen::Vector3d normal_to = edge_t1.cross(edge_t2);
+  //Collinear: the rotation about the line is arbitrary, leave it to the SVD as before
+  const double min_area = 1e-6;
+  if(normal_from.squaredNorm() <= min_area * min_area * edge_f1.squaredNorm() * edge_f2.squaredNorm() ||
+     normal_to.squaredNorm()   <= min_area * min_area * edge_t1.squaredNorm() * edge_t2.squaredNorm())
+    return false;
+  normal_from.normalize();
+  normal_to.normalize();
+
+  //Rotate the plane of the newer triangle onto the plane of the older one...
+  const Eigen::Matrix3d plane_rotation = Eigen::Quaterniond::FromTwoVectors(normal_from, normal_to).toRotationMatrix();
+  //...then the in-plane angle maximizing sum(to_i . R from_i) is the angle of sum(from_i . to_i) + i*sum(n . (from_i x to_i))
+  double cos_sum = 0.0, sin_sum = 0.0;
+  for(int i = 0; i < 3; i++){
+    const Eigen::Vector3d f = plane_rotation * (from_[i] - centroid_from);
+    const Eigen::Vector3d t = to_[i] - centroid_to;
+    cos_sum += f.dot(t);
+    sin_sum += normal_to.dot(f.cross(t));
+  }
+  rotation = Eigen::AngleAxisd(std::atan2(sin_sum, cos_sum), normal_to) * plane_rotation;
+  return true;
+}
+
+void RigidTransformationEstimator::estimateUmeyama(Eigen::Matrix3d& rotation) const
+{
+  //Cross covariance of the centered positions
+  const Eigen::Matrix3d cross_covariance = sum_cross_ - sum_from_ * sum_to_.transpose() / count_;
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(cross_covariance, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Matrix3d& u = svd.matrixU();
+  const Eigen::Matrix3d& v = svd.matrixV();
+  Eigen::Vector3d s(1.0, 1.0, 1.0);
+  if(u.determinant() * v.determinant() < 0) s(2) = -1.0; //a reflection is no rigid transformation
+  rotation = v * s.asDiagonal() * u.transpose();
+}
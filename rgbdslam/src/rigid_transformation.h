@@ -0,0 +1,55 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RGBD_SLAM_RIGID_TRANSFORMATION_H_
+#define RGBD_SLAM_RIGID_TRANSFORMATION_H_
+#include <vector>
+#include <Eigen/Core>
+#include <opencv2/features2d/features2d.hpp>
+#include "feature_block.h"
+
+//!Least squares rigid transformation between matched feature positions, without heap allocations
+/** Used in the RANSAC loop instead of pcl::TransformationFromCorrespondences. Three correspondences
+ *  (the minimal sample) are solved in closed form: the triangle planes are aligned, then the in-plane
+ *  rotation is computed directly (Horn, 1987). More correspondences (the refinement with the inliers)
+ *  are accumulated in one pass and solved by the SVD of the 3x3 cross covariance (Umeyama, 1991).
+ *  All intermediate results are fixed-size members: keep one estimator per thread and reuse it.
+ */
+class RigidTransformationEstimator {
+public:
+  ///See estimate() for max_dist_m. Non-positive values disable the check
+  explicit RigidTransformationEstimator(float max_dist_m = -1.0f);
+
+  ///Transformation from the newer positions (queryIdx) onto the older ones (trainIdx). Matches
+  ///without depth are skipped. Returns false for degenerate samples: if the squared distances between
+  ///consecutive positions differ by more than max_dist_m^2 between the nodes (the correspondences
+  ///can't all be right), if less than three correspondences remain or if the result contains NaN
+  bool estimate(const FeatureBlock& newer, const FeatureBlock& older,
+                const std::vector<cv::DMatch>& matches,
+                Eigen::Matrix4f& transformation);
+
+private:
+  ///Closed form for three correspondences. Returns false if the points are (nearly) collinear
+  bool estimateThreePoints(Eigen::Matrix3d& rotation) const;
+  ///SVD of the accumulated cross covariance
+  void estimateUmeyama(Eigen::Matrix3d& rotation) const;
+
+  float max_dist_m_;
+  unsigned int count_;
+  Eigen::Vector3d from_[3], to_[3]; ///<The first three correspondences, for the closed form
+  Eigen::Vector3d sum_from_, sum_to_;
+  Eigen::Matrix3d sum_cross_;       ///<Sum of from * to^T
+};
+#endif
@@ -0,0 +1,165 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+//Documentation see header file
+#include "tum_dataset.h"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <ros/console.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+//The depth images of the benchmark are scaled by 5000, i.e., a value of 5000 is one meter
+const double TUMDataset::depth_scale = 1.0/5000.0;
+
+TUMDataset::TUMDataset() : max_time_difference(0.02)
+{
+}
+
+bool TUMDataset::readFileList(const std::string& path, std::vector<FileEntry>& entries)
+{
+  std::ifstream file(path.c_str());
+  if(!file.is_open()) return false;
+  std::string line;
+  while(std::getline(file, line)){
+    if(line.empty() || line[0] == '#') continue; //comment
+    std::istringstream fields(line);
+    FileEntry entry;
+    if(fields >> entry.stamp >> entry.filename){
+      entries.push_back(entry);
+    }
+  }
+  std::sort(entries.begin(), entries.end());
+  return true;
+}
+
+bool TUMDataset::readGroundTruth(const std::string& path)
+{
+  std::ifstream file(path.c_str());
+  if(!file.is_open()) return false;
+  std::string line;
+  while(std::getline(file, line)){
+    if(line.empty() || line[0] == '#') continue; //comment
+    std::istringstream fields(line);
+    double t, tx, ty, tz, qx, qy, qz, qw;
+    if(fields >> t >> tx >> ty >> tz >> qx >> qy >> qz >> qw){
+      PoseEntry entry;
+      entry.stamp = t;
+      entry.pose = tf::Transform(tf::Quaternion(qx, qy, qz, qw), tf::Vector3(tx, ty, tz));
+      ground_truth_.push_back(entry);
+    }
+  }
+  return true;
+}
+
+bool TUMDataset::open(const std::string& directory)
+{
+  directory_ = directory;
+  if(!directory_.empty() && directory_[directory_.size()-1] != '/') directory_ += '/';
+  frames_.clear();
+  ground_truth_.clear();
+
+  std::vector<FileEntry> rgb_files, depth_files;
+  if(!readFileList(directory_ + "rgb.txt", rgb_files)){
+    ROS_ERROR("Could not read %srgb.txt", directory_.c_str());
+    return false;
+  }
+  if(!readFileList(directory_ + "depth.txt", depth_files)){
+    ROS_ERROR("Could not read %sdepth.txt", directory_.c_str());
+    return false;
+  }
+  if(!readGroundTruth(directory_ + "groundtruth.txt")){
+    ROS_WARN("No groundtruth.txt in %s", directory_.c_str());
+  }
+
+  //Associate as associate.py of the benchmark: of all pairs closer than max_time_difference, take the
+  //closest ones first, using each image at most once. Both lists are sorted.
+  std::vector<Candidate> candidates;
+  size_t first_depth = 0;
+  for(size_t r = 0; r < rgb_files.size(); r++){
+    const double t = rgb_files[r].stamp;
+    while(first_depth < depth_files.size() && depth_files[first_depth].stamp <= t - max_time_difference) first_depth++;
+    for(size_t d = first_depth; d < depth_files.size() && depth_files[d].stamp < t + max_time_difference; d++){
+      Candidate c;
+      c.difference = std::fabs(depth_files[d].stamp - t);
+      c.rgb = r;
+      c.depth = d;
+      candidates.push_back(c);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+  std::vector<bool> rgb_used(rgb_files.size(), false), depth_used(depth_files.size(), false);
+  std::vector<size_t> depth_of_rgb(rgb_files.size());
+  for(size_t i = 0; i < candidates.size(); i++){
+    const Candidate& c = candidates[i];
+    if(rgb_used[c.rgb] || depth_used[c.depth]) continue;
+    rgb_used[c.rgb] = depth_used[c.depth] = true;
+    depth_of_rgb[c.rgb] = c.depth;
+  }
+  for(size_t r = 0; r < rgb_files.size(); r++){ //In the order of the color images
+    if(!rgb_used[r]) continue;
+    const FileEntry& depth = depth_files[depth_of_rgb[r]];
+    FramePair pair;
+    pair.rgb_stamp = rgb_files[r].stamp;
+    pair.rgb_file = rgb_files[r].filename;
+    pair.depth_stamp = depth.stamp;
+    pair.depth_file = depth.filename;
+    frames_.push_back(pair);
+  }
+  ROS_INFO("Dataset %s: %zu color images, %zu depth images, %zu associated pairs, %zu ground truth poses",
+           directory_.c_str(), rgb_files.size(), depth_files.size(), frames_.size(), ground_truth_.size());
+  return !frames_.empty();
+}
+
+bool TUMDataset::loadFrame(size_t i, cv::Mat& rgb, cv::Mat& depth) const
+{
+  const FramePair& pair = frames_.at(i);
+  cv::Mat bgr = cv::imread(directory_ + pair.rgb_file, CV_LOAD_IMAGE_COLOR);
+  cv::Mat raw_depth = cv::imread(directory_ + pair.depth_file, CV_LOAD_IMAGE_UNCHANGED);
+  if(bgr.empty() || raw_depth.empty() || raw_depth.type() != CV_16UC1){
+    ROS_ERROR("Could not load %s and %s", pair.rgb_file.c_str(), pair.depth_file.c_str());
+    return false;
+  }
+  cv::cvtColor(bgr, rgb, CV_BGR2RGB); //Same encoding as the bagfiles of the benchmark ("rgb8")
+  depth = raw_depth; //Converted together with the mono8 image by convertDepth(depth, mono8, depth_scale)
+  return true;
+}
+
+bool TUMDataset::groundTruth(ros::Time stamp, tf::Transform& pose) const
+{
+  if(ground_truth_.empty()) return false;
+  const double t = stamp.toSec();
+  if(t < ground_truth_.front().stamp || t > ground_truth_.back().stamp) return false;
+
+  //First entry with a stamp not less than t
+  size_t upper = 0, count = ground_truth_.size();
+  while(count > 0){ //binary search
+    size_t step = count / 2;
+    if(ground_truth_[upper + step].stamp < t){ upper += step + 1; count -= step + 1; }
+    else { count = step; }
+  }
+  size_t lower = upper > 0 ? upper - 1 : 0;
+  const PoseEntry& a = ground_truth_[lower];
+  const PoseEntry& b = ground_truth_[upper];
+  const double dt = b.stamp - a.stamp;
+  if(dt > 0.1) return false; //Gap in the motion capture data
+  const double ratio = dt > 0.0 ? (t - a.stamp) / dt : 0.0;
+
+  pose.setOrigin(a.pose.getOrigin().lerp(b.pose.getOrigin(), ratio));
+  pose.setRotation(a.pose.getRotation().slerp(b.pose.getRotation(), ratio));
+  return true;
+}
@@ -0,0 +1,85 @@
+/* This file is part of RGBDSLAM.
+ *
+ * RGBDSLAM is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RGBDSLAM is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RGBDSLAM.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef RGBDSLAM_TUM_DATASET_H_
+#define RGBDSLAM_TUM_DATASET_H_
+#include <string>
+#include <vector>
+#include <ros/time.h>
+#include <tf/transform_datatypes.h>
+#include <opencv2/core/core.hpp>
+
+//!Reads a sequence of the TUM RGB-D benchmark from its directory layout
+/** The directory needs to contain rgb.txt and depth.txt, listing
+ *  "timestamp filename" per line, and the referenced PNG files.
+ *  groundtruth.txt ("timestamp tx ty tz qx qy qz qw") is optional.
+ *  Color and depth images are associated by nearest timestamp, as by associate.py of the benchmark.
+ *  See http://vision.in.tum.de/data/datasets/rgbd-dataset/file_formats
+ */
+class TUMDataset {
+public:
+  TUMDataset();
+  ///Parse the file lists. Returns false if rgb.txt or depth.txt can't be read
+  bool open(const std::string& directory);
+  ///Number of associated color/depth pairs
+  size_t size() const { return frames_.size(); }
+  ros::Time rgbStamp(size_t i) const { return ros::Time(frames_[i].rgb_stamp); }
+  ros::Time depthStamp(size_t i) const { return ros::Time(frames_[i].depth_stamp); }
+
+  ///Load and decode the images of the i-th pair. Can be called concurrently.
+  ///rgb is CV_8UC3 in rgb order, depth is the raw CV_16UC1 image in units of depth_scale (0 for missing values)
+  bool loadFrame(size_t i, cv::Mat& rgb, cv::Mat& depth) const;
+
+  ///Interpolate the ground truth pose of the color camera at the given time.
+  ///Returns false if no ground truth is available for this time.
+  bool groundTruth(ros::Time stamp, tf::Transform& pose) const;
+
+  ///Maximum time difference of associated color and depth image in seconds (exclusive)
+  double max_time_difference;
+  ///Factor from the stored 16 bit depth values to meter
+  static const double depth_scale;
+
+private:
+  struct FileEntry {
+    double stamp;
+    std::string filename;
+    bool operator<(const FileEntry& other) const { return stamp < other.stamp; }
+  };
+  struct FramePair {
+    double rgb_stamp, depth_stamp;
+    std::string rgb_file, depth_file;
+  };
+  ///Pair of color and depth image within max_time_difference, ordered as associate.py: closest first
+  struct Candidate {
+    double difference;
+    size_t rgb, depth;
+    bool operator<(const Candidate& other) const {
+      if(difference != other.difference) return difference < other.difference;
+      return rgb != other.rgb ? rgb < other.rgb : depth < other.depth;
+    }
+  };
+  struct PoseEntry {
+    double stamp;
+    tf::Transform pose;
+  };
+  static bool readFileList(const std::string& path, std::vector<FileEntry>& entries);
+  bool readGroundTruth(const std::string& path);
+
+  std::string directory_;
+  std::vector<FramePair> frames_;
+  std::vector<PoseEntry> ground_truth_;
+};
+
+#endif